@@ -1,9 +1,10 @@
 #pragma once
 
+#include <cctype>
 #include <string>
 
 
-bool get_argument_flag(std::string flag, int argc, char** argv)
+inline bool get_argument_flag(std::string flag, int argc, char** argv)
 {
 	std::string curr = "";
 
@@ -18,7 +19,7 @@ bool get_argument_flag(std::string flag, int argc, char** argv)
 }
 
 
-std::string get_argument_value(std::string option, int argc, char** argv)
+inline std::string get_argument_value(std::string option, int argc, char** argv)
 {
 	std::string curr = "";
 
@@ -32,3 +33,18 @@ std::string get_argument_value(std::string option, int argc, char** argv)
 	return "Argument error.";
 }
 
+
+// Byte count like 512M, 8G or a plain number of bytes.
+inline size_t parse_bytes(std::string value)
+{
+	size_t pos = 0;
+	double n = std::stod(value, &pos);
+	char unit = pos < value.size() ? (char)toupper(value[pos]) : ' ';
+	switch (unit) {
+	case 'K': n *= 1024.0; break;
+	case 'M': n *= 1024.0 * 1024.0; break;
+	case 'G': n *= 1024.0 * 1024.0 * 1024.0; break;
+	case 'T': n *= 1024.0 * 1024.0 * 1024.0 * 1024.0; break;
+	}
+	return (size_t)n;
+}
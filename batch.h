@@ -0,0 +1,296 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "loader.h"
+#include "log.h"
+#include "thread_pool.h"
+#include "tyler.h"
+
+
+// ----------------------------------------------------------------------------
+// Batch mode.
+//
+// -batch manifest.txt runs many texture sets in one process. Each line of
+// the manifest is one set: its input, its output and any options for it
+// alone.
+//
+//   tex/grass out/grass -sharpness 0.2
+//   "tex/wet rock.exr" out/wet_rock -mips -format dds
+//
+// Options on the command line apply to every set that doesn't set them
+// itself. Blank lines and lines starting with # are skipped.
+//
+// Sets run side by side on the shared pool, largest first, as many at once
+// as there are threads. A thread waiting on its set's bands, or done with
+// its set, takes bands of the others, so a few big textures and many small
+// ones even out across the cores. Only as many sets start as their estimated
+// working memory fits in -batch-mem, by default three quarters of physical
+// memory; a set larger than the whole limit runs on its own, tiled within
+// it.
+// ----------------------------------------------------------------------------
+
+struct BatchSet
+{
+	TylerParams params;
+	unsigned int line = 0U;
+	size_t bytes = 0;	// estimated working memory
+	int status = 0;
+	double ms = 0.0;
+};
+
+
+// Whitespace separated, "double quoted" tokens may hold spaces.
+inline std::vector<std::string> split_manifest_line(std::string line)
+{
+	std::vector<std::string> tokens;
+	size_t i = 0;
+	for (;;) {
+		while (i < line.size() && std::isspace((unsigned char)line[i])) {
+			++i;
+		}
+		if (i >= line.size() || line[i] == '#') {
+			break;
+		}
+		std::string token;
+		bool quoted = false;
+		while (i < line.size() && (quoted || !std::isspace((unsigned char)line[i]))) {
+			if (line[i] == '"') {
+				quoted = !quoted;
+			} else {
+				token.push_back(line[i]);
+			}
+			++i;
+		}
+		tokens.push_back(token);
+	}
+	return tokens;
+}
+
+
+// Reads the sets of a manifest, false when it can't be used at all.
+inline bool read_manifest(std::string path, int argc, char** argv, std::vector<BatchSet>& sets)
+{
+	std::ifstream file(path);
+	if (!file) {
+		OP("Could not open manifest=[" << path << "]");
+		return false;
+	}
+
+	// Command line options go after the line's own, so the line's win.
+	std::vector<std::string> common;
+	for (int i=1; i<argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "-batch" || arg == "-batch-mem") {
+			++i;
+			continue;
+		}
+		common.push_back(arg);
+	}
+
+	std::string text;
+	unsigned int n = 0U;
+	while (std::getline(file, text)) {
+		++n;
+		std::vector<std::string> tokens = split_manifest_line(text);
+		if (tokens.empty()) {
+			continue;
+		}
+		if (tokens.size() < 2) {
+			OP("Manifest line=[" << n << "] needs an input and an output.");
+			return false;
+		}
+
+		std::vector<std::string> args = { "pbrtyler", "-i", tokens[0], "-o", tokens[1] };
+		args.insert(args.end(), tokens.begin() + 2, tokens.end());
+		args.insert(args.end(), common.begin(), common.end());
+		std::vector<char*> ptrs;
+		for (auto& arg : args) {
+			ptrs.push_back(&arg[0]);
+		}
+
+		BatchSet set;
+		set.line = n;
+		try {
+			read_params((int)ptrs.size(), ptrs.data(), set.params);
+		} catch (std::exception e) {
+			OP("Manifest line=[" << n << "] has a bad option value.");
+			return false;
+		}
+		sets.push_back(set);
+	}
+	return true;
+}
+
+
+// Installed memory in bytes, 0 when it can't be told.
+inline size_t physical_memory()
+{
+#ifdef _WIN32
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+	return GlobalMemoryStatusEx(&status) ? (size_t)status.ullTotalPhys : 0;
+#else
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long page = sysconf(_SC_PAGE_SIZE);
+	return pages > 0 && page > 0 ? (size_t)pages * (size_t)page : 0;
+#endif
+}
+
+
+// Runs every set, 0 when all went through. mem_limit 0 - three quarters of
+// physical memory.
+inline int run_batch(std::vector<BatchSet>& sets, ThreadPool* pool, size_t mem_limit)
+{
+	if (mem_limit == 0) {
+		mem_limit = physical_memory() / 4 * 3;
+	}
+	OP("Batch begin. sets=[" << sets.size() << "] mem limit=[" << mem_limit << "]");
+	auto start = std::chrono::steady_clock::now();
+
+	// Sizes from the image headers, largest first.
+	std::vector<size_t> pending;
+	for (size_t k=0; k<sets.size(); ++k) {
+		BatchSet& set = sets[k];
+		try {
+			PixelFormat f;
+			unsigned int sw = 0U;
+			unsigned int sh = 0U;
+			inspect_source(set.params.input, 0, f, sw, sh);
+			set.bytes = TylerJob::estimate_bytes(set.params, sw, sh);
+			pending.push_back(k);
+		} catch (std::exception e) {
+			OP("Could not read set line=[" << set.line << "] input=[" << set.params.input << "]");
+			set.status = 1;
+			continue;
+		}
+		if (mem_limit > 0 && set.bytes > mem_limit && set.params.mem_budget == 0) {
+			OP("Set line=[" << set.line << "] is larger than the limit, running it tiled.");
+			set.params.mem_budget = mem_limit;
+			set.bytes = mem_limit;
+		}
+	}
+	std::stable_sort(pending.begin(), pending.end(), [&](size_t a, size_t b) {
+		return sets[a].bytes > sets[b].bytes;
+	});
+
+	std::mutex mutex;
+	size_t used = 0;
+	unsigned int running = 0U;
+
+	// Whether a set can start next to slots running sets that take room
+	// bytes: any set when none is running, else one per thread within the
+	// limit.
+	auto fits = [&](size_t room, unsigned int slots, size_t bytes) {
+		return slots == 0 || (slots < pool->size()
+			&& (mem_limit == 0 || room + bytes <= mem_limit));
+	};
+
+	// The largest pending set that can start, -1 when none can yet.
+	auto next_set = [&]() {
+		for (size_t i=0; i<pending.size(); ++i) {
+			if (fits(used, running, sets[pending[i]].bytes)) {
+				return (int)i;
+			}
+		}
+		return -1;
+	};
+
+	// Runners are pool tasks, on the threads that run the sets' bands. One
+	// can start inside another's wait for its bands, below that set on the
+	// stack, so runners never wait for room: when no set fits they stop, and
+	// the one finishing a set starts as many as fit again.
+	std::function<void(unsigned int, unsigned int)> runners;
+	auto runner = [&]() {
+		for (;;) {
+			size_t k;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				int i = next_set();
+				if (i < 0) {
+					return;
+				}
+				k = pending[i];
+				pending.erase(pending.begin() + i);
+				used += sets[k].bytes;
+				++running;
+			}
+
+			BatchSet& set = sets[k];
+			std::string prefix = log_prefix;
+			log_prefix = std::string("[").append(std::to_string(set.line)).append("] ");
+			OP("Set begin. input=[" << set.params.input << "] output=[" << set.params.output << "]"
+				<< " estimate=[" << set.bytes << "]");
+			auto set_start = std::chrono::steady_clock::now();
+			try {
+				TylerJob job;
+				job.params = set.params;
+				job.pool = pool;
+				set.status = job.run();
+			} catch (std::exception e) {
+				set.status = 1;
+			}
+			set.ms = ms_since(set_start);
+			OP("Set end. status=[" << set.status << "] ms=[" << set.ms << "]");
+			log_prefix = prefix;
+
+			// This runner goes on with the next set, the room freed may fit
+			// more.
+			unsigned int more = 0U;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				used -= set.bytes;
+				--running;
+				size_t room = used;
+				unsigned int slots = running;
+				for (size_t p : pending) {
+					if (fits(room, slots, sets[p].bytes)) {
+						room += sets[p].bytes;
+						++slots;
+						++more;
+					}
+				}
+			}
+			if (more > 1) {
+				pool->parallel_rows(0, more, runners);
+				return;
+			}
+		}
+	};
+	runners = [&](unsigned int r0, unsigned int r1) {
+		for (unsigned int r=r0; r<r1; ++r) {
+			runner();
+		}
+	};
+
+	pool->parallel_rows(0, (unsigned int)std::min((size_t)pool->size(), pending.size()), runners);
+
+	unsigned int failed = 0U;
+	for (auto& set : sets) {
+		if (set.status != 0) {
+			++failed;
+			OP("Failed set line=[" << set.line << "] input=[" << set.params.input << "]");
+		}
+	}
+	OP("Batch end. sets=[" << sets.size() << "] failed=[" << failed << "] ms=[" << ms_since(start) << "]");
+	return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "functions.h"
+#include "thread_pool.h"
+
+
+// Normalized 1D gaussian. The 2D gaussian is separable so blurring rows and
+// then columns with it equals the full 2D convolution.
+class BlurKernel
+{
+public:
+	int radius;
+	float sigma;
+	std::vector<float> weights;	// 2 * radius + 1 taps, sum to 1
+
+	BlurKernel(int _radius = 2, float _sigma = 0.83f)
+	{
+		radius = std::max(0, _radius);
+		sigma = _sigma;
+		weights.resize(2 * radius + 1);
+		float sum = 0.f;
+		for (int i=-radius; i<=radius; ++i) {
+			float g = sigma > 0.f
+				? exp(-(float)(i*i) / (2.f * sigma * sigma))
+				: (i == 0 ? 1.f : 0.f);
+			weights[i + radius] = g;
+			sum += g;
+		}
+		for (auto& g : weights) {
+			g /= sum;
+		}
+	}
+};
+
+
+// Blurs a w x h map that wraps around on both axes.
+// Rows are copied into a buffer padded with a wrapped halo so the horizontal
+// pass reads straight through it. The vertical pass looks up the wrapped
+// source rows once per output row and accumulates whole rows at a time.
+inline void blur_wrap(
+	std::vector<float>& src,
+	std::vector<float>& dst,
+	unsigned int w,
+	unsigned int h,
+	BlurKernel& kernel,
+	ThreadPool* pool
+)
+{
+	int r = kernel.radius;
+	int taps = 2 * r + 1;
+	float* k = kernel.weights.data();
+
+	std::vector<float> tmp(src.size());
+	dst.resize(src.size());
+
+	auto rows = [&](std::function<void(unsigned int, unsigned int)> fn)
+	{
+		if (pool) {
+			pool->parallel_rows(0, h, fn);
+		} else {
+			fn(0, h);
+		}
+	};
+
+	// Horizontal.
+	rows([&](unsigned int y0, unsigned int y1) {
+		std::vector<float> padded(w + 2 * r);
+		for (unsigned int y=y0; y<y1; ++y) {
+			float* row = &src[(size_t)y * w];
+			for (int x=0; x<r; ++x) {
+				padded[x] = row[modulo(x - r, w)];
+				padded[w + r + x] = row[modulo(x, w)];
+			}
+			std::copy(row, row + w, padded.begin() + r);
+
+			float* out = &tmp[(size_t)y * w];
+			for (unsigned int x=0; x<w; ++x) {
+				float* p = &padded[x];
+				float sum = 0.f;
+				for (int t=0; t<taps; ++t) {
+					sum += p[t] * k[t];
+				}
+				out[x] = sum;
+			}
+		}
+	});
+
+	// Vertical.
+	rows([&](unsigned int y0, unsigned int y1) {
+		std::vector<float*> in(taps);
+		for (unsigned int y=y0; y<y1; ++y) {
+			for (int t=0; t<taps; ++t) {
+				in[t] = &tmp[(size_t)modulo((int)y + t - r, h) * w];
+			}
+			float* out = &dst[(size_t)y * w];
+			std::fill(out, out + w, 0.f);
+			for (int t=0; t<taps; ++t) {
+				float* row = in[t];
+				float kt = k[t];
+				for (unsigned int x=0; x<w; ++x) {
+					out[x] += row[x] * kt;
+				}
+			}
+		}
+	});
+}
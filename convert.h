@@ -0,0 +1,533 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CONVERT_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CONVERT_AVX2 __attribute__((target("avx2")))
+#else
+#define CONVERT_AVX2
+#endif
+
+#include "log.h"
+#include "types.h"
+
+
+// ----------------------------------------------------------------------------
+// Byte <-> float conversions.
+//
+// byt(), flt(), bytv(), fltv() and normalize() are the reference. The array
+// kernels below have a scalar, an SSE2 and an AVX2 version, picked once at
+// runtime, which give bit identical results: the same IEEE operations in the
+// same order, rounding half away from zero in double like round() does.
+// -verify-convert checks them against the reference.
+// ----------------------------------------------------------------------------
+
+// Normal [0, 1]
+inline unsigned char byt(float val)
+{
+	return round(val * 255.f);
+}
+inline float flt(unsigned char val)
+{
+	return (float)val / 255.f;
+}
+
+// Vector [-1, 1]
+inline unsigned char bytv(float val)
+{
+	return round((val + 1.f) * 0.5 * 255.f);
+}
+inline float fltv(unsigned char val)
+{
+	return ((float)val / 255.f) * 2.f - 1.f;
+}
+
+// Zero length vectors are left as they are.
+inline Vec3 normalize(Vec3 v)
+{
+	float len = sqrt(v.x*v.x + v.y*v.y + v.z*v.z);
+	if (len > 0.f) {
+		v.x /= len;
+		v.y /= len;
+		v.z /= len;
+	}
+	return v;
+}
+
+
+// Reference kernels.
+// The quantizing ones match byt() and bytv() for values that round into an
+// int, which byt() and bytv() then wrap into a byte.
+
+inline void unorm8_to_float_scalar(const unsigned char* in, float* out, size_t n)
+{
+	for (size_t i=0; i<n; ++i) {
+		out[i] = flt(in[i]);
+	}
+}
+
+inline void snorm8_to_float_scalar(const unsigned char* in, float* out, size_t n)
+{
+	for (size_t i=0; i<n; ++i) {
+		out[i] = fltv(in[i]);
+	}
+}
+
+inline void float_to_unorm8_scalar(const float* in, unsigned char* out, size_t n)
+{
+	for (size_t i=0; i<n; ++i) {
+		out[i] = byt(in[i]);
+	}
+}
+
+inline void float_to_snorm8_scalar(const float* in, unsigned char* out, size_t n)
+{
+	for (size_t i=0; i<n; ++i) {
+		out[i] = bytv(in[i]);
+	}
+}
+
+// n xyz vectors, normalized then quantized.
+inline void normals_to_snorm8_scalar(const float* in, unsigned char* out, size_t n)
+{
+	for (size_t i=0; i<n; ++i) {
+		Vec3 v = normalize(Vec3{ in[i*3], in[i*3+1], in[i*3+2] });
+		out[i*3] = bytv(v.x);
+		out[i*3+1] = bytv(v.y);
+		out[i*3+2] = bytv(v.z);
+	}
+}
+
+
+#ifdef CONVERT_X86
+
+// round() of 4 doubles, low byte of each result in the low 4 ints.
+inline __m128i round_bytes_sse2(__m128d lo, __m128d hi)
+{
+	const __m128d sign = _mm_set1_pd(-0.0);
+	const __m128d half = _mm_set1_pd(0.5);
+	__m128i r[2];
+	__m128d v[2] = { lo, hi };
+	for (int k=0; k<2; ++k) {
+		__m128d neg = _mm_cmplt_pd(v[k], _mm_setzero_pd());
+		__m128i t = _mm_cvttpd_epi32(_mm_add_pd(_mm_andnot_pd(sign, v[k]), half));
+		// Negate where negative: (t ^ m) - m, m all ones in those lanes.
+		__m128i m = _mm_shuffle_epi32(_mm_castpd_si128(neg), _MM_SHUFFLE(3, 3, 2, 0));
+		r[k] = _mm_sub_epi32(_mm_xor_si128(t, m), m);
+	}
+	return _mm_and_si128(_mm_unpacklo_epi64(r[0], r[1]), _mm_set1_epi32(0xFF));
+}
+
+inline __m128i unorm_bytes_sse2(__m128 v)
+{
+	v = _mm_mul_ps(v, _mm_set1_ps(255.f));
+	return round_bytes_sse2(_mm_cvtps_pd(v), _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+}
+
+inline __m128i snorm_bytes_sse2(__m128 v)
+{
+	v = _mm_add_ps(v, _mm_set1_ps(1.f));
+	__m128d scale = _mm_set1_pd(0.5);
+	__m128d q = _mm_set1_pd(255.0);
+	__m128d lo = _mm_mul_pd(_mm_mul_pd(_mm_cvtps_pd(v), scale), q);
+	__m128d hi = _mm_mul_pd(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), scale), q);
+	return round_bytes_sse2(lo, hi);
+}
+
+// Packs 16 ints of 0 - 255 into bytes.
+inline void store_bytes_sse2(unsigned char* out, __m128i a, __m128i b, __m128i c, __m128i d)
+{
+	__m128i ab = _mm_packs_epi32(a, b);
+	__m128i cd = _mm_packs_epi32(c, d);
+	_mm_storeu_si128((__m128i*)out, _mm_packus_epi16(ab, cd));
+}
+
+inline void store_12_bytes(unsigned char* out, __m128i a, __m128i b, __m128i c)
+{
+	unsigned char tmp[16];
+	store_bytes_sse2(tmp, a, b, c, _mm_setzero_si128());
+	std::memcpy(out, tmp, 12);
+}
+
+inline void unorm8_to_float_sse2(const unsigned char* in, float* out, size_t n)
+{
+	const __m128 q = _mm_set1_ps(255.f);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i+16<=n; i+=16) {
+		__m128i b = _mm_loadu_si128((const __m128i*)(in + i));
+		__m128i lo = _mm_unpacklo_epi8(b, zero);
+		__m128i hi = _mm_unpackhi_epi8(b, zero);
+		__m128i v[4] = {
+			_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+			_mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero),
+		};
+		for (int k=0; k<4; ++k) {
+			_mm_storeu_ps(out + i + k*4, _mm_div_ps(_mm_cvtepi32_ps(v[k]), q));
+		}
+	}
+	unorm8_to_float_scalar(in + i, out + i, n - i);
+}
+
+inline void snorm8_to_float_sse2(const unsigned char* in, float* out, size_t n)
+{
+	const __m128 q = _mm_set1_ps(255.f);
+	const __m128 two = _mm_set1_ps(2.f);
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i+16<=n; i+=16) {
+		__m128i b = _mm_loadu_si128((const __m128i*)(in + i));
+		__m128i lo = _mm_unpacklo_epi8(b, zero);
+		__m128i hi = _mm_unpackhi_epi8(b, zero);
+		__m128i v[4] = {
+			_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+			_mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero),
+		};
+		for (int k=0; k<4; ++k) {
+			__m128 f = _mm_div_ps(_mm_cvtepi32_ps(v[k]), q);
+			_mm_storeu_ps(out + i + k*4, _mm_sub_ps(_mm_mul_ps(f, two), one));
+		}
+	}
+	snorm8_to_float_scalar(in + i, out + i, n - i);
+}
+
+inline void float_to_unorm8_sse2(const float* in, unsigned char* out, size_t n)
+{
+	size_t i = 0;
+	for (; i+16<=n; i+=16) {
+		store_bytes_sse2(out + i,
+			unorm_bytes_sse2(_mm_loadu_ps(in + i)),
+			unorm_bytes_sse2(_mm_loadu_ps(in + i + 4)),
+			unorm_bytes_sse2(_mm_loadu_ps(in + i + 8)),
+			unorm_bytes_sse2(_mm_loadu_ps(in + i + 12)));
+	}
+	float_to_unorm8_scalar(in + i, out + i, n - i);
+}
+
+inline void float_to_snorm8_sse2(const float* in, unsigned char* out, size_t n)
+{
+	size_t i = 0;
+	for (; i+16<=n; i+=16) {
+		store_bytes_sse2(out + i,
+			snorm_bytes_sse2(_mm_loadu_ps(in + i)),
+			snorm_bytes_sse2(_mm_loadu_ps(in + i + 4)),
+			snorm_bytes_sse2(_mm_loadu_ps(in + i + 8)),
+			snorm_bytes_sse2(_mm_loadu_ps(in + i + 12)));
+	}
+	float_to_snorm8_scalar(in + i, out + i, n - i);
+}
+
+// Normalizes 4 xyz vectors held as 12 floats in a, b, c, in place.
+inline void normalize_4_sse2(__m128& a, __m128& b, __m128& c)
+{
+	// a = x0 y0 z0 x1, b = y1 z1 x2 y2, c = z2 x3 y3 z3
+	__m128 t = _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2));
+	__m128 x = _mm_shuffle_ps(a, t, _MM_SHUFFLE(2, 0, 3, 0));
+	__m128 u = _mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1));
+	__m128 v = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3));
+	__m128 y = _mm_shuffle_ps(u, v, _MM_SHUFFLE(2, 0, 2, 0));
+	__m128 s = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2));
+	__m128 z = _mm_shuffle_ps(s, c, _MM_SHUFFLE(3, 0, 2, 0));
+
+	__m128 len = _mm_sqrt_ps(_mm_add_ps(
+		_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)),
+		_mm_mul_ps(z, z)));
+	__m128 keep = _mm_cmpgt_ps(len, _mm_setzero_ps());
+	len = _mm_or_ps(_mm_and_ps(keep, len), _mm_andnot_ps(keep, _mm_set1_ps(1.f)));
+
+	a = _mm_div_ps(a, _mm_shuffle_ps(len, len, _MM_SHUFFLE(1, 0, 0, 0)));
+	b = _mm_div_ps(b, _mm_shuffle_ps(len, len, _MM_SHUFFLE(2, 2, 1, 1)));
+	c = _mm_div_ps(c, _mm_shuffle_ps(len, len, _MM_SHUFFLE(3, 3, 3, 2)));
+}
+
+inline void normals_to_snorm8_sse2(const float* in, unsigned char* out, size_t n)
+{
+	size_t i = 0;
+	for (; i+4<=n; i+=4) {
+		__m128 a = _mm_loadu_ps(in + i*3);
+		__m128 b = _mm_loadu_ps(in + i*3 + 4);
+		__m128 c = _mm_loadu_ps(in + i*3 + 8);
+		normalize_4_sse2(a, b, c);
+		store_12_bytes(out + i*3, snorm_bytes_sse2(a), snorm_bytes_sse2(b), snorm_bytes_sse2(c));
+	}
+	normals_to_snorm8_scalar(in + i*3, out + i*3, n - i);
+}
+
+
+// AVX2 versions work on 4 doubles or 8 floats at a time.
+
+CONVERT_AVX2 inline __m128i round_bytes_avx2(__m256d v)
+{
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	__m128i neg = _mm256_cvttpd_epi32(_mm256_and_pd(
+		_mm256_cmp_pd(v, _mm256_setzero_pd(), _CMP_LT_OQ),
+		_mm256_set1_pd(1.0)));
+	__m128i t = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_andnot_pd(sign, v), _mm256_set1_pd(0.5)));
+	__m128i m = _mm_sub_epi32(_mm_setzero_si128(), neg);
+	t = _mm_sub_epi32(_mm_xor_si128(t, m), m);
+	return _mm_and_si128(t, _mm_set1_epi32(0xFF));
+}
+
+CONVERT_AVX2 inline __m128i unorm_bytes_avx2(__m128 v)
+{
+	v = _mm_mul_ps(v, _mm_set1_ps(255.f));
+	return round_bytes_avx2(_mm256_cvtps_pd(v));
+}
+
+CONVERT_AVX2 inline __m128i snorm_bytes_avx2(__m128 v)
+{
+	v = _mm_add_ps(v, _mm_set1_ps(1.f));
+	__m256d d = _mm256_mul_pd(_mm256_mul_pd(_mm256_cvtps_pd(v), _mm256_set1_pd(0.5)), _mm256_set1_pd(255.0));
+	return round_bytes_avx2(d);
+}
+
+CONVERT_AVX2 inline void unorm8_to_float_avx2(const unsigned char* in, float* out, size_t n)
+{
+	const __m256 q = _mm256_set1_ps(255.f);
+	size_t i = 0;
+	for (; i+8<=n; i+=8) {
+		__m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in + i)));
+		_mm256_storeu_ps(out + i, _mm256_div_ps(_mm256_cvtepi32_ps(v), q));
+	}
+	unorm8_to_float_scalar(in + i, out + i, n - i);
+}
+
+CONVERT_AVX2 inline void snorm8_to_float_avx2(const unsigned char* in, float* out, size_t n)
+{
+	const __m256 q = _mm256_set1_ps(255.f);
+	const __m256 two = _mm256_set1_ps(2.f);
+	const __m256 one = _mm256_set1_ps(1.f);
+	size_t i = 0;
+	for (; i+8<=n; i+=8) {
+		__m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in + i)));
+		__m256 f = _mm256_div_ps(_mm256_cvtepi32_ps(v), q);
+		_mm256_storeu_ps(out + i, _mm256_sub_ps(_mm256_mul_ps(f, two), one));
+	}
+	snorm8_to_float_scalar(in + i, out + i, n - i);
+}
+
+CONVERT_AVX2 inline void float_to_unorm8_avx2(const float* in, unsigned char* out, size_t n)
+{
+	size_t i = 0;
+	for (; i+16<=n; i+=16) {
+		store_bytes_sse2(out + i,
+			unorm_bytes_avx2(_mm_loadu_ps(in + i)),
+			unorm_bytes_avx2(_mm_loadu_ps(in + i + 4)),
+			unorm_bytes_avx2(_mm_loadu_ps(in + i + 8)),
+			unorm_bytes_avx2(_mm_loadu_ps(in + i + 12)));
+	}
+	float_to_unorm8_scalar(in + i, out + i, n - i);
+}
+
+CONVERT_AVX2 inline void float_to_snorm8_avx2(const float* in, unsigned char* out, size_t n)
+{
+	size_t i = 0;
+	for (; i+16<=n; i+=16) {
+		store_bytes_sse2(out + i,
+			snorm_bytes_avx2(_mm_loadu_ps(in + i)),
+			snorm_bytes_avx2(_mm_loadu_ps(in + i + 4)),
+			snorm_bytes_avx2(_mm_loadu_ps(in + i + 8)),
+			snorm_bytes_avx2(_mm_loadu_ps(in + i + 12)));
+	}
+	float_to_snorm8_scalar(in + i, out + i, n - i);
+}
+
+CONVERT_AVX2 inline void normals_to_snorm8_avx2(const float* in, unsigned char* out, size_t n)
+{
+	size_t i = 0;
+	for (; i+4<=n; i+=4) {
+		__m128 a = _mm_loadu_ps(in + i*3);
+		__m128 b = _mm_loadu_ps(in + i*3 + 4);
+		__m128 c = _mm_loadu_ps(in + i*3 + 8);
+		normalize_4_sse2(a, b, c);
+		store_12_bytes(out + i*3, snorm_bytes_avx2(a), snorm_bytes_avx2(b), snorm_bytes_avx2(c));
+	}
+	normals_to_snorm8_scalar(in + i*3, out + i*3, n - i);
+}
+
+
+inline bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+	__cpuidex(info, 1, 0);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif	// CONVERT_X86
+
+
+// One set of kernels, see convert_kernels().
+struct ConvertKernels
+{
+	const char* isa;
+	void (*unorm8_to_float)(const unsigned char*, float*, size_t);
+	void (*snorm8_to_float)(const unsigned char*, float*, size_t);
+	void (*float_to_unorm8)(const float*, unsigned char*, size_t);
+	void (*float_to_snorm8)(const float*, unsigned char*, size_t);
+	void (*normals_to_snorm8)(const float*, unsigned char*, size_t);
+};
+
+
+// Every set this build and CPU can run, best last. Scalar comes first.
+inline std::vector<ConvertKernels> available_convert_kernels()
+{
+	std::vector<ConvertKernels> sets;
+	sets.push_back({ "scalar",
+		unorm8_to_float_scalar, snorm8_to_float_scalar,
+		float_to_unorm8_scalar, float_to_snorm8_scalar,
+		normals_to_snorm8_scalar });
+#ifdef CONVERT_X86
+	sets.push_back({ "sse2",
+		unorm8_to_float_sse2, snorm8_to_float_sse2,
+		float_to_unorm8_sse2, float_to_snorm8_sse2,
+		normals_to_snorm8_sse2 });
+	if (cpu_has_avx2()) {
+		sets.push_back({ "avx2",
+			unorm8_to_float_avx2, snorm8_to_float_avx2,
+			float_to_unorm8_avx2, float_to_snorm8_avx2,
+			normals_to_snorm8_avx2 });
+	}
+#endif
+	return sets;
+}
+
+
+inline const ConvertKernels& convert_kernels()
+{
+	static const ConvertKernels best = available_convert_kernels().back();
+	return best;
+}
+
+
+inline void unorm8_to_float(const unsigned char* in, float* out, size_t n)
+{
+	convert_kernels().unorm8_to_float(in, out, n);
+}
+
+inline void snorm8_to_float(const unsigned char* in, float* out, size_t n)
+{
+	convert_kernels().snorm8_to_float(in, out, n);
+}
+
+inline void float_to_unorm8(const float* in, unsigned char* out, size_t n)
+{
+	convert_kernels().float_to_unorm8(in, out, n);
+}
+
+inline void float_to_snorm8(const float* in, unsigned char* out, size_t n)
+{
+	convert_kernels().float_to_snorm8(in, out, n);
+}
+
+inline void normals_to_snorm8(const float* in, unsigned char* out, size_t n)
+{
+	convert_kernels().normals_to_snorm8(in, out, n);
+}
+
+
+// Runs every kernel set against the scalar one: all bytes, floats around
+// every rounding step, random floats and vectors, zero vectors.
+inline bool verify_convert()
+{
+	OP("Verify convert begin.");
+
+	std::vector<unsigned char> bytes(256 * 4);
+	for (size_t i=0; i<bytes.size(); ++i) {
+		bytes[i] = (unsigned char)i;
+	}
+
+	std::vector<float> floats;
+	for (int k=-2; k<=512; ++k) {
+		float steps[2] = { (k + 0.5f) / 255.f, (k + 0.5f) / 127.5f - 1.f };
+		for (float f : steps) {
+			float v = f;
+			for (int u=0; u<4; ++u) {
+				v = std::nextafter(v, -10.f);
+			}
+			for (int u=0; u<9; ++u) {
+				floats.push_back(v);
+				v = std::nextafter(v, 10.f);
+			}
+		}
+	}
+	float specials[6] = { 0.f, -0.f, 1.f, -1.f, 0.5f, -0.5f };
+	floats.insert(floats.end(), specials, specials + 6);
+	std::srand(12345);
+	for (int i=0; i<(1 << 16); ++i) {
+		floats.push_back((float)std::rand() / RAND_MAX * 2.5f - 1.25f);
+	}
+	for (int i=0; i<12; ++i) {
+		floats.push_back(0.f);
+	}
+	floats.resize(floats.size() / 3 * 3);
+	size_t vectors = floats.size() / 3;
+
+	std::vector<ConvertKernels> sets = available_convert_kernels();
+	const ConvertKernels& ref = sets[0];
+	std::vector<float> ref_f(bytes.size());
+	std::vector<float> out_f(bytes.size());
+	std::vector<unsigned char> ref_b(floats.size());
+	std::vector<unsigned char> out_b(floats.size());
+	bool passed = true;
+
+	for (size_t s=1; s<sets.size(); ++s) {
+		const ConvertKernels& k = sets[s];
+		size_t fails = 0;
+
+		ref.unorm8_to_float(bytes.data(), ref_f.data(), bytes.size());
+		k.unorm8_to_float(bytes.data(), out_f.data(), bytes.size());
+		fails += std::memcmp(ref_f.data(), out_f.data(), ref_f.size() * sizeof(float)) != 0;
+		ref.snorm8_to_float(bytes.data(), ref_f.data(), bytes.size());
+		k.snorm8_to_float(bytes.data(), out_f.data(), bytes.size());
+		fails += std::memcmp(ref_f.data(), out_f.data(), ref_f.size() * sizeof(float)) != 0;
+
+		ref.float_to_unorm8(floats.data(), ref_b.data(), floats.size());
+		k.float_to_unorm8(floats.data(), out_b.data(), floats.size());
+		fails += ref_b != out_b;
+		ref.float_to_snorm8(floats.data(), ref_b.data(), floats.size());
+		k.float_to_snorm8(floats.data(), out_b.data(), floats.size());
+		fails += ref_b != out_b;
+		ref.normals_to_snorm8(floats.data(), ref_b.data(), vectors);
+		k.normals_to_snorm8(floats.data(), out_b.data(), vectors);
+		fails += ref_b != out_b;
+
+		OP("isa=[" << k.isa << "] kernels failed=[" << fails << "/5]");
+		passed = passed && fails == 0;
+	}
+
+	OP("Using isa=[" << convert_kernels().isa << "]");
+	if (passed) {
+		OP("Verify convert passed.");
+	} else {
+		OP("Verify convert FAILED.");
+	}
+	OP("Verify convert end.");
+	return passed;
+}
@@ -0,0 +1,707 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "types.h"
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+
+// ----------------------------------------------------------------------------
+// Block compressed DDS writer.
+//
+// 4x4 blocks of 8-bit pixels are encoded to BC1, BC4, BC5 or BC7 on the
+// thread that made the band, and written straight to their place in the
+// file, so bands can arrive in any order. Encoding fits a line through each
+// block's colours along their principal axis and refines the end points by
+// least squares. BC7 only uses mode 6.
+// ----------------------------------------------------------------------------
+
+enum DDSFormat { DDS_BC1 = 0, DDS_BC4, DDS_BC5, DDS_BC7 };
+const char* const DDS_FORMAT_NAMES[4] = { "bc1", "bc4", "bc5", "bc7" };
+
+// DXGI_FORMAT values, unorm and srgb.
+const uint32_t DDS_DXGI_FORMATS[4][2] = { { 71, 72 }, { 80, 80 }, { 83, 83 }, { 98, 99 } };
+const unsigned int DDS_BLOCK_BYTES[4] = { 8, 8, 16, 16 };
+
+
+// Format of the _hrm map, bc1 or bc7. BC1 is half the size, BC7 mixes the
+// three unrelated channels up less.
+inline DDSFormat parse_dds_hrm_format(std::string name)
+{
+	if (name == DDS_FORMAT_NAMES[DDS_BC7]) {
+		return DDS_BC7;
+	}
+	if (name != DDS_FORMAT_NAMES[DDS_BC1]) {
+		OP("Unknown hrm dds format=[" << name << "], using bc1.");
+	}
+	return DDS_BC1;
+}
+const unsigned int DDS_BAND_PIXELS = 1 << 14;
+const size_t DDS_HEAD_BYTES = 4 + 36 * 4;
+
+
+// Writes bits lowest first into a zeroed block.
+struct BlockBits
+{
+	unsigned char* out;
+	unsigned int pos = 0U;
+
+	BlockBits(unsigned char* _out) : out(_out) {}
+
+	void put(unsigned int v, unsigned int bits)
+	{
+		for (unsigned int b=0; b<bits; ++b, ++pos) {
+			out[pos >> 3] |= (unsigned char)(((v >> b) & 1U) << (pos & 7U));
+		}
+	}
+};
+
+
+// Mean and principal axis of n channels of the 16 pixels of a block, by
+// power iteration on their covariance. The axis is zero for flat blocks.
+inline void principal_axis(const float px[16][4], int n, float mean[4], float axis[4])
+{
+	for (int c=0; c<4; ++c) {
+		mean[c] = 0.f;
+		axis[c] = 0.f;
+	}
+	for (int i=0; i<16; ++i)
+		for (int c=0; c<n; ++c) {
+			mean[c] += px[i][c] / 16.f;
+		}
+
+	float cov[4][4] = {};
+	float lo[4] = { 255.f, 255.f, 255.f, 255.f };
+	float hi[4] = { 0.f, 0.f, 0.f, 0.f };
+	for (int i=0; i<16; ++i) {
+		float d[4];
+		for (int c=0; c<n; ++c) {
+			d[c] = px[i][c] - mean[c];
+			lo[c] = std::min(lo[c], px[i][c]);
+			hi[c] = std::max(hi[c], px[i][c]);
+		}
+		for (int a=0; a<n; ++a)
+			for (int b=0; b<n; ++b) {
+				cov[a][b] += d[a] * d[b];
+			}
+	}
+
+	// Start from the bounding box diagonal, which is close for most blocks.
+	float v[4] = {};
+	for (int c=0; c<n; ++c) {
+		v[c] = hi[c] - lo[c];
+	}
+	for (int it=0; it<8; ++it) {
+		float t[4] = {};
+		float len = 0.f;
+		for (int a=0; a<n; ++a) {
+			for (int b=0; b<n; ++b) {
+				t[a] += cov[a][b] * v[b];
+			}
+			len = std::max(len, std::fabs(t[a]));
+		}
+		if (len <= 0.f) {
+			break;
+		}
+		for (int c=0; c<n; ++c) {
+			v[c] = t[c] / len;
+		}
+	}
+	float len = 0.f;
+	for (int c=0; c<n; ++c) {
+		len += v[c] * v[c];
+	}
+	len = std::sqrt(len);
+	for (int c=0; c<n && len > 0.f; ++c) {
+		axis[c] = v[c] / len;
+	}
+}
+
+
+// End points of the block's extent along its principal axis.
+inline void axis_end_points(const float px[16][4], int n, float e0[4], float e1[4])
+{
+	float mean[4];
+	float axis[4];
+	principal_axis(px, n, mean, axis);
+	float tmin = 0.f;
+	float tmax = 0.f;
+	for (int i=0; i<16; ++i) {
+		float t = 0.f;
+		for (int c=0; c<n; ++c) {
+			t += (px[i][c] - mean[c]) * axis[c];
+		}
+		tmin = std::min(tmin, t);
+		tmax = std::max(tmax, t);
+	}
+	for (int c=0; c<4; ++c) {
+		e0[c] = std::min(255.f, std::max(0.f, mean[c] + axis[c] * tmin));
+		e1[c] = std::min(255.f, std::max(0.f, mean[c] + axis[c] * tmax));
+	}
+}
+
+
+// Least squares end points for pixels at weights wt along e0 -> e1.
+// Returns false when the weights can't tell the end points apart.
+inline bool fit_end_points(
+	const float px[16][4],
+	int n,
+	const float wt[16],
+	float e0[4],
+	float e1[4]
+) {
+	float a = 0.f, b = 0.f, c = 0.f;
+	float x[4] = {};
+	float y[4] = {};
+	for (int i=0; i<16; ++i) {
+		float u = 1.f - wt[i];
+		float v = wt[i];
+		a += u * u;
+		b += u * v;
+		c += v * v;
+		for (int k=0; k<n; ++k) {
+			x[k] += u * px[i][k];
+			y[k] += v * px[i][k];
+		}
+	}
+	float det = a * c - b * b;
+	if (std::fabs(det) < 1e-6f) {
+		return false;
+	}
+	for (int k=0; k<n; ++k) {
+		e0[k] = std::min(255.f, std::max(0.f, (c * x[k] - b * y[k]) / det));
+		e1[k] = std::min(255.f, std::max(0.f, (a * y[k] - b * x[k]) / det));
+	}
+	return true;
+}
+
+
+// Picks the nearest of count palette entries for every pixel.
+// Returns the squared error.
+inline float pick_indices(
+	const float px[16][4],
+	int n,
+	const int palette[][4],
+	int count,
+	unsigned char idx[16]
+) {
+	float total = 0.f;
+	for (int i=0; i<16; ++i) {
+		float best = 1e30f;
+		for (int p=0; p<count; ++p) {
+			float e = 0.f;
+			for (int c=0; c<n; ++c) {
+				float d = px[i][c] - (float)palette[p][c];
+				e += d * d;
+			}
+			if (e < best) {
+				best = e;
+				idx[i] = (unsigned char)p;
+			}
+		}
+		total += best;
+	}
+	return total;
+}
+
+
+// ----------------------------------------------------------------------------
+// BC1
+// ----------------------------------------------------------------------------
+
+inline unsigned short pack_565(const float c[3])
+{
+	int r = (int)std::lround(c[0] * 31.f / 255.f);
+	int g = (int)std::lround(c[1] * 63.f / 255.f);
+	int b = (int)std::lround(c[2] * 31.f / 255.f);
+	return (unsigned short)((r << 11) | (g << 5) | b);
+}
+
+inline void unpack_565(unsigned short v, int out[4])
+{
+	int r = (v >> 11) & 31;
+	int g = (v >> 5) & 63;
+	int b = v & 31;
+	out[0] = (r << 3) | (r >> 2);
+	out[1] = (g << 2) | (g >> 4);
+	out[2] = (b << 3) | (b >> 2);
+	out[3] = 255;
+}
+
+
+struct BC1Block
+{
+	unsigned short c0;
+	unsigned short c1;
+	unsigned char idx[16];
+	float error;
+};
+
+
+// Four colour mode only, c0 > c1, so alpha is always opaque.
+inline BC1Block bc1_try(const float px[16][4], const float e0[4], const float e1[4])
+{
+	BC1Block block;
+	block.c0 = pack_565(e0);
+	block.c1 = pack_565(e1);
+	if (block.c0 < block.c1) {
+		std::swap(block.c0, block.c1);
+	}
+
+	int palette[4][4];
+	unpack_565(block.c0, palette[0]);
+	unpack_565(block.c1, palette[1]);
+	if (block.c0 == block.c1) {
+		block.error = pick_indices(px, 3, palette, 1, block.idx);
+		return block;
+	}
+	for (int c=0; c<3; ++c) {
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+	block.error = pick_indices(px, 3, palette, 4, block.idx);
+	return block;
+}
+
+
+inline void encode_bc1(const float px[16][4], unsigned char out[8])
+{
+	const float weights[4] = { 0.f, 1.f, 1.f / 3.f, 2.f / 3.f };
+
+	float e0[4];
+	float e1[4];
+	axis_end_points(px, 3, e0, e1);
+	BC1Block best = bc1_try(px, e1, e0);
+	for (int it=0; it<2; ++it) {
+		float wt[16];
+		for (int i=0; i<16; ++i) {
+			wt[i] = weights[best.idx[i]];
+		}
+		int p0[4];
+		int p1[4];
+		unpack_565(best.c0, p0);
+		unpack_565(best.c1, p1);
+		for (int c=0; c<4; ++c) {
+			e0[c] = (float)p0[c];
+			e1[c] = (float)p1[c];
+		}
+		if (best.c0 == best.c1 || !fit_end_points(px, 3, wt, e0, e1)) {
+			break;
+		}
+		BC1Block next = bc1_try(px, e0, e1);
+		if (next.error >= best.error) {
+			break;
+		}
+		best = next;
+	}
+
+	std::memset(out, 0, 8);
+	BlockBits bits(out);
+	bits.put(best.c0, 16);
+	bits.put(best.c1, 16);
+	for (int i=0; i<16; ++i) {
+		bits.put(best.idx[i], 2);
+	}
+}
+
+
+// ----------------------------------------------------------------------------
+// BC4, BC5
+// ----------------------------------------------------------------------------
+
+// Channel c of the block in the eight value mode, e0 > e1.
+inline void encode_bc4(const float px[16][4], int c, unsigned char out[8])
+{
+	float lo = 255.f;
+	float hi = 0.f;
+	for (int i=0; i<16; ++i) {
+		lo = std::min(lo, px[i][c]);
+		hi = std::max(hi, px[i][c]);
+	}
+	int e0 = (int)std::lround(hi);
+	int e1 = (int)std::lround(lo);
+
+	std::memset(out, 0, 8);
+	out[0] = (unsigned char)e0;
+	out[1] = (unsigned char)e1;
+	if (e0 == e1) {
+		return;
+	}
+
+	int palette[8];
+	palette[0] = e0;
+	palette[1] = e1;
+	for (int i=2; i<8; ++i) {
+		palette[i] = ((8 - i) * e0 + (i - 1) * e1 + 3) / 7;
+	}
+	BlockBits bits(out + 2);
+	for (int i=0; i<16; ++i) {
+		int best = 0;
+		float best_error = 1e30f;
+		for (int p=0; p<8; ++p) {
+			float e = std::fabs(px[i][c] - (float)palette[p]);
+			if (e < best_error) {
+				best_error = e;
+				best = p;
+			}
+		}
+		bits.put(best, 3);
+	}
+}
+
+
+inline void encode_bc5(const float px[16][4], unsigned char out[16])
+{
+	encode_bc4(px, 0, out);
+	encode_bc4(px, 1, out + 8);
+}
+
+
+// ----------------------------------------------------------------------------
+// BC7 mode 6: one subset, RGBA 7.7.7.7 end points with a p-bit each and
+// 4-bit indices.
+// ----------------------------------------------------------------------------
+
+const int BC7_WEIGHTS_4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+
+struct BC7Block
+{
+	int q[2][4];	// 7-bit end points
+	int p[2];	// p-bits
+	unsigned char idx[16];
+	float error;
+};
+
+
+// Quantizes an end point to 7 bits and the p-bit that fits it best.
+// Opaque blocks keep p = 1 so alpha decodes to 255.
+inline void bc7_quantize(const float e[4], bool opaque, int q[4], int& p)
+{
+	float best = 1e30f;
+	for (int pb=opaque ? 1 : 0; pb<2; ++pb) {
+		int t[4];
+		float err = 0.f;
+		for (int c=0; c<4; ++c) {
+			t[c] = std::min(127, std::max(0, (int)std::lround((e[c] - pb) / 2.f)));
+			float d = (float)(t[c] * 2 + pb) - e[c];
+			err += d * d;
+		}
+		if (err < best) {
+			best = err;
+			p = pb;
+			std::memcpy(q, t, sizeof(t));
+		}
+	}
+}
+
+
+inline BC7Block bc7_try(const float px[16][4], const float e0[4], const float e1[4], bool opaque)
+{
+	BC7Block block;
+	bc7_quantize(e0, opaque, block.q[0], block.p[0]);
+	bc7_quantize(e1, opaque, block.q[1], block.p[1]);
+
+	int palette[16][4];
+	for (int i=0; i<16; ++i)
+		for (int c=0; c<4; ++c) {
+			int a = block.q[0][c] * 2 + block.p[0];
+			int b = block.q[1][c] * 2 + block.p[1];
+			palette[i][c] = ((64 - BC7_WEIGHTS_4[i]) * a + BC7_WEIGHTS_4[i] * b + 32) >> 6;
+		}
+	block.error = pick_indices(px, 4, palette, 16, block.idx);
+	return block;
+}
+
+
+inline void encode_bc7(const float px[16][4], unsigned char out[16])
+{
+	bool opaque = true;
+	for (int i=0; i<16 && opaque; ++i) {
+		opaque = px[i][3] == 255.f;
+	}
+
+	float e0[4];
+	float e1[4];
+	axis_end_points(px, 4, e0, e1);
+	BC7Block best = bc7_try(px, e0, e1, opaque);
+	for (int it=0; it<2; ++it) {
+		float wt[16];
+		for (int i=0; i<16; ++i) {
+			wt[i] = BC7_WEIGHTS_4[best.idx[i]] / 64.f;
+		}
+		for (int c=0; c<4; ++c) {
+			e0[c] = (float)(best.q[0][c] * 2 + best.p[0]);
+			e1[c] = (float)(best.q[1][c] * 2 + best.p[1]);
+		}
+		if (!fit_end_points(px, 4, wt, e0, e1)) {
+			break;
+		}
+		BC7Block next = bc7_try(px, e0, e1, opaque);
+		if (next.error >= best.error) {
+			break;
+		}
+		best = next;
+	}
+
+	// The first index is stored without its top bit.
+	if (best.idx[0] & 8) {
+		for (int c=0; c<4; ++c) {
+			std::swap(best.q[0][c], best.q[1][c]);
+		}
+		std::swap(best.p[0], best.p[1]);
+		for (int i=0; i<16; ++i) {
+			best.idx[i] = (unsigned char)(15 - best.idx[i]);
+		}
+	}
+
+	std::memset(out, 0, 16);
+	BlockBits bits(out);
+	bits.put(1U << 6, 7);
+	for (int c=0; c<4; ++c) {
+		bits.put(best.q[0][c], 7);
+		bits.put(best.q[1][c], 7);
+	}
+	bits.put(best.p[0], 1);
+	bits.put(best.p[1], 1);
+	bits.put(best.idx[0], 3);
+	for (int i=1; i<16; ++i) {
+		bits.put(best.idx[i], 4);
+	}
+}
+
+
+inline void encode_block(DDSFormat format, const float px[16][4], unsigned char* out)
+{
+	switch (format) {
+	case DDS_BC1: encode_bc1(px, out); break;
+	case DDS_BC4: encode_bc4(px, 0, out); break;
+	case DDS_BC5: encode_bc5(px, out); break;
+	default: encode_bc7(px, out); break;
+	}
+}
+
+
+// Encodes rows of 8-bit pixels, rows a multiple of 4 or the last ones of the
+// image. Pixels past the right and bottom edges repeat the edge.
+inline void encode_blocks(
+	DDSFormat format,
+	const unsigned char* pixels,
+	unsigned int w,
+	unsigned int rows,
+	unsigned int channels,
+	unsigned char* out
+) {
+	unsigned int bw = (w + 3) / 4;
+	for (unsigned int by=0; by<rows; by+=4)
+		for (unsigned int bx=0; bx<bw; ++bx) {
+			float px[16][4];
+			for (unsigned int i=0; i<16; ++i) {
+				unsigned int x = std::min(bx * 4 + i % 4, w - 1);
+				unsigned int y = std::min(by + i / 4, rows - 1);
+				const unsigned char* p = pixels + ((size_t)y * w + x) * channels;
+				for (unsigned int c=0; c<4; ++c) {
+					px[i][c] = c < channels ? (float)p[c] : (c == 3 ? 255.f : 0.f);
+				}
+			}
+			encode_block(format, px, out);
+			out += DDS_BLOCK_BYTES[format];
+		}
+}
+
+
+// ----------------------------------------------------------------------------
+// DDS file
+// ----------------------------------------------------------------------------
+
+inline size_t dds_level_bytes(unsigned int w, unsigned int h, DDSFormat format)
+{
+	return (size_t)((w + 3) / 4) * ((h + 3) / 4) * DDS_BLOCK_BYTES[format];
+}
+
+
+// DDS_HEADER with the DX10 extension, as little endian words after "DDS ".
+inline void dds_header(
+	unsigned int w,
+	unsigned int h,
+	unsigned int levels,
+	DDSFormat format,
+	bool srgb,
+	uint32_t words[36]
+) {
+	std::memset(words, 0, 36 * sizeof(uint32_t));
+	words[0] = 124;	// size
+	words[1] = 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000;	// caps, height, width, pixel format, linear size
+	words[2] = h;
+	words[3] = w;
+	words[4] = (uint32_t)dds_level_bytes(w, h, format);
+	words[6] = levels;
+	words[18] = 32;	// pixel format size
+	words[19] = 0x4;	// four cc
+	words[20] = 0x30315844;	// "DX10"
+	words[26] = 0x1000;	// texture
+	if (levels > 1) {
+		words[1] |= 0x20000;	// mip map count
+		words[26] |= 0x8 | 0x400000;	// complex, mip map
+	}
+	words[31] = DDS_DXGI_FORMATS[format][srgb ? 1 : 0];
+	words[32] = 3;	// 2d texture
+	words[34] = 1;	// array size
+}
+
+
+// Level l of the mip chain is max(1, w >> l) by max(1, h >> l) and follows
+// level l - 1 in the file.
+class DDSStream : public ImageStream
+{
+public:
+	DDSFormat format = DDS_BC7;
+	unsigned int levels = 1U;
+
+	~DDSStream()
+	{
+		if (file) {
+			std::fclose(file);
+		}
+	}
+
+
+	void open(
+		std::string filename,
+		unsigned int _w,
+		unsigned int _h,
+		unsigned int _channels,
+		DDSFormat _format,
+		bool srgb,
+		unsigned int _levels = 1U
+	)
+	{
+		w = _w;
+		h = _h;
+		channels = _channels;
+		format = _format;
+		levels = _levels;
+		path = filename;
+		rows_written = 0;
+		rows_expected = 0;
+		error = false;
+
+		level_offset.clear();
+		size_t offset = DDS_HEAD_BYTES;
+		for (unsigned int l=0; l<levels; ++l) {
+			level_offset.push_back(offset);
+			offset += dds_level_bytes(level_w(l), level_h(l), format);
+			rows_expected += level_h(l);
+		}
+
+		file = std::fopen(path.c_str(), "wb");
+		if (!file) {
+			OP("Could not open=[" << path << "]");
+			throw std::exception("Encoder error.");
+		}
+		unsigned char head[DDS_HEAD_BYTES] = { 'D', 'D', 'S', ' ' };
+		uint32_t words[36];
+		dds_header(w, h, levels, format, srgb, words);
+		for (int i=0; i<36; ++i) {
+			for (int b=0; b<4; ++b) {
+				head[4 + i * 4 + b] = (unsigned char)(words[i] >> (b * 8));
+			}
+		}
+		error = std::fwrite(head, 1, sizeof(head), file) != sizeof(head);
+	}
+
+
+	// Multiples of 4, small enough for the bands to spread over the pool.
+	unsigned int band_rows() override
+	{
+		unsigned int rows = (unsigned int)(DDS_BAND_PIXELS / std::max(1U, w));
+		return std::max(4U, rows / 4 * 4);
+	}
+
+
+	unsigned int level_w(unsigned int level)
+	{
+		return std::max(1U, w >> level);
+	}
+
+	unsigned int level_h(unsigned int level)
+	{
+		return std::max(1U, h >> level);
+	}
+
+
+	void put_rows(unsigned int y0, unsigned int y1, const unsigned char* pixels) override
+	{
+		put_level_rows(0, y0, y1, pixels);
+	}
+
+
+	// Rows [y0, y1) of a level, level_w(level) pixels each.
+	void put_level_rows(
+		unsigned int level,
+		unsigned int y0,
+		unsigned int y1,
+		const unsigned char* pixels
+	) {
+		unsigned int lw = level_w(level);
+		if (level >= levels || y0 % 4 != 0 || (y1 % 4 != 0 && y1 != level_h(level))) {
+			std::unique_lock<std::mutex> lock(mutex);
+			OP("Rows not on block bounds level=[" << level << "] y0=[" << y0 << "] y1=[" << y1 << "]");
+			error = true;
+			return;
+		}
+
+		size_t row_bytes = (size_t)((lw + 3) / 4) * DDS_BLOCK_BYTES[format];
+		std::vector<unsigned char> blocks(row_bytes * ((y1 - y0 + 3) / 4));
+		encode_blocks(format, pixels, lw, y1 - y0, channels, blocks.data());
+
+		std::unique_lock<std::mutex> lock(mutex);
+		uint64_t offset = level_offset[level] + row_bytes * (y0 / 4);
+		if (fseek64(file, offset, SEEK_SET) != 0
+			|| std::fwrite(blocks.data(), 1, blocks.size(), file) != blocks.size()) {
+			error = true;
+		}
+		rows_written += y1 - y0;
+	}
+
+
+	void close() override
+	{
+		if (!file) {
+			return;
+		}
+		if (rows_written != rows_expected) {
+			OP("Rows missing=[" << rows_expected - rows_written << "]");
+			error = true;
+		}
+		error = std::fclose(file) != 0 || error;
+		file = nullptr;
+		if (error) {
+			OP("Encoder error. Filename=[" << path << "]");
+			throw std::exception("Encoder error.");
+		}
+	}
+
+private:
+	std::string path;
+	std::FILE* file = nullptr;
+	std::vector<size_t> level_offset;
+	unsigned int rows_written = 0U;
+	unsigned int rows_expected = 0U;
+	bool error = false;
+	std::mutex mutex;
+};
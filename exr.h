@@ -0,0 +1,631 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "lodepng.h"
+
+#include "log.h"
+#include "thread_pool.h"
+#include "types.h"
+
+
+// ----------------------------------------------------------------------------
+// OpenEXR reader.
+//
+// Reads the maps straight from one multi-layer EXR, like the ones Blender
+// writes with its render passes and shader AOVs, in float. Covers single
+// part scanline files, uncompressed or RLE, ZIPS or ZIP compressed, with
+// half, float or uint channels. Tiled, deep and multi-part files and the
+// other compressions (PIZ, PXR24, B44, DWA) are refused.
+// ----------------------------------------------------------------------------
+
+const unsigned char EXR_MAGIC[4] = { 0x76, 0x2F, 0x31, 0x01 };
+const uint32_t EXR_FLAG_TILED = 0x200;
+const uint32_t EXR_FLAG_DEEP = 0x800;
+const uint32_t EXR_FLAG_MULTIPART = 0x1000;
+const size_t EXR_HEADER_MAX = 1 << 20;	// read to inspect
+
+enum EXRPixelType { EXR_UINT = 0, EXR_HALF = 1, EXR_FLOAT = 2 };
+enum EXRCompression { EXR_NONE = 0, EXR_RLE = 1, EXR_ZIPS = 2, EXR_ZIP = 3 };
+
+
+struct EXRChannel
+{
+	std::string name;
+	int type = EXR_HALF;
+	size_t offset = 0;	// of its values in a line
+};
+
+
+struct EXRImage
+{
+	unsigned int w = 0U;
+	unsigned int h = 0U;
+	int y_min = 0;
+	int compression = EXR_NONE;
+	unsigned int block_lines = 1U;	// lines per chunk
+	size_t line_bytes = 0;
+	std::vector<EXRChannel> channels;	// in file order
+	std::vector<uint64_t> offsets;	// of each chunk
+};
+
+
+// Layers the maps come from. A channel belongs to the layer named before its
+// last dot, "ViewLayer.DiffCol.R" is R of DiffCol, and layers match by name
+// ignoring case and any view layer in front.
+struct EXRLayers
+{
+	std::string d = "DiffCol";
+	std::string n = "Normal";
+	std::string h = "Height";
+	std::string r = "Roughness";
+	std::string m = "Metallic";
+};
+
+
+inline bool is_exr(const unsigned char* data, size_t size)
+{
+	return size >= 8 && std::memcmp(data, EXR_MAGIC, 4) == 0;
+}
+
+
+inline bool is_exr_path(std::string filename)
+{
+	if (filename.size() < 4) {
+		return false;
+	}
+	std::string ext = filename.substr(filename.size() - 4);
+	for (auto& c : ext) {
+		c = (char)std::tolower((unsigned char)c);
+	}
+	return ext == ".exr";
+}
+
+
+inline bool same_name(std::string a, std::string b)
+{
+	if (a.size() != b.size()) {
+		return false;
+	}
+	for (size_t i=0; i<a.size(); ++i) {
+		if (std::tolower((unsigned char)a[i]) != std::tolower((unsigned char)b[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// -exr-layers d=DiffCol,n=Normal,h=Height,r=Roughness,m=Metallic, any of
+// them. The rest keep their defaults.
+inline EXRLayers parse_exr_layers(std::string spec)
+{
+	EXRLayers layers;
+	size_t start = 0;
+	while (start <= spec.size()) {
+		size_t end = std::min(spec.find(',', start), spec.size());
+		std::string item = spec.substr(start, end - start);
+		size_t eq = item.find('=');
+		std::string key = item.substr(0, eq);
+		std::string name = eq == std::string::npos ? "" : item.substr(eq + 1);
+		std::string* layer =
+			key == "d" ? &layers.d
+			: key == "n" ? &layers.n
+			: key == "h" ? &layers.h
+			: key == "r" ? &layers.r
+			: key == "m" ? &layers.m
+			: nullptr;
+		if (layer && !name.empty()) {
+			*layer = name;
+		} else if (!item.empty()) {
+			OP("Unknown exr layer=[" << item << "], ignored.");
+		}
+		start = end + 1;
+	}
+	return layers;
+}
+
+
+// Hash of the layer names, so a cache made from other layers isn't used.
+inline uint32_t exr_layers_key(const EXRLayers& layers)
+{
+	uint32_t hash = 2166136261U;
+	const std::string* names[5] = { &layers.d, &layers.n, &layers.h, &layers.r, &layers.m };
+	for (int k=0; k<5; ++k) {
+		for (char c : *names[k]) {
+			hash = (hash ^ (unsigned char)std::tolower((unsigned char)c)) * 16777619U;
+		}
+		hash = (hash ^ 0xFFU) * 16777619U;
+	}
+	return hash == 0 ? 1 : hash;
+}
+
+
+inline void exr_error(std::string filename, std::string what)
+{
+	OP("Decoder error: " << what);
+	OP("Filename=[" << filename << "]");
+	throw std::exception("Decoder error.");
+}
+
+
+inline uint32_t exr_u32(const unsigned char* p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+inline uint64_t exr_u64(const unsigned char* p)
+{
+	return (uint64_t)exr_u32(p) | (uint64_t)exr_u32(p + 4) << 32;
+}
+
+
+inline float half_to_float(uint16_t v)
+{
+	uint32_t sign = (uint32_t)(v & 0x8000) << 16;
+	uint32_t e = (v >> 10) & 0x1F;
+	uint32_t m = v & 0x3FF;
+	if (e == 0) {
+		float f = (float)m * (1.f / 16777216.f);
+		return sign ? -f : f;
+	}
+	uint32_t bits = e == 31
+		? sign | 0x7F800000U | m << 13
+		: sign | (e + 112) << 23 | m << 13;
+	float f;
+	std::memcpy(&f, &bits, 4);
+	return f;
+}
+
+
+inline size_t exr_type_bytes(int type)
+{
+	return type == EXR_HALF ? 2 : 4;
+}
+
+
+// Reads the header and, unless it is only the header, the chunk offsets.
+inline void exr_parse(
+	const std::vector<unsigned char>& data,
+	EXRImage& img,
+	std::string filename,
+	bool header_only = false
+) {
+	if (!is_exr(data.data(), data.size())) {
+		exr_error(filename, "not an EXR.");
+	}
+	uint32_t version = exr_u32(&data[4]);
+	if (version & (EXR_FLAG_TILED | EXR_FLAG_DEEP | EXR_FLAG_MULTIPART)) {
+		exr_error(filename, "tiled, deep and multi-part EXRs aren't supported.");
+	}
+
+	bool window = false;
+	int box[4] = {};
+	img = EXRImage();
+	size_t p = 8;
+	auto text = [&]() {
+		size_t end = p;
+		while (end < data.size() && data[end] != 0) {
+			++end;
+		}
+		if (end >= data.size()) {
+			exr_error(filename, "broken header.");
+		}
+		std::string s((const char*)&data[p], end - p);
+		p = end + 1;
+		return s;
+	};
+
+	while (true) {
+		std::string name = text();
+		if (name.empty()) {
+			break;
+		}
+		std::string type = text();
+		if (p + 4 > data.size()) {
+			exr_error(filename, "broken header.");
+		}
+		size_t size = exr_u32(&data[p]);
+		p += 4;
+		if (size > data.size() - p) {
+			exr_error(filename, "broken header.");
+		}
+		const unsigned char* v = &data[p];
+
+		if (name == "channels" && type == "chlist") {
+			size_t q = 0;
+			while (q < size && v[q] != 0) {
+				EXRChannel c;
+				while (q < size && v[q] != 0) {
+					c.name.push_back((char)v[q++]);
+				}
+				if (q + 17 > size) {
+					exr_error(filename, "broken channel list.");
+				}
+				c.type = (int)exr_u32(v + q + 1);
+				if (exr_u32(v + q + 9) != 1 || exr_u32(v + q + 13) != 1) {
+					exr_error(filename, "subsampled channels aren't supported.");
+				}
+				if (c.type < EXR_UINT || c.type > EXR_FLOAT) {
+					exr_error(filename, "unknown channel type.");
+				}
+				img.channels.push_back(c);
+				q += 17;
+			}
+		} else if (name == "compression" && size == 1) {
+			img.compression = v[0];
+		} else if (name == "dataWindow" && size == 16) {
+			for (int k=0; k<4; ++k) {
+				box[k] = (int)exr_u32(v + k * 4);
+			}
+			window = true;
+		}
+		p += size;
+	}
+
+	if (!window || box[2] < box[0] || box[3] < box[1] || img.channels.empty()) {
+		exr_error(filename, "header lacks channels or data window.");
+	}
+	switch (img.compression) {
+	case EXR_NONE:
+	case EXR_RLE:
+	case EXR_ZIPS:
+		img.block_lines = 1;
+		break;
+	case EXR_ZIP:
+		img.block_lines = 16;
+		break;
+	default:
+		exr_error(filename, "only uncompressed, RLE, ZIPS and ZIP EXRs are supported.");
+	}
+
+	img.w = (unsigned int)((int64_t)box[2] - box[0] + 1);
+	img.h = (unsigned int)((int64_t)box[3] - box[1] + 1);
+	img.y_min = box[1];
+	img.line_bytes = 0;
+	for (auto& c : img.channels) {
+		c.offset = img.line_bytes;
+		img.line_bytes += (size_t)img.w * exr_type_bytes(c.type);
+	}
+
+	if (header_only) {
+		return;
+	}
+	size_t chunks = (img.h + img.block_lines - 1) / img.block_lines;
+	if (chunks > (data.size() - p) / 8) {
+		exr_error(filename, "broken offset table.");
+	}
+	img.offsets.resize(chunks);
+	for (size_t k=0; k<chunks; ++k) {
+		img.offsets[k] = exr_u64(&data[p + k * 8]);
+	}
+}
+
+
+// The channel of layer whose name is one of names, tried in order, -1 when
+// there is none. An empty name takes the layer's first channel.
+inline int exr_find_channel(const EXRImage& img, std::string layer, std::vector<std::string> names)
+{
+	for (auto& name : names) {
+		for (size_t c=0; c<img.channels.size(); ++c) {
+			const std::string& full = img.channels[c].name;
+			size_t dot = full.rfind('.');
+			std::string owner = dot == std::string::npos ? "" : full.substr(0, dot);
+			std::string part = dot == std::string::npos ? full : full.substr(dot + 1);
+			bool in_layer = same_name(owner, layer)
+				|| (owner.size() > layer.size()
+					&& owner[owner.size() - layer.size() - 1] == '.'
+					&& same_name(owner.substr(owner.size() - layer.size()), layer));
+			if (in_layer && (name.empty() || same_name(part, name))) {
+				return (int)c;
+			}
+		}
+	}
+	return -1;
+}
+
+
+// Channels of the ten planes, d r g b a, n x y z, h, r, m. Diffuse alpha is
+// -1 when the layer has none. Normals are X Y Z or else R G B, the single
+// value layers take V, R or X, or else their first channel.
+inline void exr_pbr_channels(const EXRImage& img, const EXRLayers& layers, int channel[10], std::string filename)
+{
+	channel[0] = exr_find_channel(img, layers.d, { "R" });
+	channel[1] = exr_find_channel(img, layers.d, { "G" });
+	channel[2] = exr_find_channel(img, layers.d, { "B" });
+	channel[3] = exr_find_channel(img, layers.d, { "A" });
+	bool xyz = exr_find_channel(img, layers.n, { "X" }) >= 0;
+	channel[4] = exr_find_channel(img, layers.n, { xyz ? "X" : "R" });
+	channel[5] = exr_find_channel(img, layers.n, { xyz ? "Y" : "G" });
+	channel[6] = exr_find_channel(img, layers.n, { xyz ? "Z" : "B" });
+	channel[7] = exr_find_channel(img, layers.h, { "V", "R", "X", "" });
+	channel[8] = exr_find_channel(img, layers.r, { "V", "R", "X", "" });
+	channel[9] = exr_find_channel(img, layers.m, { "V", "R", "X", "" });
+
+	const char* planes[10] = { "d R", "d G", "d B", "", "n X", "n Y", "n Z", "h", "r", "m" };
+	bool missing = false;
+	for (int k=0; k<10; ++k) {
+		if (channel[k] < 0 && k != 3) {
+			OP("No channel for=[" << planes[k] << "]");
+			missing = true;
+		}
+	}
+	if (missing) {
+		for (auto& c : img.channels) {
+			OP("- channel=[" << c.name << "]");
+		}
+		OP("Set the layers with -exr-layers.");
+		exr_error(filename, "layers missing.");
+	}
+}
+
+
+// Undoes the byte predictor and splits the interleaved halves ZIP and RLE
+// compress, into out.
+inline void exr_unpredict(std::vector<unsigned char>& tmp, unsigned char* out)
+{
+	size_t n = tmp.size();
+	for (size_t i=1; i<n; ++i) {
+		tmp[i] = (unsigned char)(tmp[i - 1] + tmp[i] - 128);
+	}
+	size_t half = (n + 1) / 2;
+	for (size_t i=0; i<n; ++i) {
+		out[i] = (i & 1) ? tmp[half + i / 2] : tmp[i / 2];
+	}
+}
+
+
+inline bool exr_unrle(const unsigned char* in, size_t size, std::vector<unsigned char>& out)
+{
+	out.clear();
+	size_t p = 0;
+	while (p < size) {
+		int count = (signed char)in[p++];
+		if (count < 0) {
+			if (p + (size_t)-count > size) {
+				return false;
+			}
+			out.insert(out.end(), in + p, in + p - count);
+			p += (size_t)-count;
+		} else {
+			if (p >= size) {
+				return false;
+			}
+			out.insert(out.end(), (size_t)count + 1, in[p++]);
+		}
+	}
+	return true;
+}
+
+
+// Decodes channel[c] of every pixel into out[c][i * step[c]], pixel i
+// being x + y * w. A channel of -1 fills 1. Chunks decode in parallel.
+inline void exr_decode(
+	const std::vector<unsigned char>& data,
+	const EXRImage& img,
+	const int* channel,
+	int count,
+	float* out[],
+	const size_t step[],
+	std::string filename,
+	ThreadPool* pool = nullptr
+) {
+	std::atomic<bool> failed(false);
+	auto decode_chunks = [&](unsigned int k0, unsigned int k1) {
+		std::vector<unsigned char> packed;
+		std::vector<unsigned char> lines;
+		for (unsigned int k=k0; k<k1 && !failed; ++k) {
+			uint64_t at = img.offsets[k];
+			if (at > data.size() || data.size() - at < 8) {
+				exr_error(filename, "broken chunk offset.");
+			}
+			int64_t y = (int64_t)(int32_t)exr_u32(&data[at]) - img.y_min;
+			size_t size = exr_u32(&data[at + 4]);
+			if (y < 0 || y >= img.h || size > data.size() - at - 8) {
+				exr_error(filename, "broken chunk.");
+			}
+			unsigned int y0 = (unsigned int)y;
+			unsigned int rows = std::min(img.block_lines, img.h - y0);
+			size_t raw_size = img.line_bytes * rows;
+			const unsigned char* src = &data[at + 8];
+
+			// Chunks that don't get smaller are stored as they are.
+			if (img.compression != EXR_NONE && size < raw_size) {
+				packed.clear();
+				bool ok = img.compression == EXR_RLE
+					? exr_unrle(src, size, packed)
+					: lodepng::decompress(packed, src, size) == 0;
+				if (!ok || packed.size() != raw_size) {
+					exr_error(filename, "broken compressed chunk.");
+				}
+				lines.resize(raw_size);
+				exr_unpredict(packed, lines.data());
+				src = lines.data();
+			} else if (size != raw_size) {
+				exr_error(filename, "broken chunk size.");
+			}
+
+			for (unsigned int r=0; r<rows; ++r) {
+				const unsigned char* line = src + img.line_bytes * r;
+				size_t i0 = (size_t)(y0 + r) * img.w;
+				for (int c=0; c<count; ++c) {
+					float* o = out[c] + i0 * step[c];
+					if (channel[c] < 0) {
+						for (unsigned int x=0; x<img.w; ++x) {
+							o[x * step[c]] = 1.f;
+						}
+						continue;
+					}
+					const EXRChannel& ch = img.channels[channel[c]];
+					const unsigned char* v = line + ch.offset;
+					if (ch.type == EXR_HALF) {
+						for (unsigned int x=0; x<img.w; ++x) {
+							o[x * step[c]] = half_to_float((uint16_t)(v[x*2] | v[x*2 + 1] << 8));
+						}
+					} else if (ch.type == EXR_FLOAT) {
+						for (unsigned int x=0; x<img.w; ++x) {
+							uint32_t bits = exr_u32(v + x * 4);
+							std::memcpy(&o[x * step[c]], &bits, 4);
+						}
+					} else {
+						for (unsigned int x=0; x<img.w; ++x) {
+							o[x * step[c]] = (float)exr_u32(v + x * 4);
+						}
+					}
+				}
+			}
+		}
+	};
+
+	unsigned int chunks = (unsigned int)img.offsets.size();
+	if (!pool) {
+		decode_chunks(0, chunks);
+		return;
+	}
+	// Pool workers can't throw, errors are passed on once all are done.
+	pool->parallel_rows(0, chunks, [&](unsigned int k0, unsigned int k1) {
+		try {
+			decode_chunks(k0, k1);
+		} catch (...) {
+			failed = true;
+		}
+	});
+	if (failed) {
+		throw std::exception("Decoder error.");
+	}
+}
+
+
+// Blender's colour passes are scene linear, the _d PNGs they replace are
+// sRGB encoded.
+inline float linear_to_srgb(float v)
+{
+	v = std::min(std::max(v, 0.f), 1.f);
+	return v <= 0.0031308f ? v * 12.92f : 1.055f * std::pow(v, 1.f / 2.4f) - 0.055f;
+}
+
+
+inline float srgb_to_linear(float v)
+{
+	v = std::min(std::max(v, 0.f), 1.f);
+	return v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+}
+
+
+inline void encode_srgb(Col4* d, size_t size)
+{
+	for (size_t i=0; i<size; ++i) {
+		d[i].r = linear_to_srgb(d[i].r);
+		d[i].g = linear_to_srgb(d[i].g);
+		d[i].b = linear_to_srgb(d[i].b);
+	}
+}
+
+
+inline void load_exr(std::string filename, std::vector<unsigned char>& data, EXRImage& img)
+{
+	unsigned error = lodepng::load_file(data, filename);
+	if (error) {
+		OP("Decoder error " << error << ": " << lodepng_error_text(error));
+		OP("Filename=[" << filename << "]");
+		throw std::exception("Decoder error.");
+	}
+	exr_parse(data, img, filename);
+}
+
+
+// Size from the header, without reading the whole file.
+inline void exr_inspect(std::string filename, unsigned int& w, unsigned int& h)
+{
+	std::vector<unsigned char> data(EXR_HEADER_MAX);
+	std::FILE* file = std::fopen(filename.c_str(), "rb");
+	if (!file) {
+		exr_error(filename, "could not open.");
+	}
+	data.resize(std::fread(data.data(), 1, data.size(), file));
+	std::fclose(file);
+	EXRImage img;
+	exr_parse(data, img, filename, true);
+	w = img.w;
+	h = img.h;
+}
+
+
+// Decodes all maps at once straight into their planes.
+inline void read_exr_pbr(
+	std::string filename,
+	const EXRLayers& layers,
+	PBRMap& pbr,
+	unsigned int& w,
+	unsigned int& h,
+	ThreadPool* pool = nullptr
+) {
+	std::vector<unsigned char> data;
+	EXRImage img;
+	load_exr(filename, data, img);
+	int channel[10];
+	exr_pbr_channels(img, layers, channel, filename);
+
+	w = img.w;
+	h = img.h;
+	size_t size = (size_t)w * h;
+	pbr.d.resize(size);
+	pbr.n.resize(size);
+	pbr.h.resize(size);
+	pbr.r.resize(size);
+	pbr.m.resize(size);
+	float* out[10] = {
+		&pbr.d[0].r, &pbr.d[0].g, &pbr.d[0].b, &pbr.d[0].a,
+		&pbr.n[0].x, &pbr.n[0].y, &pbr.n[0].z,
+		pbr.h.data(), pbr.r.data(), pbr.m.data()
+	};
+	const size_t step[10] = { 4, 4, 4, 4, 3, 3, 3, 1, 1, 1 };
+	exr_decode(data, img, channel, 10, out, step, filename, pool);
+	encode_srgb(pbr.d.data(), size);
+}
+
+
+// The three maps as native floats, pixel interleaved: bytes[0] diffuse
+// RGBA, bytes[1] normal XYZ and bytes[2] hrm, from one decode of the file.
+inline void read_exr_maps(
+	std::string filename,
+	const EXRLayers& layers,
+	std::vector<unsigned char> bytes[3],
+	unsigned int& w,
+	unsigned int& h,
+	ThreadPool* pool = nullptr
+) {
+	std::vector<unsigned char> data;
+	EXRImage img;
+	load_exr(filename, data, img);
+	int channel[10];
+	exr_pbr_channels(img, layers, channel, filename);
+
+	w = img.w;
+	h = img.h;
+	size_t size = (size_t)w * h;
+	const int counts[3] = { 4, 3, 3 };
+	float* out[10];
+	size_t step[10];
+	int c = 0;
+	for (int k=0; k<3; ++k) {
+		bytes[k].resize(size * counts[k] * sizeof(float));
+		float* values = (float*)bytes[k].data();
+		for (int i=0; i<counts[k]; ++i, ++c) {
+			out[c] = values + i;
+			step[c] = counts[k];
+		}
+	}
+	exr_decode(data, img, channel, 10, out, step, filename, pool);
+	encode_srgb((Col4*)bytes[0].data(), size);
+}
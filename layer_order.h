@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cmath>
+
+
+// Pixels ranked together by the layer kernels. The loops over lanes have no
+// branches so the compiler can vectorize them.
+const int LAYER_LANES = 8;
+
+
+// Height factors of 4 layers for LAYER_LANES pixels.
+// After order_layers() slot 0 holds the top layer.
+struct LayerLanes
+{
+	float v[4][LAYER_LANES];
+	int k[4][LAYER_LANES];
+};
+
+
+// Swaps slots a and b in every lane where b belongs above a.
+// Higher factor goes on top, ties keep the lower layer id on top. That is
+// the order a stable sort on "a.v > b.v" gives.
+inline void order_layers_cmpx(LayerLanes& l, int a, int b)
+{
+	for (int i=0; i<LAYER_LANES; ++i) {
+		float va = l.v[a][i];
+		float vb = l.v[b][i];
+		int ka = l.k[a][i];
+		int kb = l.k[b][i];
+		bool swap = vb > va || (vb == va && kb < ka);
+		l.v[a][i] = swap ? vb : va;
+		l.v[b][i] = swap ? va : vb;
+		l.k[a][i] = swap ? kb : ka;
+		l.k[b][i] = swap ? ka : kb;
+	}
+}
+
+
+// Sorting network for 4 slots.
+inline void order_layers(LayerLanes& l)
+{
+	order_layers_cmpx(l, 0, 1);
+	order_layers_cmpx(l, 2, 3);
+	order_layers_cmpx(l, 0, 2);
+	order_layers_cmpx(l, 1, 3);
+	order_layers_cmpx(l, 1, 2);
+}
+
+
+// Blend weight of every ordered slot. The top layer takes its factor, each
+// layer underneath works in what the layers above left over.
+inline void layer_weights(LayerLanes& l, float eps, float out[4][LAYER_LANES])
+{
+	float sum_prev[LAYER_LANES] = {};
+	for (int j=0; j<4; ++j) {
+		for (int i=0; i<LAYER_LANES; ++i) {
+			float below = j < 3 ? l.v[j+1][i] : 0.f;
+			float dist = l.v[j][i] - below;
+			float f = dist > eps
+				? 1.f
+				: (dist < -eps ? 0.f : (dist + eps) / (2.f * eps));
+			float wt = (1.f - sum_prev[i]) * sqrt(sqrt(f));
+			out[j][i] = wt;
+			sum_prev[i] += wt;
+		}
+	}
+}
+
+
+// Folds mixing the layers bottom to top over a base of layer 0, each with
+// mix(dst, src, wt), into one coefficient per layer. The mix is then a single
+// weighted sum of the 4 layers.
+inline void mix_coefficients(unsigned char order, const float wt[4], float c[4])
+{
+	float rest = 1.f;
+	for (int k=0; k<4; ++k) {
+		c[k] = 0.f;
+	}
+	for (int j=0; j<4; ++j) {
+		int k = (order >> (2 * j)) & 3;
+		float f = wt[k] > 0.f ? wt[k] : 0.f;
+		c[k] = f * rest;
+		rest *= 1.f - f;
+	}
+	c[0] += rest;
+}
@@ -1,60 +1,44 @@
 #pragma once
 
+#include <algorithm>
+#include <cstring>
 #include <exception>
+#include <future>
 #include <string>
 #include <vector>
 
 #include "lodepng.h"
 
+#include "convert.h"
+#include "exr.h"
 #include "log.h"
+#include "parallel_deflate.h"
+#include "qoi.h"
+#include "thread_pool.h"
 #include "types.h"
 
 
-// Normal [0, 1]
-inline unsigned char byt(float val)
-{
-	return round(val * 255.f);
-}
-inline float flt(unsigned char val)
-{
-	return (float)val / 255.f;
-}
-
-// Vector [-1, 1]
-inline unsigned char bytv(float val)
-{
-	return round((val + 1.f) * 0.5 * 255.f);
-}
-inline float fltv(unsigned char val)
-{
-	return ((float)val / 255.f) * 2.f - 1.f;
-}
-inline Vec3 normalize(Vec3 v)
-{
-	float len = sqrt(v.x*v.x + v.y*v.y + v.z*v.z);
-	v.x /= len;
-	v.y /= len;
-	v.z /= len;
-	return v;
-}
+// Bytes per pixel of the planes reserve_pbr makes.
+const size_t PBR_PIXEL_BYTES = sizeof(Col4) + sizeof(Vec3) + 4 * sizeof(float);
 
 
-void reserve_pbr(
+inline void reserve_pbr(
 	PBRMap& pbr,
 	unsigned int w,
 	unsigned int h
 ) {
-	auto size = w*h;
-	pbr.d = std::vector<Col4>(size, Col4{ 0.f, 0.f, 0.f, 1.f });
-	pbr.n = std::vector<Vec3>(size, Vec3{ 0.f, 0.f, 0.f });
-	pbr.h = std::vector<float>(size, 0.f);
-	pbr.hn = std::vector<float>(size, 0.f);
-	pbr.r = std::vector<float>(size, 0.f);
-	pbr.m = std::vector<float>(size, 0.f);
+	// Reuses what the planes already hold, for jobs that run again.
+	size_t size = (size_t)w * h;
+	pbr.d.assign(size, Col4{ 0.f, 0.f, 0.f, 1.f });
+	pbr.n.assign(size, Vec3{ 0.f, 0.f, 0.f });
+	pbr.h.assign(size, 0.f);
+	pbr.hn.assign(size, 0.f);
+	pbr.r.assign(size, 0.f);
+	pbr.m.assign(size, 0.f);
 }
 
 
-void free_pbr(PBRMap& pbr)
+inline void free_pbr(PBRMap& pbr)
 {
 	pbr.d.clear();
 	pbr.n.clear();
@@ -64,137 +48,551 @@ void free_pbr(PBRMap& pbr)
 }
 
 
-void read_file(
+// Layout of pixels decoded in the PNG's own colour type and bit depth.
+struct PixelFormat
+{
+	unsigned int channels = 4;	// 1 grey, 2 grey alpha, 3 rgb, 4 rgba
+	unsigned int bitdepth = 8;	// 8 or 16, big endian, or 32, native float
+
+	inline size_t pixel_bytes()
+	{
+		return channels * bitdepth / 8;
+	}
+
+	// Channel holding r, g, b or a (0-3), -1 when alpha is missing.
+	inline int channel(int c)
+	{
+		if (c == 3) {
+			return channels == 2 || channels == 4 ? channels - 1 : -1;
+		}
+		return channels <= 2 ? 0 : c;
+	}
+
+	// Value [0, 1] of r, g, b or a of the pixel at px.
+	inline float unorm(const unsigned char* px, int c)
+	{
+		int k = channel(c);
+		if (k < 0) {
+			return 1.f;
+		}
+		if (bitdepth == 32) {
+			float v;
+			std::memcpy(&v, px + k*4, 4);
+			return v;
+		}
+		if (bitdepth == 16) {
+			return (float)(px[k*2] << 8 | px[k*2 + 1]) / 65535.f;
+		}
+		return flt(px[k]);
+	}
+
+	// Value [-1, 1] of r, g or b of the pixel at px. Floats are signed
+	// already.
+	inline float snorm(const unsigned char* px, int c)
+	{
+		return bitdepth == 32 ? unorm(px, c) : unorm(px, c) * 2.f - 1.f;
+	}
+};
+
+
+// Format a PNG decodes to without expanding it to RGBA8: grey stays one
+// channel and 16-bit stays 16-bit. Palettes, low bit depths and colour keys
+// become 8-bit.
+inline unsigned inspect_png(
+	const std::vector<unsigned char>& png,
+	PixelFormat& format,
+	unsigned int& w,
+	unsigned int& h
+) {
+	lodepng::State state;
+	unsigned error = lodepng_inspect(&w, &h, &state, png.data(), png.size());
+	if (error) {
+		return error;
+	}
+
+	LodePNGColorMode& color = state.info_png.color;
+	bool key = color.key_defined != 0;
+	format.bitdepth = color.bitdepth == 16 ? 16 : 8;
+	switch (color.colortype) {
+	case LCT_GREY:
+		format.channels = key ? 2 : 1;
+		break;
+	case LCT_GREY_ALPHA:
+		format.channels = 2;
+		break;
+	case LCT_RGB:
+		format.channels = key ? 4 : 3;
+		break;
+	case LCT_RGBA:
+		format.channels = 4;
+		break;
+	default:
+		format.channels = 4;
+		format.bitdepth = 8;
+		break;
+	}
+	return 0;
+}
+
+
+// Path of a source map, <filename><suffix>.png or .qoi when there is no
+// PNG but a QOI. An EXR holds all of them.
+inline std::string source_path(std::string filename, std::string suffix)
+{
+	if (is_exr_path(filename)) {
+		return filename;
+	}
+	std::string png = std::string(filename).append(suffix).append(".png");
+	std::string qoi = std::string(filename).append(suffix).append(".qoi");
+	std::FILE* f = std::fopen(png.c_str(), "rb");
+	if (f) {
+		std::fclose(f);
+		return png;
+	}
+	f = std::fopen(qoi.c_str(), "rb");
+	if (f) {
+		std::fclose(f);
+		return qoi;
+	}
+	return png;
+}
+
+
+inline void qoi_error(std::string filename)
+{
+	OP("Decoder error: broken QOI.");
+	OP("Filename=[" << filename << "]");
+	throw std::exception("Decoder error.");
+}
+
+
+// PNGs and QOIs are told apart by their contents.
+inline void inspect_image(
+	std::string filename,
+	PixelFormat& format,
+	unsigned int& w,
+	unsigned int& h
+) {
+	std::vector<unsigned char> png;
+	unsigned error = lodepng::load_file(png, filename);
+	if (!error && is_qoi(png.data(), png.size())) {
+		if (!qoi_inspect(png.data(), png.size(), w, h, format.channels)) {
+			qoi_error(filename);
+		}
+		format.bitdepth = 8;
+		return;
+	}
+	if (!error) {
+		error = inspect_png(png, format, w, h);
+	}
+	if (error) {
+		OP("Decoder error " << error << ": " << lodepng_error_text(error));
+		OP("Filename=[" << filename << "]");
+		throw std::exception("Decoder error.");
+	}
+}
+
+
+// Decodes in the format inspect_png picks, QOIs in their own channels.
+inline void read_image(
 	std::string filename,
 	std::vector<unsigned char>& bytes,
+	PixelFormat& format,
 	unsigned int& w,
 	unsigned int& h
 ) {
-	unsigned error = lodepng::decode(bytes, w, h, filename);
+	std::vector<unsigned char> png;
+	unsigned error = lodepng::load_file(png, filename);
+	if (!error && is_qoi(png.data(), png.size())) {
+		if (!qoi_decode(png, bytes, w, h, format.channels)) {
+			qoi_error(filename);
+		}
+		format.bitdepth = 8;
+		return;
+	}
+	if (!error) {
+		error = inspect_png(png, format, w, h);
+	}
+	if (!error) {
+		LodePNGColorType type =
+			format.channels == 1 ? LCT_GREY
+			: format.channels == 2 ? LCT_GREY_ALPHA
+			: format.channels == 3 ? LCT_RGB
+			: LCT_RGBA;
+		error = lodepng::decode(bytes, w, h, png, type, format.bitdepth);
+	}
 	if (error) {
 		OP("Decoder error " << error << ": " << lodepng_error_text(error));
 		OP("Filename=[" << filename << "]");
 		throw std::exception("Decoder error.");
 	}
-	// 4 bytes per pixel, ordered RGBARGBA
 }
 
 
-void read_col3(
+// Floats of 8, 16 or 32-bit channel values, in their own layout.
+inline void decode_values(
+	const unsigned char* bytes,
+	PixelFormat& f,
+	size_t values,
+	bool snorm,
+	float* out
+) {
+	if (f.bitdepth == 32) {
+		std::memcpy(out, bytes, values * sizeof(float));
+		return;
+	}
+	if (f.bitdepth == 8) {
+		if (snorm) {
+			snorm8_to_float(bytes, out, values);
+		} else {
+			unorm8_to_float(bytes, out, values);
+		}
+		return;
+	}
+	for (size_t i=0; i<values; ++i) {
+		float v = (float)(bytes[i*2] << 8 | bytes[i*2 + 1]) / 65535.f;
+		out[i] = snorm ? v * 2.f - 1.f : v;
+	}
+}
+
+
+// Pixels [i0, i0 + n) of decode_pixels, values holding n pixels' floats.
+inline void decode_pixel_range(
+	const unsigned char* bytes,
+	PixelFormat& f,
+	size_t i0,
+	size_t n,
+	bool snorm,
+	int count,
+	float* out[],
+	size_t step,
+	float* values
+) {
+	decode_values(bytes + i0 * f.pixel_bytes(), f, n * f.channels, snorm, values);
+	for (int c=0; c<count; ++c) {
+		int k = f.channel(c);
+		float* o = out[c] + i0 * step;
+		for (size_t i=0; i<n; ++i) {
+			o[i * step] = k < 0 ? 1.f : values[i * f.channels + k];
+		}
+	}
+}
+
+
+// Converts channels r, g, b, a up to count of the decoded pixels, channel c
+// of pixel i going to out[c][i * step]. When the pixels are already laid
+// out that way they are converted in one go, else a chunk at a time.
+inline void decode_pixels(
+	std::vector<unsigned char>& bytes,
+	PixelFormat& f,
+	size_t size,
+	bool snorm,
+	int count,
+	float* out[],
+	size_t step
+) {
+	bool direct = f.channels == (unsigned int)count && step == (size_t)count;
+	for (int c=0; c<count; ++c) {
+		direct = direct && out[c] == out[0] + c;
+	}
+	if (direct) {
+		decode_values(bytes.data(), f, size * count, snorm, out[0]);
+		return;
+	}
+
+	const size_t CHUNK = 1 << 14;
+	std::vector<float> values(CHUNK * f.channels);
+	for (size_t i0=0; i0<size; i0+=CHUNK) {
+		size_t n = std::min(CHUNK, size - i0);
+		decode_pixel_range(bytes.data(), f, i0, n, snorm, count, out, step, values.data());
+	}
+}
+
+
+inline void read_col3(
 	std::string filename,
 	std::vector<Col3>& pixels,
 	unsigned int& w,
 	unsigned int& h
 ) {
 	std::vector<unsigned char> bytes;
-	read_file(filename, bytes, w, h);
+	PixelFormat f;
+	read_image(filename, bytes, f, w, h);
 
-	auto size = w * h;
+	size_t size = (size_t)w * h;
 	pixels.resize(size);
-	for (int i=0; i<size; ++i) {
-		pixels[i].r = flt(bytes[i*4]);
-		pixels[i].g = flt(bytes[i*4 + 1]);
-		pixels[i].b = flt(bytes[i*4 + 2]);		
-	}
+	float* out[3] = { &pixels[0].r, &pixels[0].g, &pixels[0].b };
+	decode_pixels(bytes, f, size, false, 3, out, 3);
 }
 
 
-void read_col4(
+inline void read_col4(
 	std::string filename,
 	std::vector<Col4>& pixels,
 	unsigned int& w,
 	unsigned int& h
 ) {
 	std::vector<unsigned char> bytes;
-	read_file(filename, bytes, w, h);
+	PixelFormat f;
+	read_image(filename, bytes, f, w, h);
 
-	auto size = w * h;
+	size_t size = (size_t)w * h;
 	pixels.resize(size);
-	for (int i=0; i<size; ++i) {
-		pixels[i].r = flt(bytes[i*4]);
-		pixels[i].g = flt(bytes[i*4 + 1]);
-		pixels[i].b = flt(bytes[i*4 + 2]);
-		pixels[i].a = flt(bytes[i*4 + 3]);
-	}
+	float* out[4] = { &pixels[0].r, &pixels[0].g, &pixels[0].b, &pixels[0].a };
+	decode_pixels(bytes, f, size, false, 4, out, 4);
 }
 
 
-void read_float(
+inline void read_float(
 	std::string filename,
 	std::vector<float>& pixels,
 	unsigned int& w,
 	unsigned int& h
 ) {
 	std::vector<unsigned char> bytes;
-	read_file(filename, bytes, w, h);
+	PixelFormat f;
+	read_image(filename, bytes, f, w, h);
 
-	auto size = w * h;
+	size_t size = (size_t)w * h;
 	pixels.resize(size);
-	for (int i=0; i<size; ++i) {
-		pixels[i] = flt(bytes[i*4]);
-	}
+	float* out[1] = { pixels.data() };
+	decode_pixels(bytes, f, size, false, 1, out, 1);
 }
 
 
-void read_vec3(
+inline void read_vec3(
 	std::string filename,
 	std::vector<Vec3>& pixels,
 	unsigned int& w,
 	unsigned int& h
 ) {
 	std::vector<unsigned char> bytes;
-	read_file(filename, bytes, w, h);
+	PixelFormat f;
+	read_image(filename, bytes, f, w, h);
 
-	auto size = w * h;
+	size_t size = (size_t)w * h;
 	pixels.resize(size);
-	for (int i=0; i<size; ++i) {
-		pixels[i].x = fltv(bytes[i*4]);
-		pixels[i].y = fltv(bytes[i*4 + 1]);
-		pixels[i].z = fltv(bytes[i*4 + 2]);
+	float* out[3] = { &pixels[0].x, &pixels[0].y, &pixels[0].z };
+	decode_pixels(bytes, f, size, true, 3, out, 3);
+}
+
+
+// Reads the three hrm channels straight into their planes.
+inline void read_hrm(
+	std::string filename,
+	PBRMap& pbr,
+	unsigned int& w,
+	unsigned int& h
+) {
+	std::vector<unsigned char> bytes;
+	PixelFormat f;
+	read_image(filename, bytes, f, w, h);
+
+	size_t size = (size_t)w * h;
+	pbr.h.resize(size);
+	pbr.r.resize(size);
+	pbr.m.resize(size);
+	float* out[3] = { pbr.h.data(), pbr.r.data(), pbr.m.data() };
+	decode_pixels(bytes, f, size, false, 3, out, 1);
+}
+
+
+// Format of source map k, 0 _d, 1 _n or 2 _hrm, from its header. Maps in
+// an EXR are floats, RGBA, XYZ and hrm.
+inline void inspect_source(
+	std::string filename,
+	int k,
+	PixelFormat& format,
+	unsigned int& w,
+	unsigned int& h
+) {
+	const char* suffixes[3] = { "_d", "_n", "_hrm" };
+	if (is_exr_path(filename)) {
+		exr_inspect(filename, w, h);
+		format.channels = k == 0 ? 4 : 3;
+		format.bitdepth = 32;
+		return;
+	}
+	inspect_image(source_path(filename, suffixes[k]), format, w, h);
+}
+
+
+// Decodes source map k of PNGs or QOIs in the format inspect_source gives.
+inline void read_source(
+	std::string filename,
+	int k,
+	std::vector<unsigned char>& bytes,
+	PixelFormat& format,
+	unsigned int& w,
+	unsigned int& h
+) {
+	const char* suffixes[3] = { "_d", "_n", "_hrm" };
+	read_image(source_path(filename, suffixes[k]), bytes, format, w, h);
+}
+
+
+// Decodes all source maps of an EXR in the formats inspect_source gives,
+// reading and inflating the file once for the three of them.
+inline void read_exr_sources(
+	std::string filename,
+	const EXRLayers& layers,
+	std::vector<unsigned char> bytes[3],
+	PixelFormat format[3],
+	unsigned int& w,
+	unsigned int& h,
+	ThreadPool* pool = nullptr
+) {
+	read_exr_maps(filename, layers, bytes, w, h, pool);
+	for (int k=0; k<3; ++k) {
+		format[k].channels = k == 0 ? 4 : 3;
+		format[k].bitdepth = 32;
 	}
 }
 
 
-void load_pbr(
+inline void load_pbr(
 	std::string _filename,
 	PBRMap& pbr,
 	unsigned int& w,
-	unsigned int& h
+	unsigned int& h,
+	const EXRLayers& layers = EXRLayers(),
+	ThreadPool* pool = nullptr
 ) {
 	OP("Load PBR begin.");
 	std::string filename(_filename);
 
-	// diffuse
-	read_col4(std::string(filename).append("_d.png").c_str(), pbr.d, w, h);
+	// An EXR is decoded once for all maps.
+	if (is_exr_path(filename)) {
+		read_exr_pbr(filename, layers, pbr, w, h, pool);
+		OP("Load PBR end.");
+		return;
+	}
 
-	// normal
-	read_vec3(std::string(filename).append("_n.png").c_str(), pbr.n, w, h);
+	// Each map is decoded on a thread of the pool straight into its planes.
+	unsigned int dw = 0U, dh = 0U;
+	unsigned int nw = 0U, nh = 0U;
+	unsigned int hw = 0U, hh = 0U;
+	std::exception_ptr error[3];
+	auto decode = [&](unsigned int k0, unsigned int k1) {
+		for (unsigned int k=k0; k<k1; ++k) {
+			try {
+				if (k == 0) {
+					read_col4(source_path(filename, "_d"), pbr.d, dw, dh);
+				} else if (k == 1) {
+					read_vec3(source_path(filename, "_n"), pbr.n, nw, nh);
+				} else {
+					read_hrm(source_path(filename, "_hrm"), pbr, hw, hh);
+				}
+			} catch (...) {
+				error[k] = std::current_exception();
+			}
+		}
+	};
+	if (pool) {
+		pool->parallel_rows(0, 3, decode);
+	} else {
+		decode(0, 3);
+	}
 
-	// hrm
-	std::vector<Col4> hrm;
-	read_col4(std::string(filename).append("_hrm.png").c_str(), hrm, w, h);
-	auto size = w * h;
-	pbr.h.resize(size);
-	pbr.r.resize(size);
-	pbr.m.resize(size);
-	for (int i=0; i<size; ++i) {
-		pbr.h[i] = hrm[i].r;
-		pbr.r[i] = hrm[i].g;
-		pbr.m[i] = hrm[i].b;
+	// Rethrows decoder errors.
+	for (int k=0; k<3; ++k) {
+		if (error[k]) {
+			std::rethrow_exception(error[k]);
+		}
+	}
+
+	if (dw != nw || dw != hw || dh != nh || dh != hh) {
+		OP("Map sizes differ: _d=[" << dw << "x" << dh << "]"
+			<< " _n=[" << nw << "x" << nh << "]"
+			<< " _hrm=[" << hw << "x" << hh << "]");
+		throw std::exception("Map size mismatch.");
 	}
+	w = dw;
+	h = dh;
 
 	OP("Load PBR end.");
 }
 
 
-void write_file(
+// Encoder speed against size trade-offs.
+// - fastest - stored blocks, no filtering. For intermediates.
+// - fast - small window, greedy matching.
+// - default - lodepng defaults.
+// - small - full 32K window, longest matches.
+enum PNGPreset { PNG_FASTEST = 0, PNG_FAST, PNG_DEFAULT, PNG_SMALL };
+const char* const PNG_PRESET_NAMES[4] = { "fastest", "fast", "default", "small" };
+
+
+inline PNGPreset parse_png_preset(std::string name)
+{
+	for (int k=0; k<4; ++k) {
+		if (name == PNG_PRESET_NAMES[k]) {
+			return (PNGPreset)k;
+		}
+	}
+	OP("Unknown png preset=[" << name << "], using default.");
+	return PNG_DEFAULT;
+}
+
+
+inline void png_preset_settings(PNGPreset preset, LodePNGEncoderSettings& enc)
+{
+	LodePNGCompressSettings& z = enc.zlibsettings;
+	switch (preset) {
+	case PNG_FASTEST:
+		z.btype = 0;
+		enc.filter_strategy = LFS_ZERO;
+		break;
+	case PNG_FAST:
+		z.windowsize = 256;
+		z.nicematch = 16;
+		z.lazymatching = 0;
+		enc.filter_strategy = LFS_MINSUM;
+		break;
+	case PNG_SMALL:
+		z.windowsize = 32768;
+		z.nicematch = 258;
+		z.lazymatching = 1;
+		break;
+	default:
+		break;
+	}
+}
+
+
+// 4 bytes per pixel, ordered RGBARGBA
+// With a pool the deflate runs in parallel strips.
+inline unsigned encode_png(
+	std::vector<unsigned char>& png,
+	const std::vector<unsigned char>& bytes,
+	unsigned int w,
+	unsigned int h,
+	PNGPreset preset,
+	ThreadPool* pool = nullptr
+) {
+	lodepng::State state;
+	png_preset_settings(preset, state.encoder);
+	if (pool && pool->size() > 1) {
+		state.encoder.zlibsettings.custom_zlib = parallel_zlib;
+		state.encoder.zlibsettings.custom_context = pool;
+	}
+	return lodepng::encode(png, bytes, w, h, state);
+}
+
+
+inline void write_file(
 	std::string filename,
 	std::vector<unsigned char>& bytes,
 	unsigned int& w,
-	unsigned int& h
+	unsigned int& h,
+	PNGPreset preset = PNG_DEFAULT,
+	ThreadPool* pool = nullptr
 ) {
-	// 4 bytes per pixel, ordered RGBARGBA
-	unsigned error = lodepng::encode(filename, bytes, w, h);
+	std::vector<unsigned char> png;
+	unsigned error = encode_png(png, bytes, w, h, preset, pool);
+	if (!error) {
+		error = lodepng::save_file(png, filename);
+	}
 	if (error) {
 		OP("Encoder error " << error << ": " << lodepng_error_text(error));
 		OP("Filename=[" << filename << "]");
@@ -203,111 +601,239 @@ void write_file(
 }
 
 
-void write_col3(
+// Encodes the three maps of a tyled texture with every preset, and as QOI,
+// and reports speed and size of each and how fast they decode, writing
+// nothing. The maps are read from PNGs or QOIs.
+inline void bench_png_presets(std::string _filename, ThreadPool* pool = nullptr)
+{
+	OP("PNG preset bench begin.");
+	const char* suffixes[3] = { "_d", "_n", "_hrm" };
+	std::vector<unsigned char> bytes[3];
+	unsigned int w[3];
+	unsigned int h[3];
+	for (int k=0; k<3; ++k) {
+		std::string filename = source_path(_filename, suffixes[k]);
+		std::vector<unsigned char> file;
+		unsigned error = lodepng::load_file(file, filename);
+		unsigned int channels;
+		if (!error && is_qoi(file.data(), file.size())) {
+			if (!qoi_decode(file, bytes[k], w[k], h[k], channels, true)) {
+				qoi_error(filename);
+			}
+			continue;
+		}
+		if (!error) {
+			error = lodepng::decode(bytes[k], w[k], h[k], file);
+		}
+		if (error) {
+			OP("Decoder error " << error << ": " << lodepng_error_text(error));
+			OP("Filename=[" << filename << "]");
+			throw std::exception("Decoder error.");
+		}
+	}
+
+	double mb = 0.0;
+	for (int k=0; k<3; ++k) {
+		mb += bytes[k].size() / (1024.0 * 1024.0);
+	}
+
+	// PNG presets, then QOI.
+	for (int p=0; p<5; ++p) {
+		double ms = 0.0;
+		double decode_ms = 0.0;
+		size_t out_bytes = 0;
+		for (int k=0; k<3; ++k) {
+			std::vector<unsigned char> encoded;
+			std::vector<unsigned char> decoded;
+			unsigned int dw, dh, channels;
+			auto start = std::chrono::steady_clock::now();
+			unsigned error = 0;
+			if (p < 4) {
+				error = encode_png(encoded, bytes[k], w[k], h[k], (PNGPreset)p, pool);
+			} else {
+				qoi_encode(bytes[k].data(), w[k], h[k], 4, true, encoded);
+			}
+			ms += ms_since(start);
+			if (error) {
+				OP("Encoder error " << error << ": " << lodepng_error_text(error));
+				throw std::exception("Encoder error.");
+			}
+			out_bytes += encoded.size();
+
+			start = std::chrono::steady_clock::now();
+			if (p < 4) {
+				error = lodepng::decode(decoded, dw, dh, encoded);
+			} else {
+				error = qoi_decode(encoded, decoded, dw, dh, channels) ? 0 : 1;
+			}
+			decode_ms += ms_since(start);
+			if (error || decoded != bytes[k]) {
+				OP("Bench round trip failed.");
+				throw std::exception("Decoder error.");
+			}
+		}
+		OP((p < 4 ? "preset=[" : "format=[") << (p < 4 ? PNG_PRESET_NAMES[p] : "qoi") << "]"
+			<< " ms=[" << ms << "] MB/s=[" << mb / (ms / 1000.0) << "] bytes=[" << out_bytes << "]"
+			<< " decode MB/s=[" << mb / (decode_ms / 1000.0) << "]");
+	}
+	OP("PNG preset bench end.");
+}
+
+
+// Quantizes count floats per pixel, stepping step floats, into RGBA bytes.
+// Channels past count are 255.
+inline void encode_pixels(
+	const float* in,
+	size_t size,
+	int count,
+	size_t step,
+	bool normals,
+	std::vector<unsigned char>& bytes
+) {
+	const size_t CHUNK = 1 << 14;
+	std::vector<float> values(CHUNK * count);
+	std::vector<unsigned char> quantized(CHUNK * count);
+	bytes.resize(size * 4);
+	for (size_t i0=0; i0<size; i0+=CHUNK) {
+		size_t n = std::min(CHUNK, size - i0);
+		const float* src = in + i0 * step;
+		if (step == (size_t)count) {
+			std::memcpy(values.data(), src, n * count * sizeof(float));
+		} else {
+			for (size_t i=0; i<n; ++i)
+				for (int c=0; c<count; ++c) {
+					values[i * count + c] = src[i * step + c];
+				}
+		}
+		if (normals) {
+			normals_to_snorm8(values.data(), quantized.data(), n);
+		} else {
+			float_to_unorm8(values.data(), quantized.data(), n * count);
+		}
+		unsigned char* o = &bytes[i0 * 4];
+		for (size_t i=0; i<n; ++i) {
+			for (int c=0; c<4; ++c) {
+				o[i*4 + c] = c < count ? quantized[i * count + c] : 255;
+			}
+		}
+	}
+}
+
+
+inline void write_col3(
 	std::string filename,
 	std::vector<Col3>& pixels,
 	unsigned int w,
-	unsigned int h
+	unsigned int h,
+	PNGPreset preset = PNG_DEFAULT,
+	ThreadPool* pool = nullptr
 ) {
 	std::vector<unsigned char> bytes;
-	auto size = w * h;
-	bytes.resize(size * 4);
-	for (int i=0; i<size; ++i) {
-		bytes[i*4] = byt(pixels[i].r);
-		bytes[i*4+1] = byt(pixels[i].g);
-		bytes[i*4+2] = byt(pixels[i].b);
-		bytes[i*4+3] = byt(1.0);
-	}
-	write_file(filename, bytes, w, h);
+	encode_pixels(&pixels[0].r, (size_t)w * h, 3, 3, false, bytes);
+	write_file(filename, bytes, w, h, preset, pool);
 }
 
 
-void write_col4(
+inline void write_col4(
 	std::string filename,
 	std::vector<Col4>& pixels,
 	unsigned int w,
-	unsigned int h
+	unsigned int h,
+	PNGPreset preset = PNG_DEFAULT,
+	ThreadPool* pool = nullptr
 ) {
 	std::vector<unsigned char> bytes;
-	auto size = w * h;
+	size_t size = (size_t)w * h;
 	bytes.resize(size * 4);
-	for (int i=0; i<size; ++i) {
-		bytes[i*4] = byt(pixels[i].r);
-		bytes[i*4+1] = byt(pixels[i].g);
-		bytes[i*4+2] = byt(pixels[i].b);
-		bytes[i*4+3] = byt(pixels[i].a);
-	}
-	write_file(filename, bytes, w, h);
+	float_to_unorm8(&pixels[0].r, bytes.data(), size * 4);
+	write_file(filename, bytes, w, h, preset, pool);
 }
 
 
-void write_float(
+inline void write_float(
 	std::string filename,
 	std::vector<float>& pixels,
 	unsigned int w,
-	unsigned int h
+	unsigned int h,
+	PNGPreset preset = PNG_DEFAULT,
+	ThreadPool* pool = nullptr
 ) {
 	std::vector<unsigned char> bytes;
-	auto size = w * h;
-	bytes.resize(size * 4);
-	for (int i=0; i<size; ++i) {
-		bytes[i*4] = byt(pixels[i]);
-		bytes[i*4+1] = byt(pixels[i]);
-		bytes[i*4+2] = byt(pixels[i]);
-		bytes[i*4+3] = byt(1.0);
+	encode_pixels(pixels.data(), (size_t)w * h, 1, 1, false, bytes);
+	size_t size = (size_t)w * h;
+	for (size_t i=0; i<size; ++i) {
+		bytes[i*4+1] = bytes[i*4];
+		bytes[i*4+2] = bytes[i*4];
 	}
-	write_file(filename, bytes, w, h);
+	write_file(filename, bytes, w, h, preset, pool);
 }
 
 
-void write_vec3(
+// Normals are normalized before they are quantized.
+inline void write_vec3(
 	std::string filename,
 	std::vector<Vec3>& pixels,
 	unsigned int w,
-	unsigned int h
+	unsigned int h,
+	PNGPreset preset = PNG_DEFAULT,
+	ThreadPool* pool = nullptr
 ) {
 	std::vector<unsigned char> bytes;
-	auto size = w * h;
-	bytes.resize(size * 4);
-	Vec3 v;
-	for (int i=0; i<size; ++i) {
-		v = normalize(pixels[i]);
-		bytes[i*4] = bytv(pixels[i].x);
-		bytes[i*4+1] = bytv(pixels[i].y);
-		bytes[i*4+2] = bytv(pixels[i].z);
-		bytes[i*4+3] = byt(1.0);
-	}
-	write_file(filename, bytes, w, h);
+	encode_pixels(&pixels[0].x, (size_t)w * h, 3, 3, true, bytes);
+	write_file(filename, bytes, w, h, preset, pool);
 }
 
 
-void save_pbr(
+inline void save_pbr(
 	std::string _filename,
 	PBRMap& pbr,
 	unsigned int w,
-	unsigned int h
+	unsigned int h,
+	PNGPreset preset = PNG_DEFAULT,
+	ThreadPool* pool = nullptr
 ) {
 	OP("Save PBR begin.");
 	std::string filename(_filename);
 
+	// Each map is quantized and encoded on its own thread.
+	double d_ms = 0.0;
+	double n_ms = 0.0;
+	double hrm_ms = 0.0;
+
 	// diffuse
-	write_col4(std::string(filename).append("_d.png").c_str(), pbr.d, w, h);
+	auto d = std::async(std::launch::async, [&]() {
+		auto start = std::chrono::steady_clock::now();
+		write_col4(std::string(filename).append("_d.png").c_str(), pbr.d, w, h, preset, pool);
+		d_ms = ms_since(start);
+	});
 
 	// normal
-	write_vec3(std::string(filename).append("_n.png").c_str(), pbr.n, w, h);
+	auto n = std::async(std::launch::async, [&]() {
+		auto start = std::chrono::steady_clock::now();
+		write_vec3(std::string(filename).append("_n.png").c_str(), pbr.n, w, h, preset, pool);
+		n_ms = ms_since(start);
+	});
 
 	// hrm
-	std::vector<Col3> hrm;
-	auto size = w * h;
-	hrm.resize(size);
-	for (int i=0; i<size; ++i) {
-		hrm[i].r = pbr.h[i];
-		hrm[i].g = pbr.r[i];
-		hrm[i].b = pbr.m[i];
-	}
-	write_col3(std::string(filename).append("_hrm.png").c_str(), hrm, w, h);
-
-	OP("Create RHM map.");
-	//read_float(filename.append("_h.png").c_str(), pbr.h, w, h);
+	auto hrm = std::async(std::launch::async, [&]() {
+		auto start = std::chrono::steady_clock::now();
+		std::vector<Col3> hrm;
+		size_t size = (size_t)w * h;
+		hrm.resize(size);
+		for (size_t i=0; i<size; ++i) {
+			hrm[i].r = pbr.h[i];
+			hrm[i].g = pbr.r[i];
+			hrm[i].b = pbr.m[i];
+		}
+		write_col3(std::string(filename).append("_hrm.png").c_str(), hrm, w, h, preset, pool);
+		hrm_ms = ms_since(start);
+	});
+
+	// Rethrows encoder errors.
+	d.get();
+	n.get();
+	hrm.get();
+
+	OP("Encode ms: _d=[" << d_ms << "] _n=[" << n_ms << "] _hrm=[" << hrm_ms << "]");
 	OP("Save PBR end.");
 }
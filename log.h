@@ -1,5 +1,36 @@
 #pragma once
 
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
 
-#define OP(x) std::cout << x << std::endl
+// Lines go out whole, so jobs running side by side don't mix them up. Each
+// thread can put a prefix in front of its own lines. Defined in
+// pbrtyler.cpp.
+extern thread_local std::string log_prefix;
+extern std::mutex log_mutex;
+extern std::function<void(const std::string&)> log_output;	// empty - stdout
+
+#define OP(x) do { std::ostringstream op_line; op_line << x; log_line(op_line.str()); } while (0)
+
+
+inline void log_line(const std::string& line)
+{
+	std::unique_lock<std::mutex> lock(log_mutex);
+	if (log_output) {
+		log_output(log_prefix + line);
+		return;
+	}
+	std::cout << log_prefix << line << std::endl;
+}
+
+
+inline double ms_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(
+		std::chrono::steady_clock::now() - start
+	).count();
+}
@@ -2,16 +2,24 @@
 
 #include <algorithm>
 #include <cmath>
+#include <mutex>
 #include <vector>
 
 #include "FastNoiseLite.h"
 
+#include "blur.h"
 #include "functions.h"
+#include "layer_order.h"
 #include "log.h"
 #include "pixeltools.h"
+#include "thread_pool.h"
 #include "types.h"
 
 
+// Pixels per band of the final mix when the sink takes any.
+const size_t MIX_BAND_PIXELS = 1 << 16;
+
+
 class MapTools
 {
 public:
@@ -21,17 +29,42 @@ public:
 	unsigned int h;
 	float hnf;
 	float he;
+	ThreadPool* pool = nullptr;
+	BlurKernel blur_kernel;
+	bool verify_mix = false;
+	float verify_tolerance = 0.5f / 255.f;
+	bool mix_failed = false;	// a verified mix went over the tolerance
 
-	inline int _i(int x, int y)
+	inline size_t _i(size_t x, size_t y)
 	{
 		return y * w + x;
 	}
 
-	inline int _ii(int x, int y, int x_offset, int y_offset)
+	inline size_t _ii(size_t x, size_t y, size_t x_offset, size_t y_offset)
 	{
 		return (y + y_offset) * src_w + (x + x_offset);
 	}
 
+	// Runs fn over bands of rows [y0, y1), in parallel if there is a pool.
+	// Passes must only write pixels of their own rows.
+	void for_rows(std::function<void(unsigned int, unsigned int)> fn)
+	{
+		for_range(0, h, fn);
+	}
+
+	void for_range(
+		unsigned int begin,
+		unsigned int end,
+		std::function<void(unsigned int, unsigned int)> fn
+	)
+	{
+		if (pool) {
+			pool->parallel_rows(begin, end, fn);
+		} else {
+			fn(begin, end);
+		}
+	}
+
 
 	std::vector<float> blur_map(
 		std::vector<float>& map
@@ -40,17 +73,7 @@ public:
 		OP("Blur map.");
 
 		std::vector<float> out;
-		out.resize(map.size());
-
-		for (int y=0; y<h; ++y)
-			for (int x=0; x<w; ++x) {
-				int i = _i(x, y);
-				for (int yy=-2; yy<=2; ++yy)
-					for (int xx=-2; xx<=2; ++xx) {
-						int j = _i(modulo(x+xx, w), modulo(y+yy, h));
-						out[i] += map[j] * gaussian_blur(xx, yy, 0.83f);
-					}
-			}
+		blur_wrap(map, out, w, h, blur_kernel, pool);
 
 		return out;
 	}
@@ -68,10 +91,10 @@ public:
 
 		OP("Create blend map.");
 		std::vector<float> bm;
-		bm.resize(w*h);
-		for (int y=0; y<h; ++y)
-			for (int x=0; x<w; ++x) {
-				int i = _i(x, y);
+		bm.resize((size_t)w*h);
+		for (unsigned int y=0; y<h; ++y)
+			for (unsigned int x=0; x<w; ++x) {
+				size_t i = _i(x, y);
 				bm[i] = blend_factor(src_f[i], dst_f[i], src.h[i], dst_f[i]);
 			}
 		if (blur) {
@@ -79,27 +102,39 @@ public:
 		}
 
 		OP("Mix in pixels.");
-		for (int y=0; y<h; ++y)
-			for (int x=0; x<w; ++x) {
-				int i = _i(x, y);
+		for (unsigned int y=0; y<h; ++y)
+			for (unsigned int x=0; x<w; ++x) {
+				size_t i = _i(x, y);
 				copy_pixel(src, dst, src_f, dst_f, i, i, bm[i]);
 			}
 
 		OP("Blend map end.");
 	}
 
-	struct idedFloat
+	void blend_map_4_way(
+		PBRMap& dst,
+		PBRView s1,
+		PBRView s2,
+		PBRView s3,
+		PBRView s4,
+		std::vector<float>& f1,
+		std::vector<float>& f2,
+		std::vector<float>& f3,
+		std::vector<float>& f4,
+		bool blur
+	)
 	{
-		int k;
-		float v;
-	};
+		PBRMapSink sink(dst, w);
+		blend_map_4_way(sink, s1, s2, s3, s4, f1, f2, f3, f4, blur);
+	}
 
+	// Mixes band by band into the sink, the blended map is never whole.
 	void blend_map_4_way(
-		PBRMap& dst,	// pre filled as base
-		PBRMap& s1,
-		PBRMap& s2,
-		PBRMap& s3,
-		PBRMap& s4,
+		PBRRowSink& sink,
+		PBRView s1,
+		PBRView s2,
+		PBRView s3,
+		PBRView s4,
 		std::vector<float>& f1,
 		std::vector<float>& f2,
 		std::vector<float>& f3,
@@ -112,56 +147,55 @@ public:
 		OP("Reserving maps.");
 		std::vector<float> bm[4];
 		for (int i=0; i<4; ++i) {
-			bm[i].resize(w*h, 0.f);
+			bm[i].resize((size_t)w*h, 0.f);
 		}
-		std::vector<idedFloat> ha;
-		ha.resize(4);
-
-		std::vector< std::vector<idedFloat> > hb;
-		hb.resize(w*h);
+		// Layer order per pixel, top first, packed 2 bits per layer.
+		std::vector<unsigned char> order;
+		order.resize((size_t)w*h);
 
 		OP("Compute blend factors.");
-		for (int y=0; y<h; ++y)
-			for (int x=0; x<w; ++x) {
-				int i = _i(x, y);
-
-				ha[0].k = 0;
-				ha[1].k = 1;
-				ha[2].k = 2;
-				ha[3].k = 3;
-				ha[0].v = height_factor(f1[i], s1.h[i]);
-				ha[1].v = height_factor(f2[i], s2.h[i]);
-				ha[2].v = height_factor(f3[i], s3.h[i]);
-				ha[3].v = height_factor(f4[i], s4.h[i]);
-
-				std::sort(
-					ha.begin(),
-					ha.end(),
-					[](idedFloat a, idedFloat b)
-					{
-						return a.v > b.v;
+		PBRView ss[4] = {
+			s1, s2, s3, s4
+		};
+		std::vector<float>* ff[4] = {
+			&f1, &f2, &f3, &f4
+		};
+		for_rows([&](unsigned int y0, unsigned int y1) {
+			LayerLanes l;
+			float wt[4][LAYER_LANES];
+			for (unsigned int y=y0; y<y1; ++y)
+				for (unsigned int x0=0; x0<w; x0+=LAYER_LANES) {
+					size_t i0 = _i(x0, y);
+					int n = (int)std::min(w - x0, (unsigned int)LAYER_LANES);
+
+					for (int j=0; j<4; ++j) {
+						float* hj = ss[j].h + ss[j].idx(x0, y);
+						for (int i=0; i<LAYER_LANES; ++i) {
+							l.k[j][i] = j;
+							l.v[j][i] = i < n
+								? height_factor((*ff[j])[i0+i], hj[i])
+								: 0.f;
+						}
 					}
-				);
-
-				// Top layer factor most important.
-				// Then factor underneath work in (1 - top factor).
 
-				for (int j=0; j<4; ++j) {
-					float sum_prev = 0.f;
-					for (int k=0; k<j; ++k) {
-						sum_prev += bm[ha[k].k][i];
-					}
-					if (j < 3) {
-						bm[ha[j].k][i] = (1.f - sum_prev)
-							* sqrt(sqrt(factor_eps(ha[j].v, ha[j+1].v, he)));
-					} else {
-						bm[ha[j].k][i] = (1.f - sum_prev)
-							* sqrt(sqrt(factor_eps(ha[j].v, 0.f, he)));
+					// Top layer factor most important.
+					// Then factor underneath work in (1 - top factor).
+					order_layers(l);
+					layer_weights(l, he, wt);
+
+					for (int i=0; i<n; ++i) {
+						for (int j=0; j<4; ++j) {
+							bm[l.k[j][i]][i0+i] = wt[j][i];
+						}
+						order[i0+i] = (unsigned char)(
+							l.k[0][i]
+							| l.k[1][i] << 2
+							| l.k[2][i] << 4
+							| l.k[3][i] << 6
+						);
 					}
 				}
-
-				hb[i] = ha;
-			}
+		});
 
 		// Blur maps.
 		if (blur) {
@@ -172,33 +206,77 @@ public:
 		}
 
 		// Normalize factors - need to sum to 1.
-		for (int y=0; y<h; ++y)
-		for (int x=0; x<w; ++x) {
-			int i = _i(x, y);
-			float len = 0.f;
-			for (int j=0; j<4; ++j) {
-				len += bm[j][i];
-			}
-			for (int j=0; j<4; ++j) {
-				bm[j][i] /= len;
+		for_rows([&](unsigned int y0, unsigned int y1) {
+			for (unsigned int y=y0; y<y1; ++y)
+			for (unsigned int x=0; x<w; ++x) {
+				size_t i = _i(x, y);
+				float len = 0.f;
+				for (int j=0; j<4; ++j) {
+					len += bm[j][i];
+				}
+				for (int j=0; j<4; ++j) {
+					bm[j][i] /= len;
+				}
 			}
-		}
+		});
 
 		OP("Mix in pixels.");
-		PBRMap* ss[4] = {
-			&s1, &s2, &s3, &s4
-		};
-		for (int y=0; y<h; ++y)
-		for (int x=0; x<w; ++x) {
-			int i = _i(x, y);
-			copy_pixel(*ss[0], dst, f1, f1, i, i, 1.f, false);
-			for (int j=3; j>=0; --j) {
-				int k = hb[i][j].k;
-				float v = hb[i][j].v;
-				copy_pixel(*ss[k], dst, f1, f1, i, i,
-					bm[k][i],
-					false
-				);
+		unsigned int rows = sink.band_rows();
+		if (rows == 0) {
+			rows = std::max(1U, (unsigned int)(MIX_BAND_PIXELS / w));
+		}
+		unsigned int bands = (h + rows - 1) / rows;
+		std::mutex mutex;
+		float max_diff = 0.f;
+		size_t over = 0;
+
+		for_range(0, bands, [&](unsigned int b0, unsigned int b1) {
+			PBRMap band;
+			float wt[4];
+			float c[4];
+			size_t si[4];
+			float band_max = 0.f;
+			size_t band_over = 0;
+			for (unsigned int b=b0; b<b1; ++b) {
+				unsigned int y0 = b * rows;
+				unsigned int y1 = std::min(y0 + rows, h);
+				size_t size = (size_t)w * (y1 - y0);
+				band.d.resize(size);
+				band.n.resize(size);
+				band.h.resize(size);
+				band.r.resize(size);
+				band.m.resize(size);
+
+				for (unsigned int y=y0; y<y1; ++y)
+				for (unsigned int x=0; x<w; ++x) {
+					size_t i = _i(x, y);
+					for (int k=0; k<4; ++k) {
+						wt[k] = bm[k][i];
+						si[k] = ss[k].idx(x, y);
+					}
+					mix_coefficients(order[i], wt, c);
+					composite_pixel(ss, si, band, c, (size_t)(y - y0) * w + x);
+				}
+
+				if (verify_mix) {
+					verify_mix_band(band, y0, y1, ss, bm, order, band_max, band_over);
+				}
+				sink.put_rows(y0, y1, PBRView(band, w));
+			}
+			if (verify_mix) {
+				std::unique_lock<std::mutex> lock(mutex);
+				max_diff = std::max(max_diff, band_max);
+				over += band_over;
+			}
+		});
+
+		if (verify_mix) {
+			OP("Verify mix: max_diff=[" << max_diff << "] tolerance=[" << verify_tolerance << "]");
+			if (over > 0) {
+				OP("Verify mix FAILED - pixels over tolerance=[" << over << "/" << (size_t)w*h << "]");
+				mix_failed = true;
+			} else {
+				OP("Verify mix passed.");
 			}
 		}
 
@@ -206,11 +284,64 @@ public:
 	}
 
 
+	// Compares rows [y0, y1) of the mix against the old sequential copy_pixel
+	// lerps, bottom layer to top, over a base of s1.
+	void verify_mix_band(
+		PBRMap& band,
+		unsigned int y0,
+		unsigned int y1,
+		PBRView ss[4],
+		std::vector<float> bm[4],
+		std::vector<unsigned char>& order,
+		float& max_diff,
+		size_t& over
+	)
+	{
+		PBRMap legacy;
+		legacy.d.resize(1);
+		legacy.n.resize(1);
+		legacy.h.resize(1);
+		legacy.r.resize(1);
+		legacy.m.resize(1);
+
+		for (unsigned int y=y0; y<y1; ++y)
+		for (unsigned int x=0; x<w; ++x) {
+			size_t i = _i(x, y);
+			size_t bi = (size_t)(y - y0) * w + x;
+			copy_planes(ss[0], legacy, ss[0].idx(x, y), 0);
+			unsigned char o = order[i];
+			for (int j=3; j>=0; --j) {
+				int k = (o >> (2 * j)) & 3;
+				copy_planes(ss[k], legacy, ss[k].idx(x, y), 0, bm[k][i]);
+			}
+
+			float diff[10] = {
+				band.d[bi].r - legacy.d[0].r,
+				band.d[bi].g - legacy.d[0].g,
+				band.d[bi].b - legacy.d[0].b,
+				band.d[bi].a - legacy.d[0].a,
+				band.n[bi].x - legacy.n[0].x,
+				band.n[bi].y - legacy.n[0].y,
+				band.n[bi].z - legacy.n[0].z,
+				band.h[bi] - legacy.h[0],
+				band.r[bi] - legacy.r[0],
+				band.m[bi] - legacy.m[0],
+			};
+			float pixel_max = 0.f;
+			for (int c=0; c<10; ++c) {
+				pixel_max = std::max(pixel_max, std::abs(diff[c]));
+			}
+			max_diff = std::max(max_diff, pixel_max);
+			if (pixel_max > verify_tolerance) {
+				++over;
+			}
+		}
+	}
+
+
 	void copy_chunk(
-		PBRMap& src,
+		PBRView src,
 		PBRMap& dst,
-		std::vector<float>& src_f,
-		std::vector<float>& out_f,
 		Rect2 from,
 		Vec2 to
 	)
@@ -226,8 +357,8 @@ public:
 		int dy;
 
 		// Indexes.
-		int si;
-		int di;
+		size_t si;
+		size_t di;
 
 		// Copy pixels.
 		for (int ry=0; ry<from.h; ++ry) {
@@ -236,10 +367,10 @@ public:
 			for (int rx=0; rx<from.w; ++rx) {
 				sx = from.x + rx;
 				dx = to.x + rx;
-				si = _i(sx, sy);
+				si = src.idx(sx, sy);
 				di = _i(dx, dy);
 
-				copy_pixel(src, dst, src_f, out_f, si, di);
+				copy_planes(src, dst, si, di);
 			}
 		}
 
@@ -247,12 +378,33 @@ public:
 	}
 
 
+	// Same move as copy_chunk for the influence factors, which change with
+	// the settings while the pixels don't.
+	void copy_fac_chunk(
+		std::vector<float>& src_f,
+		std::vector<float>& out_f,
+		Rect2 from,
+		Vec2 to
+	)
+	{
+		for (int ry=0; ry<from.h; ++ry) {
+			int sy = from.y + ry;
+			int dy = to.y + ry;
+			for (int rx=0; rx<from.w; ++rx) {
+				int sx = from.x + rx;
+				int dx = to.x + rx;
+				out_f[_i(dx, dy)] = src_f[_i(sx, sy)];
+			}
+		}
+	}
+
+
 	void copy_from_wide_map(PBRMap& src, PBRMap& dst, int x_offset, int y_offset)
 	{
 		OP("Copy from wide map begin.");
 		std::vector<float> placeholder;
-		for (int y=0; y<h; ++y)
-			for (int x=0; x<w; ++x) {
+		for (unsigned int y=0; y<h; ++y)
+			for (unsigned int x=0; x<w; ++x) {
 				copy_pixel(
 					src,
 					dst,
@@ -293,50 +445,68 @@ public:
 	}
 
 
-	void influence_map_base(std::vector<float>& map, float fac_power)
+	inline float influence_base(int x, int y, float fac_power)
 	{
 		int dist;
 		int mind = w / 8;
 		int maxd = w / 2;
 		float fac;
-		map.resize(w*h);
-		for (int y=0; y<h; ++y)
-			for (int x=0; x<w; ++x) {
-				dist = distance_from_center_radial(x, y);
-				fac = 1.f - clamp(dist / (float)(maxd - mind), 0.f, 1.f);
-				map[_i(x, y)] = pow(fac, fac_power);
-			}
+		dist = distance_from_center_radial(x, y);
+		fac = 1.f - clamp(dist / (float)(maxd - mind), 0.f, 1.f);
+		return pow(fac, fac_power);
 	}
 
 
-	void influence_map_corner(std::vector<float>& map, float fac_power)
+	inline float influence_corner(int x, int y, float fac_power)
 	{
 		int dist;
 		int mind = w / 8;
 		int maxd = w / 2;
 		float fac;
-		map.resize(w*h);
-		for (int y=0; y<h; ++y)
-			for (int x=0; x<w; ++x) {
-				dist = distance_from_center_radial(x, y);
-				fac = 1.f - clamp(dist / (float)(maxd - mind), 0.f, 1.f);
-				map[_i(x, y)] = pow(fac, fac_power);
-			}
+		dist = distance_from_center_radial(x, y);
+		fac = 1.f - clamp(dist / (float)(maxd - mind), 0.f, 1.f);
+		return pow(fac, fac_power);
 	}
 
 
-	void influence_map_edge(std::vector<float>& map, float fac_power)
+	inline float influence_edge(int x, int y, float fac_power)
 	{
 		float dist;
 		float mind = w / 8;
 		float maxd = w / 2;
 		float fac;
-		map.resize(w*h);
-		for (int y=0; y<h; ++y)
-			for (int x=0; x<w; ++x) {
-				dist = distance_from_center_radial(x, y);
-				fac = 1.f - clamp(dist / (float)(maxd - mind), 0.f, 1.f);
-				map[_i(x, y)] = pow(fac, fac_power);
+		dist = distance_from_center_radial(x, y);
+		fac = 1.f - clamp(dist / (float)(maxd - mind), 0.f, 1.f);
+		return pow(fac, fac_power);
+	}
+
+
+	void influence_map_base(std::vector<float>& map, float fac_power)
+	{
+		map.resize((size_t)w*h);
+		for (unsigned int y=0; y<h; ++y)
+			for (unsigned int x=0; x<w; ++x) {
+				map[_i(x, y)] = influence_base(x, y, fac_power);
+			}
+	}
+
+
+	void influence_map_corner(std::vector<float>& map, float fac_power)
+	{
+		map.resize((size_t)w*h);
+		for (unsigned int y=0; y<h; ++y)
+			for (unsigned int x=0; x<w; ++x) {
+				map[_i(x, y)] = influence_corner(x, y, fac_power);
+			}
+	}
+
+
+	void influence_map_edge(std::vector<float>& map, float fac_power)
+	{
+		map.resize((size_t)w*h);
+		for (unsigned int y=0; y<h; ++y)
+			for (unsigned int x=0; x<w; ++x) {
+				map[_i(x, y)] = influence_edge(x, y, fac_power);
 			}
 	}
 
@@ -347,9 +517,9 @@ public:
 		float mind = w / 4;
 		float maxd = w * 7 / 8;
 		float fac;
-		map.resize(w*h);
-		for (int y=0; y<h; ++y)
-			for (int x=0; x<w; ++x) {
+		map.resize((size_t)w*h);
+		for (unsigned int y=0; y<h; ++y)
+			for (unsigned int x=0; x<w; ++x) {
 				dist = distance_from_center_box(x, y);
 				fac = clamp(dist / (float)(maxd - mind), 0.f, 1.f);
 				map[_i(x, y)] = pow(fac, 1.f);
@@ -359,7 +529,40 @@ public:
 
 	void influence_map_empty(std::vector<float>& map)
 	{
-		map = std::vector<float>(w*h, 0.0);
+		map.assign((size_t)w*h, 0.f);
+	}
+
+
+	// Height noise with the same look at every output size.
+	FastNoiseLite height_noise(int seed)
+	{
+		FastNoiseLite ns;
+		ns.SetNoiseType(FastNoiseLite::NoiseType_OpenSimplex2);
+		ns.SetFrequency(1.5f / (float)w);
+		ns.SetFractalGain(0.5);
+		ns.SetFractalLacunarity(2.f);
+		ns.SetFractalOctaves(8);
+		ns.SetSeed(seed);
+		return ns;
+	}
+
+
+	inline float fac_noise(
+		float fac,
+		FastNoiseLite& noise,
+		float noise_factor,
+		int x,
+		int y
+	)
+	{
+		float f = clamp(
+			fac * (1.f - noise_factor)
+			+ noise_factor
+			* (noise.GetNoise((float)x, (float)y) * 0.5f + 0.5f),
+			0.f,
+			1.f
+		);
+		return 1.f * fac + (1.f - fac) * f;
 	}
 
 
@@ -369,17 +572,10 @@ public:
 		float noise_factor
 	)
 	{
-		for (int y=0; y<h; ++y)
-		for (int x=0; x<w; ++x) {
-			int i = _i(x, y);
-			float f = clamp(
-				map[i] * (1.f - noise_factor)
-				+ noise_factor
-				* (noise.GetNoise((float)x, (float)y) * 0.5f + 0.5f),
-				0.f,
-				1.f
-			);
-			map[i] = 1.f * map[i] + (1.f - map[i]) * f;
+		for (unsigned int y=0; y<h; ++y)
+		for (unsigned int x=0; x<w; ++x) {
+			size_t i = _i(x, y);
+			map[i] = fac_noise(map[i], noise, noise_factor, x, y);
 		}
 	};
 
@@ -389,9 +585,9 @@ public:
 		FastNoiseLite& noise,
 		float height_noise_factor
 	) {
-		for (int y=0; y<h; ++y)
-		for (int x=0; x<w; ++x) {
-			int i = _i(x, y);
+		for (unsigned int y=0; y<h; ++y)
+		for (unsigned int x=0; x<w; ++x) {
+			size_t i = _i(x, y);
 			map.hn[i] = clamp(
 				map.h[i] * (1.f - height_noise_factor)
 					+ height_noise_factor
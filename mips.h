@@ -0,0 +1,347 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "convert.h"
+#include "exr.h"
+#include "functions.h"
+#include "loader.h"
+#include "log.h"
+#include "maptools.h"
+#include "output_sink.h"
+#include "types.h"
+
+
+// ----------------------------------------------------------------------------
+// Mip chain.
+//
+// Each level halves the one above in float with a separable 1 3 3 1 filter.
+// Its taps reach one pixel past the 2x2 footprint on each side and wrap
+// around the edges, as the maps are seamless, so every level tiles like
+// level 0 does. Diffuse is sRGB encoded and filtered in linear light.
+// Normals are renormalized on every level.
+// ----------------------------------------------------------------------------
+
+// Halo a tile needs around itself to make its part of level 1.
+const int MIP_HALO = 2;
+
+
+// Levels down to 1x1, level 0 included.
+inline unsigned int mip_levels(unsigned int w, unsigned int h)
+{
+	unsigned int levels = 1U;
+	while ((w >> levels) > 0 || (h >> levels) > 0) {
+		++levels;
+	}
+	return levels;
+}
+
+
+// Taps of pixel x of the next level along an axis of n pixels, unwrapped.
+// Axes already 1 pixel long pass through.
+inline int mip_taps(unsigned int x, unsigned int n, int tap[4], float wt[4])
+{
+	if (n == 1) {
+		tap[0] = 0;
+		wt[0] = 1.f;
+		return 1;
+	}
+	const float filter[4] = { 1.f / 8.f, 3.f / 8.f, 3.f / 8.f, 1.f / 8.f };
+	for (int k=0; k<4; ++k) {
+		tap[k] = 2 * (int)x - 1 + k;
+		wt[k] = filter[k];
+	}
+	return 4;
+}
+
+
+// Pixels [x0, x1) of rows [y0, y1) of the level below src, which is
+// sw by sh. Source pixel (x, y) is read at src.idx(x - ox, y - oy), after
+// wrapping x and y when wrap_x and wrap_y are set. A tile with a halo of
+// wrapped pixels passes its origin and no wrap instead.
+inline void downsample_rows(
+	PBRView src,
+	unsigned int sw,
+	unsigned int sh,
+	int ox,
+	int oy,
+	bool wrap_x,
+	bool wrap_y,
+	PBRView dst,
+	unsigned int x0,
+	unsigned int x1,
+	unsigned int y0,
+	unsigned int y1
+) {
+	for (unsigned int y=y0; y<y1; ++y) {
+		int ty[4];
+		float wy[4];
+		int ny = mip_taps(y, sh, ty, wy);
+		for (int j=0; j<ny; ++j) {
+			ty[j] = (wrap_y ? modulo(ty[j], sh) : ty[j]) - oy;
+		}
+
+		for (unsigned int x=x0; x<x1; ++x) {
+			int tx[4];
+			float wx[4];
+			int nx = mip_taps(x, sw, tx, wx);
+			for (int i=0; i<nx; ++i) {
+				tx[i] = (wrap_x ? modulo(tx[i], sw) : tx[i]) - ox;
+			}
+
+			Col4 d = { 0.f, 0.f, 0.f, 0.f };
+			Vec3 n = { 0.f, 0.f, 0.f };
+			float h = 0.f;
+			float r = 0.f;
+			float m = 0.f;
+			for (int j=0; j<ny; ++j)
+				for (int i=0; i<nx; ++i) {
+					size_t s = src.idx(tx[i], ty[j]);
+					float f = wx[i] * wy[j];
+					d.r += srgb_to_linear(src.d[s].r) * f;
+					d.g += srgb_to_linear(src.d[s].g) * f;
+					d.b += srgb_to_linear(src.d[s].b) * f;
+					d.a += src.d[s].a * f;
+					n.x += src.n[s].x * f;
+					n.y += src.n[s].y * f;
+					n.z += src.n[s].z * f;
+					h += src.h[s] * f;
+					r += src.r[s] * f;
+					m += src.m[s] * f;
+				}
+
+			size_t o = dst.idx(x, y);
+			dst.d[o] = Col4{ linear_to_srgb(d.r), linear_to_srgb(d.g), linear_to_srgb(d.b), d.a };
+			dst.n[o] = normalize(n);
+			dst.h[o] = h;
+			dst.r[o] = r;
+			dst.m[o] = m;
+		}
+	}
+}
+
+
+// Passes level 0 on to out band by band and makes level 1 from the bands on
+// the way, so level 0 isn't kept whole. Level 1 rows with all their taps in
+// one band are made from it; rows near a band's edges are kept only until
+// the band on the other side is in.
+class PBRMipSink : public PBRRowSink
+{
+public:
+	PBRMap level1;
+
+	PBRMipSink(PBRRowSink& _out, unsigned int _w, unsigned int _h)
+		: out(_out), w(_w), h(_h), w1(std::max(1U, _w / 2)), h1(std::max(1U, _h / 2))
+	{
+		reserve_pbr(level1, w1, h1);
+		done.assign(h1, 0);
+		have.assign(h, 0);
+		uses.assign(h, 0);
+		for (unsigned int y=0; y<h1; ++y) {
+			int ty[4];
+			float wy[4];
+			int n = mip_taps(y, h, ty, wy);
+			for (int j=0; j<n; ++j) {
+				++uses[modulo(ty[j], h)];
+			}
+		}
+	}
+
+	unsigned int band_rows() override
+	{
+		return out.band_rows();
+	}
+
+	void put_rows(unsigned int y0, unsigned int y1, PBRView rows) override
+	{
+		out.put_rows(y0, y1, rows);
+
+		// Level 1 rows tapping the band, the first and last through the wrap.
+		std::vector<unsigned int> inside;
+		std::vector<unsigned int> across;
+		auto sort_row = [&](unsigned int y) {
+			int ty[4];
+			float wy[4];
+			int n = mip_taps(y, h, ty, wy);
+			bool all = true;
+			bool any = false;
+			for (int j=0; j<n; ++j) {
+				unsigned int t = (unsigned int)modulo(ty[j], h);
+				all = all && ty[j] >= (int)y0 && ty[j] < (int)y1;
+				any = any || (t >= y0 && t < y1);
+			}
+			if (all) {
+				inside.push_back(y);
+			} else if (any) {
+				across.push_back(y);
+			}
+		};
+		unsigned int c0 = y0 > 2 ? (y0 - 1) / 2 : 0U;
+		unsigned int c1 = std::min(h1, y1 / 2 + 1);
+		for (unsigned int y=c0; y<c1; ++y) {
+			sort_row(y);
+		}
+		if (c0 > 0) {
+			sort_row(0);
+		}
+		if (c1 < h1) {
+			sort_row(h1 - 1);
+		}
+
+		for (unsigned int y : inside) {
+			downsample_rows(rows, w, h, 0, (int)y0, true, false, PBRView(level1, w1), 0, w1, y, y + 1);
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		for (unsigned int y=y0; y<y1; ++y) {
+			have[y] = 1;
+		}
+		for (unsigned int y : inside) {
+			finish_row(y);
+		}
+		for (unsigned int y : across) {
+			if (!done[y]) {
+				make_across(y, y0, y1, rows);
+			}
+		}
+		for (unsigned int y=y0; y<y1; ++y) {
+			if (uses[y] > 0) {
+				PBRMap& row = kept[y];
+				row.d.resize(w);
+				row.n.resize(w);
+				row.h.resize(w);
+				row.r.resize(w);
+				row.m.resize(w);
+				copy_row(rows, rows.idx(0, y - y0), PBRView(row, w));
+			}
+		}
+	}
+
+private:
+	PBRRowSink& out;
+	unsigned int w;
+	unsigned int h;
+	unsigned int w1;
+	unsigned int h1;
+	std::mutex mutex;
+	std::vector<unsigned char> done;	// level 1 rows made
+	std::vector<unsigned char> have;	// level 0 rows in
+	std::vector<unsigned char> uses;	// level 1 rows still to make from each level 0 row
+	std::map<unsigned int, PBRMap> kept;
+
+
+	// A row of w pixels from src at index i.
+	void copy_row(PBRView src, size_t i, PBRView dst)
+	{
+		std::copy(src.d + i, src.d + i + w, dst.d);
+		std::copy(src.n + i, src.n + i + w, dst.n);
+		std::copy(src.h + i, src.h + i + w, dst.h);
+		std::copy(src.r + i, src.r + i + w, dst.r);
+		std::copy(src.m + i, src.m + i + w, dst.m);
+	}
+
+
+	// Level 1 row y is made, its level 0 rows have one use less.
+	void finish_row(unsigned int y)
+	{
+		done[y] = 1;
+		int ty[4];
+		float wy[4];
+		int n = mip_taps(y, h, ty, wy);
+		for (int j=0; j<n; ++j) {
+			unsigned int t = (unsigned int)modulo(ty[j], h);
+			if (--uses[t] == 0) {
+				kept.erase(t);
+			}
+		}
+	}
+
+
+	// Level 1 row y from kept rows and the band [y0, y1), once all its
+	// rows are in.
+	void make_across(unsigned int y, unsigned int y0, unsigned int y1, PBRView rows)
+	{
+		int ty[4];
+		float wy[4];
+		int n = mip_taps(y, h, ty, wy);
+		for (int j=0; j<n; ++j) {
+			if (!have[modulo(ty[j], h)]) {
+				return;
+			}
+		}
+
+		// Its taps one after another, read without wrapping them.
+		PBRMap taps;
+		taps.d.resize((size_t)w * n);
+		taps.n.resize((size_t)w * n);
+		taps.h.resize((size_t)w * n);
+		taps.r.resize((size_t)w * n);
+		taps.m.resize((size_t)w * n);
+		for (int j=0; j<n; ++j) {
+			unsigned int t = (unsigned int)modulo(ty[j], h);
+			PBRView dst(taps, 0, j, w);
+			if (t >= y0 && t < y1) {
+				copy_row(rows, rows.idx(0, t - y0), dst);
+			} else {
+				copy_row(PBRView(kept[t], w), 0, dst);
+			}
+		}
+		downsample_rows(PBRView(taps, w), w, h, 0, ty[0], true, false, PBRView(level1, w1), 0, w1, y, y + 1);
+		finish_row(y);
+	}
+};
+
+
+// Streams a whole level into the output in bands.
+inline void write_level(
+	PBROutputSink& out,
+	unsigned int level,
+	PBRMap& map,
+	unsigned int w,
+	unsigned int h,
+	MapTools& mt
+) {
+	unsigned int rows = out.band_rows(level);
+	unsigned int bands = (h + rows - 1) / rows;
+	mt.for_range(0, bands, [&](unsigned int b0, unsigned int b1) {
+		for (unsigned int b=b0; b<b1; ++b) {
+			unsigned int y0 = b * rows;
+			unsigned int y1 = std::min(y0 + rows, h);
+			out.put_level_rows(level, y0, y1, PBRView(map, 0, y0, w));
+		}
+	});
+}
+
+
+// Writes level 1, which is w by h, and every level after it into out.
+inline void write_mips(
+	PBROutputSink& out,
+	PBRMap& level1,
+	unsigned int w,
+	unsigned int h,
+	MapTools& mt
+) {
+	PBRMap map = std::move(level1);
+	for (unsigned int l=1; l<out.levels; ++l) {
+		OP("Mip level=[" << l << "] w=[" << w << "] h=[" << h << "]");
+		write_level(out, l, map, w, h, mt);
+		if (l + 1 == out.levels) {
+			break;
+		}
+
+		unsigned int nw = std::max(1U, w / 2);
+		unsigned int nh = std::max(1U, h / 2);
+		PBRMap next;
+		reserve_pbr(next, nw, nh);
+		mt.for_range(0, nh, [&](unsigned int y0, unsigned int y1) {
+			downsample_rows(PBRView(map, w), w, h, 0, 0, true, true, PBRView(next, nw), 0, nw, y0, y1);
+		});
+		map = std::move(next);
+		w = nw;
+		h = nh;
+	}
+}
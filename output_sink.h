@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "convert.h"
+#include "dds.h"
+#include "loader.h"
+#include "log.h"
+#include "png_stream.h"
+#include "qoi.h"
+#include "types.h"
+
+
+// ----------------------------------------------------------------------------
+// Output maps.
+//
+// png writes _d, _n and _hrm PNGs. dds writes GPU ready block compressed
+// DDS files instead: _d as sRGB BC7, _n as BC5 holding x and y, and _hrm as
+// BC1, or BC7 when picked. qoi writes lossless QOIs, much faster than PNGs, for intermediates.
+// With mip levels, DDS files hold the whole chain and PNGs and QOIs get a
+// set of files per level, <output>_mip<level>_d.png and so on.
+// ----------------------------------------------------------------------------
+
+enum OutputFormat { FORMAT_PNG = 0, FORMAT_DDS, FORMAT_QOI };
+const char* const OUTPUT_FORMAT_NAMES[3] = { "png", "dds", "qoi" };
+
+
+inline OutputFormat parse_output_format(std::string name)
+{
+	for (int k=0; k<3; ++k) {
+		if (name == OUTPUT_FORMAT_NAMES[k]) {
+			return (OutputFormat)k;
+		}
+	}
+	OP("Unknown format=[" << name << "], using png.");
+	return FORMAT_PNG;
+}
+
+
+// An output path ending in .dds or .qoi picks its format. The extension is
+// taken off, the map suffixes go before it. A .png stays part of the name,
+// out.png makes out.png_d.png as it always has.
+inline bool output_format_from_extension(std::string& filename, OutputFormat& format)
+{
+	for (int k=FORMAT_DDS; k<3; ++k) {
+		std::string ext = std::string(".").append(OUTPUT_FORMAT_NAMES[k]);
+		if (filename.size() > ext.size()
+			&& filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0) {
+			filename.resize(filename.size() - ext.size());
+			format = (OutputFormat)k;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// Quantizes count pixels of map k starting at index i of src into 8-bit
+// pixels of channels, 3 or 4 for diffuse, 3 for the others. Normals are
+// normalized first.
+inline void quantize_map(int k, int channels, PBRView src, size_t i, size_t count, unsigned char* out)
+{
+	switch (k) {
+	case 0:
+		if (channels == 4) {
+			float_to_unorm8(&src.d[i].r, out, count * 4);
+		} else {
+			std::vector<unsigned char> rgba(count * 4);
+			float_to_unorm8(&src.d[i].r, rgba.data(), count * 4);
+			for (size_t p=0; p<count; ++p) {
+				out[p*3] = rgba[p*4];
+				out[p*3+1] = rgba[p*4+1];
+				out[p*3+2] = rgba[p*4+2];
+			}
+		}
+		break;
+	case 1:
+		normals_to_snorm8(&src.n[i].x, out, count);
+		break;
+	default:
+		{
+			std::vector<unsigned char> planes(count * 3);
+			float_to_unorm8(src.h + i, planes.data(), count);
+			float_to_unorm8(src.r + i, planes.data() + count, count);
+			float_to_unorm8(src.m + i, planes.data() + count * 2, count);
+			for (size_t p=0; p<count; ++p) {
+				out[p*3] = planes[p];
+				out[p*3+1] = planes[count + p];
+				out[p*3+2] = planes[count * 2 + p];
+			}
+		}
+		break;
+	}
+}
+
+
+// The _d, _n and _hrm maps streamed into their files as they are blended.
+// For PNGs and QOIs _d drops its alpha when the sources are opaque, like
+// lodepng's auto conversion did. _n and _hrm are RGB.
+class PBROutputSink : public PBRRowSink
+{
+public:
+	std::unique_ptr<ImageStream> image[3];
+	std::vector<std::unique_ptr<ImageStream>> mip_image[3];	// levels 1 and on, not DDS
+	OutputFormat format = FORMAT_PNG;
+	unsigned int levels = 1U;
+
+
+	void open(
+		std::string filename,
+		unsigned int w,
+		unsigned int h,
+		bool opaque,
+		OutputFormat _format,
+		PNGPreset preset,
+		unsigned int _levels = 1U,
+		DDSFormat hrm_format = DDS_BC1
+	)
+	{
+		format = _format;
+		levels = _levels;
+		const char* suffixes[3] = { "_d", "_n", "_hrm" };
+		unsigned int channels[3] = { opaque && format != FORMAT_DDS ? 3U : 4U, 3U, 3U };
+		const DDSFormat dds_formats[3] = { DDS_BC7, DDS_BC5, hrm_format };
+		for (int k=0; k<3; ++k) {
+			mip_image[k].clear();
+			if (format == FORMAT_DDS) {
+				DDSStream* dds = new DDSStream();
+				image[k].reset(dds);
+				std::string path = std::string(filename).append(suffixes[k]).append(".dds");
+				dds->open(path, w, h, channels[k], dds_formats[k], k == 0, levels);
+				continue;
+			}
+			for (unsigned int l=0; l<levels; ++l) {
+				std::string path = filename;
+				if (l > 0) {
+					path.append("_mip").append(std::to_string(l));
+				}
+				path.append(suffixes[k]).append(".").append(OUTPUT_FORMAT_NAMES[format]);
+				unsigned int lw = std::max(1U, w >> l);
+				unsigned int lh = std::max(1U, h >> l);
+				QOIStream* qoi = format == FORMAT_QOI ? new QOIStream() : nullptr;
+				PNGStream* png = qoi ? nullptr : new PNGStream();
+				ImageStream* stream = qoi ? (ImageStream*)qoi : png;
+				if (l == 0) {
+					image[k].reset(stream);
+				} else {
+					mip_image[k].emplace_back(stream);
+				}
+				if (qoi) {
+					qoi->open(path, lw, lh, channels[k], k == 0);
+				} else {
+					png->open(path, lw, lh, channels[k], preset);
+				}
+			}
+		}
+	}
+
+
+	unsigned int band_rows() override
+	{
+		return band_rows(0);
+	}
+
+	unsigned int band_rows(unsigned int level)
+	{
+		return level == 0 || format == FORMAT_DDS
+			? image[0]->band_rows()
+			: mip_image[0][level - 1]->band_rows();
+	}
+
+
+	void put_rows(unsigned int y0, unsigned int y1, PBRView rows) override
+	{
+		put_level_rows(0, y0, y1, rows);
+	}
+
+
+	// Rows [y0, y1) of a mip level, pixel (x, y) at rows.idx(x, y - y0).
+	void put_level_rows(unsigned int level, unsigned int y0, unsigned int y1, PBRView rows)
+	{
+		std::vector<unsigned char> bytes;
+		unsigned int w = std::max(1U, image[0]->w >> level);
+		for (int k=0; k<3; ++k) {
+			unsigned int c = image[k]->channels;
+			bytes.resize((size_t)w * (y1 - y0) * c);
+			unsigned char* out = bytes.data();
+			for (unsigned int y=y0; y<y1; ++y) {
+				quantize(k, rows, rows.idx(0, y - y0), w, out);
+				out += (size_t)w * c;
+			}
+			if (level == 0) {
+				image[k]->put_rows(y0, y1, bytes.data());
+			} else if (format == FORMAT_DDS) {
+				((DDSStream*)image[k].get())->put_level_rows(level, y0, y1, bytes.data());
+			} else {
+				mip_image[k][level - 1]->put_rows(y0, y1, bytes.data());
+			}
+		}
+	}
+
+
+	// Quantizes count pixels of map k starting at index i of src.
+	void quantize(int k, PBRView src, size_t i, size_t count, unsigned char* out)
+	{
+		quantize_map(k, image[k]->channels, src, i, count, out);
+	}
+
+
+	void close()
+	{
+		for (int k=0; k<3; ++k) {
+			if (image[k]) {
+				image[k]->close();
+			}
+			for (auto& mip : mip_image[k]) {
+				mip->close();
+			}
+		}
+	}
+};
@@ -0,0 +1,439 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "lodepng.h"
+
+#include "thread_pool.h"
+
+
+// ----------------------------------------------------------------------------
+// Parallel zlib compressor for lodepng.
+//
+// Installed as custom_zlib, it cuts the filtered scanlines into strips and
+// deflates each on the pool. Every strip but the last has the final bit of
+// its last block cleared and is closed with an empty stored block, which
+// leaves it byte aligned, so the strips join into one deflate stream. The
+// adler32 of the strips are combined into the one of the whole input.
+// Matches can't reach across strips, which costs a little size.
+// ----------------------------------------------------------------------------
+
+const size_t DEFLATE_STRIP_MIN = 1 << 20;
+
+
+// Walks the blocks of a raw deflate stream without producing output, to find
+// the bit where its last block starts and the bit where the stream ends.
+class DeflateScanner
+{
+public:
+	bool scan(const unsigned char* _data, size_t _size, size_t& last_block, size_t& end)
+	{
+		data = _data;
+		size = _size;
+		pos = 0;
+		error = false;
+
+		bool last = false;
+		while (!last && !error) {
+			last_block = pos;
+			last = bits(1) != 0;
+			unsigned int type = bits(2);
+			if (type == 0) {
+				stored();
+			} else if (type == 1) {
+				fixed();
+			} else if (type == 2) {
+				dynamic();
+			} else {
+				error = true;
+			}
+		}
+		end = pos;
+		return !error;
+	}
+
+private:
+	static const int MAX_BITS = 15;
+	static const int FAST_BITS = 9;
+
+	// Canonical code: code lengths counted per length, symbols ordered by
+	// code, and a table decoding codes of up to FAST_BITS bits at once.
+	struct Huffman
+	{
+		short count[MAX_BITS + 1];
+		short symbol[288];
+		unsigned short fast[1 << FAST_BITS];	// symbol << 4 | length, 0 - slow path
+	};
+
+	const unsigned char* data;
+	size_t size;
+	size_t pos;	// in bits
+	bool error;
+	Huffman lit;
+	Huffman dist;
+
+
+	// Next 16 bits without consuming them, zeros past the end.
+	inline unsigned int peek()
+	{
+		size_t i = pos >> 3;
+		unsigned int v = 0;
+		for (int k=0; k<3; ++k) {
+			if (i + k < size) {
+				v |= (unsigned int)data[i + k] << (8 * k);
+			}
+		}
+		return (v >> (pos & 7)) & 0xFFFF;
+	}
+
+	inline unsigned int bits(int n)
+	{
+		if (pos + n > size * 8) {
+			error = true;
+			pos = size * 8;
+			return 0;
+		}
+		unsigned int v = peek() & ((1U << n) - 1);
+		pos += n;
+		return v;
+	}
+
+
+	void build(Huffman& h, const unsigned char* lengths, int n)
+	{
+		std::memset(h.count, 0, sizeof(h.count));
+		std::memset(h.fast, 0, sizeof(h.fast));
+		for (int s=0; s<n; ++s) {
+			h.count[lengths[s]]++;
+		}
+		h.count[0] = 0;
+
+		short offs[MAX_BITS + 2];
+		unsigned int next_code[MAX_BITS + 2];
+		offs[1] = 0;
+		next_code[1] = 0;
+		for (int len=1; len<=MAX_BITS; ++len) {
+			offs[len + 1] = offs[len] + h.count[len];
+			next_code[len + 1] = (next_code[len] + h.count[len]) << 1;
+		}
+
+		for (int s=0; s<n; ++s) {
+			int len = lengths[s];
+			if (len == 0) {
+				continue;
+			}
+			h.symbol[offs[len]++] = (short)s;
+			unsigned int code = next_code[len]++;
+			if (len <= FAST_BITS) {
+				// Codes are stored from their top bit down.
+				unsigned int rev = 0;
+				for (int b=0; b<len; ++b) {
+					rev |= ((code >> b) & 1) << (len - 1 - b);
+				}
+				for (unsigned int i=rev; i<(1U << FAST_BITS); i+=1U << len) {
+					h.fast[i] = (unsigned short)(s << 4 | len);
+				}
+			}
+		}
+	}
+
+
+	int decode(const Huffman& h)
+	{
+		unsigned int fast = h.fast[peek() & ((1U << FAST_BITS) - 1)];
+		if (fast != 0) {
+			bits(fast & 15);
+			return fast >> 4;
+		}
+
+		int code = 0;
+		int first = 0;
+		int index = 0;
+		for (int len=1; len<=MAX_BITS; ++len) {
+			code |= (int)bits(1);
+			int count = h.count[len];
+			if (code - count < first) {
+				return h.symbol[index + (code - first)];
+			}
+			index += count;
+			first += count;
+			first <<= 1;
+			code <<= 1;
+		}
+		error = true;
+		return -1;
+	}
+
+
+	void stored()
+	{
+		pos = (pos + 7) & ~(size_t)7;
+		unsigned int len = bits(16);
+		unsigned int nlen = bits(16);
+		if (error || len != (~nlen & 0xFFFF) || pos + (size_t)len * 8 > size * 8) {
+			error = true;
+			return;
+		}
+		pos += (size_t)len * 8;
+	}
+
+
+	void fixed()
+	{
+		unsigned char lengths[288];
+		for (int s=0; s<288; ++s) {
+			lengths[s] = s < 144 ? 8 : (s < 256 ? 9 : (s < 280 ? 7 : 8));
+		}
+		build(lit, lengths, 288);
+		for (int s=0; s<30; ++s) {
+			lengths[s] = 5;
+		}
+		build(dist, lengths, 30);
+		codes();
+	}
+
+
+	void dynamic()
+	{
+		static const unsigned char order[19] = {
+			16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+		};
+		int nlen = bits(5) + 257;
+		int ndist = bits(5) + 1;
+		int ncode = bits(4) + 4;
+		if (nlen > 286 || ndist > 30) {
+			error = true;
+			return;
+		}
+
+		unsigned char lengths[320] = {};
+		for (int i=0; i<ncode; ++i) {
+			lengths[order[i]] = (unsigned char)bits(3);
+		}
+		build(lit, lengths, 19);
+
+		int i = 0;
+		while (i < nlen + ndist && !error) {
+			int sym = decode(lit);
+			if (sym < 16) {
+				lengths[i++] = (unsigned char)sym;
+				continue;
+			}
+			int len = 0;
+			int repeat = 0;
+			if (sym == 16) {
+				if (i == 0) {
+					error = true;
+					return;
+				}
+				len = lengths[i - 1];
+				repeat = 3 + bits(2);
+			} else if (sym == 17) {
+				repeat = 3 + bits(3);
+			} else {
+				repeat = 11 + bits(7);
+			}
+			if (i + repeat > nlen + ndist) {
+				error = true;
+				return;
+			}
+			while (repeat--) {
+				lengths[i++] = (unsigned char)len;
+			}
+		}
+		if (error) {
+			return;
+		}
+		build(lit, lengths, nlen);
+		build(dist, lengths + nlen, ndist);
+		codes();
+	}
+
+
+	// Skips literals and matches up to the end of block code.
+	void codes()
+	{
+		static const unsigned char len_extra[29] = {
+			0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+			2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+		};
+		static const unsigned char dist_extra[30] = {
+			0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+			6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+		};
+		while (!error) {
+			int sym = decode(lit);
+			if (sym < 256) {
+				continue;
+			}
+			if (sym == 256) {
+				return;
+			}
+			sym -= 257;
+			if (sym >= 29) {
+				error = true;
+				return;
+			}
+			bits(len_extra[sym]);
+			int d = decode(dist);
+			if (d < 0 || d >= 30) {
+				error = true;
+				return;
+			}
+			bits(dist_extra[d]);
+		}
+	}
+};
+
+
+inline unsigned int adler32(const unsigned char* data, size_t size)
+{
+	unsigned int a = 1;
+	unsigned int b = 0;
+	while (size > 0) {
+		size_t n = std::min(size, (size_t)5552);
+		size -= n;
+		for (size_t i=0; i<n; ++i) {
+			a += data[i];
+			b += a;
+		}
+		data += n;
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
+}
+
+
+// Adler32 of two buffers joined, from the adler32 of each and the size of
+// the second.
+inline unsigned int adler32_combine(unsigned int adler1, unsigned int adler2, size_t size2)
+{
+	const unsigned int BASE = 65521;
+	unsigned int rem = (unsigned int)(size2 % BASE);
+	unsigned int sum1 = adler1 & 0xFFFF;
+	unsigned int sum2 = (unsigned int)(((unsigned long long)rem * sum1) % BASE);
+	sum1 += (adler2 & 0xFFFF) + BASE - 1;
+	sum2 += ((adler1 >> 16) & 0xFFFF) + ((adler2 >> 16) & 0xFFFF) + BASE - rem;
+	if (sum1 >= BASE) sum1 -= BASE;
+	if (sum1 >= BASE) sum1 -= BASE;
+	if (sum2 >= (BASE << 1)) sum2 -= (BASE << 1);
+	if (sum2 >= BASE) sum2 -= BASE;
+	return sum1 | (sum2 << 16);
+}
+
+
+// Deflates one strip of a longer stream. Unless it is the last strip, its
+// final bit is cleared and it ends with a sync flush, 3 zero bits of an empty
+// stored block header, padding, LEN 0 and NLEN, so the next strip can follow.
+inline unsigned deflate_strip(
+	const unsigned char* in,
+	size_t size,
+	const LodePNGCompressSettings* settings,
+	bool last,
+	std::vector<unsigned char>& out
+) {
+	unsigned char* deflated = nullptr;
+	size_t deflated_size = 0;
+	unsigned error = lodepng_deflate(&deflated, &deflated_size, in, size, settings);
+	if (!error) {
+		out.assign(deflated, deflated + deflated_size);
+	}
+	std::free(deflated);
+	if (error || last) {
+		return error;
+	}
+
+	size_t last_block = 0;
+	size_t end = 0;
+	DeflateScanner scanner;
+	if (!scanner.scan(out.data(), out.size(), last_block, end)) {
+		return 1;
+	}
+	out[last_block >> 3] &= (unsigned char)~(1U << (last_block & 7));
+	out.resize((end + 3 + 7) >> 3, 0);
+	if ((end & 7) != 0) {
+		out[end >> 3] &= (unsigned char)((1U << (end & 7)) - 1);
+	}
+	for (size_t i=(end >> 3) + 1; i<out.size(); ++i) {
+		out[i] = 0;
+	}
+	const unsigned char flush[4] = { 0x00, 0x00, 0xFF, 0xFF };
+	out.insert(out.end(), flush, flush + 4);
+	return 0;
+}
+
+
+// custom_context of the compress settings has to point to the ThreadPool.
+inline unsigned parallel_zlib(
+	unsigned char** out,
+	size_t* outsize,
+	const unsigned char* in,
+	size_t insize,
+	const LodePNGCompressSettings* _settings
+) {
+	ThreadPool* pool = (ThreadPool*)_settings->custom_context;
+	LodePNGCompressSettings settings = *_settings;
+	settings.custom_zlib = nullptr;
+	settings.custom_deflate = nullptr;
+	settings.custom_context = nullptr;
+
+	size_t strip = std::max(DEFLATE_STRIP_MIN, insize / (pool->size() * 2) + 1);
+	unsigned int count = (unsigned int)std::max((size_t)1, (insize + strip - 1) / strip);
+	if (count == 1) {
+		return lodepng_zlib_compress(out, outsize, in, insize, &settings);
+	}
+
+	struct Strip
+	{
+		std::vector<unsigned char> bytes;
+		unsigned int adler;
+		unsigned int error;
+	};
+	std::vector<Strip> strips(count);
+
+	pool->parallel_rows(0, count, [&](unsigned int s0, unsigned int s1) {
+		for (unsigned int s=s0; s<s1; ++s) {
+			Strip& st = strips[s];
+			size_t begin = (size_t)s * strip;
+			size_t size = std::min(strip, insize - begin);
+			st.adler = adler32(in + begin, size);
+			st.error = deflate_strip(in + begin, size, &settings, s + 1 == count, st.bytes);
+		}
+	});
+
+	size_t total = 6;
+	for (unsigned int s=0; s<count; ++s) {
+		if (strips[s].error) {
+			return strips[s].error;
+		}
+		total += strips[s].bytes.size();
+	}
+
+	unsigned char* z = (unsigned char*)std::malloc(total);
+	if (!z) {
+		return 83;	// lodepng's alloc fail
+	}
+	// CMF and FLG as lodepng writes them.
+	z[0] = 120;
+	z[1] = 1;
+	size_t pos = 2;
+	unsigned int adler = 1;
+	for (unsigned int s=0; s<count; ++s) {
+		std::memcpy(z + pos, strips[s].bytes.data(), strips[s].bytes.size());
+		pos += strips[s].bytes.size();
+		size_t size = std::min(strip, insize - (size_t)s * strip);
+		adler = adler32_combine(adler, strips[s].adler, size);
+	}
+	z[pos] = (unsigned char)(adler >> 24);
+	z[pos+1] = (unsigned char)(adler >> 16);
+	z[pos+2] = (unsigned char)(adler >> 8);
+	z[pos+3] = (unsigned char)adler;
+
+	*out = z;
+	*outsize = total;
+	return 0;
+}
@@ -0,0 +1,394 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "loader.h"
+#include "log.h"
+#include "types.h"
+
+
+// ----------------------------------------------------------------------------
+// Planar float cache of decoded sources.
+//
+// <input>.pbrcache next to the input maps holds a header and the d, n, h, r,
+// m planes exactly as PBRMap stores them, each aligned to a page. Repeat runs
+// map it into memory instead of decoding the PNGs. The header keeps size and
+// modification time of the three source files, and for an EXR which layers
+// the maps came from; when any differs the cache is decoded and written again.
+// ----------------------------------------------------------------------------
+
+const char PBR_CACHE_MAGIC[8] = { 'P', 'B', 'R', 'C', 'A', 'C', 'H', 'E' };
+const uint32_t PBR_CACHE_VERSION = 1;
+const uint64_t PBR_CACHE_ALIGN = 4096;
+
+struct PBRCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t w;
+	uint32_t h;
+	uint32_t source_key;	// EXR layers, 0 for PNGs and QOIs
+	int64_t source_size[3];
+	int64_t source_mtime[3];
+	uint64_t offset[5];	// d, n, h, r, m
+	uint64_t size;
+};
+
+
+inline bool file_stamp(std::string path, int64_t& size, int64_t& mtime)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(path.c_str(), &st) != 0) {
+		return false;
+	}
+#else
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		return false;
+	}
+#endif
+	size = (int64_t)st.st_size;
+	mtime = (int64_t)st.st_mtime;
+	return true;
+}
+
+
+// Copy on write mapping of a whole file.
+class MappedFile
+{
+public:
+	unsigned char* data = nullptr;
+	size_t size = 0;
+
+	MappedFile() {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+		close();
+	}
+
+	bool open(std::string path)
+	{
+		close();
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+			close();
+			return false;
+		}
+		mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+		if (!mapping) {
+			close();
+			return false;
+		}
+		data = (unsigned char*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+		if (!data) {
+			close();
+			return false;
+		}
+		size = (size_t)file_size.QuadPart;
+#else
+		fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) {
+			close();
+			return false;
+		}
+		void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			close();
+			return false;
+		}
+		data = (unsigned char*)p;
+		size = (size_t)st.st_size;
+#endif
+		return true;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (data) {
+			UnmapViewOfFile(data);
+		}
+		if (mapping) {
+			CloseHandle(mapping);
+			mapping = NULL;
+		}
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+			file = INVALID_HANDLE_VALUE;
+		}
+#else
+		if (data) {
+			munmap(data, size);
+		}
+		if (fd >= 0) {
+			::close(fd);
+			fd = -1;
+		}
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+
+// Decoded source maps, either decoded into a PBRMap or mapped from the cache.
+class PBRSource
+{
+public:
+	unsigned int w = 0U;
+	unsigned int h = 0U;
+	PBRView view;	// whole source
+	bool opaque = true;	// every diffuse alpha is 1
+
+
+	void load(
+		std::string filename,
+		bool use_cache,
+		const EXRLayers& layers = EXRLayers(),
+		ThreadPool* pool = nullptr
+	)
+	{
+		OP("Load source begin.");
+
+		std::string cache_path = std::string(filename).append(".pbrcache");
+		PBRCacheHeader stamp = {};
+		bool stamped = use_cache && stamp_sources(filename, stamp);
+		stamp.source_key = is_exr_path(filename) ? exr_layers_key(layers) : 0;
+
+		if (stamped && map_cache(cache_path, stamp)) {
+			OP("Mapped cache=[" << cache_path << "]");
+		} else {
+			load_pbr(filename, map, w, h, layers, pool);
+			view = PBRView(map, w);
+			if (stamped) {
+				write_cache(cache_path, stamp);
+			}
+		}
+
+		find_opaque();
+		OP("Load source end.");
+	}
+
+
+	// Maps already in memory, viewed in place. They have to outlive the
+	// source and are only read.
+	void wrap(PBRMap& maps, unsigned int _w, unsigned int _h)
+	{
+		free();
+		w = _w;
+		h = _h;
+		view = PBRView(maps, w);
+		find_opaque();
+	}
+
+
+	void free()
+	{
+		view = PBRView();
+		map = PBRMap();
+		file.close();
+	}
+
+
+	// Size and modification time of the source files, false when any is
+	// missing.
+	static bool stamp_sources(std::string filename, PBRCacheHeader& stamp)
+	{
+		const char* suffixes[3] = { "_d", "_n", "_hrm" };
+		for (int k=0; k<3; ++k) {
+			std::string path = source_path(filename, suffixes[k]);
+			if (!file_stamp(path, stamp.source_size[k], stamp.source_mtime[k])) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	PBRMap map;
+	MappedFile file;
+
+
+	void find_opaque()
+	{
+		opaque = true;
+		size_t size = (size_t)w * h;
+		for (size_t i=0; i<size && opaque; ++i) {
+			opaque = view.d[i].a == 1.f;
+		}
+	}
+
+
+	static uint64_t align(uint64_t offset)
+	{
+		return (offset + PBR_CACHE_ALIGN - 1) / PBR_CACHE_ALIGN * PBR_CACHE_ALIGN;
+	}
+
+
+	static void layout(PBRCacheHeader& header)
+	{
+		uint64_t size = (uint64_t)header.w * header.h;
+		uint64_t bytes[5] = {
+			size * sizeof(Col4),
+			size * sizeof(Vec3),
+			size * sizeof(float),
+			size * sizeof(float),
+			size * sizeof(float),
+		};
+		uint64_t offset = align(sizeof(PBRCacheHeader));
+		for (int k=0; k<5; ++k) {
+			header.offset[k] = offset;
+			offset = align(offset + bytes[k]);
+		}
+		header.size = offset;
+	}
+
+
+	bool map_cache(std::string path, PBRCacheHeader& stamp)
+	{
+		if (!file.open(path)) {
+			return false;
+		}
+
+		PBRCacheHeader header;
+		bool valid = file.size >= sizeof(PBRCacheHeader);
+		if (valid) {
+			std::memcpy(&header, file.data, sizeof(PBRCacheHeader));
+			valid = std::memcmp(header.magic, PBR_CACHE_MAGIC, 8) == 0
+				&& header.version == PBR_CACHE_VERSION
+				&& header.source_key == stamp.source_key
+				&& header.size == file.size;
+		}
+		for (int k=0; valid && k<3; ++k) {
+			valid = header.source_size[k] == stamp.source_size[k]
+				&& header.source_mtime[k] == stamp.source_mtime[k];
+		}
+		if (valid) {
+			PBRCacheHeader expected = header;
+			layout(expected);
+			valid = std::memcmp(expected.offset, header.offset, sizeof(header.offset)) == 0
+				&& expected.size == header.size;
+		}
+		if (!valid) {
+			OP("Cache out of date=[" << path << "]");
+			file.close();
+			return false;
+		}
+
+		w = header.w;
+		h = header.h;
+		view.d = (Col4*)(file.data + header.offset[0]);
+		view.n = (Vec3*)(file.data + header.offset[1]);
+		view.h = (float*)(file.data + header.offset[2]);
+		view.r = (float*)(file.data + header.offset[3]);
+		view.m = (float*)(file.data + header.offset[4]);
+		view.stride = w;
+		return true;
+	}
+
+
+	// Failing to write the cache only costs the next run a decode.
+	void write_cache(std::string path, PBRCacheHeader& stamp)
+	{
+		auto start = std::chrono::steady_clock::now();
+
+		PBRCacheHeader header = stamp;
+		std::memcpy(header.magic, PBR_CACHE_MAGIC, 8);
+		header.version = PBR_CACHE_VERSION;
+		header.w = w;
+		header.h = h;
+		layout(header);
+
+		// Own temporary per writer, batch sets sharing a source may write
+		// its cache at the same time.
+		std::string tmp_path = std::string(path).append(".tmp").append(std::to_string((uintptr_t)this));
+		std::FILE* f = std::fopen(tmp_path.c_str(), "wb");
+		bool ok = f != nullptr;
+		const void* planes[5] = { map.d.data(), map.n.data(), map.h.data(), map.r.data(), map.m.data() };
+		size_t sizes[5] = {
+			map.d.size() * sizeof(Col4),
+			map.n.size() * sizeof(Vec3),
+			map.h.size() * sizeof(float),
+			map.r.size() * sizeof(float),
+			map.m.size() * sizeof(float),
+		};
+		uint64_t pos = 0;
+		std::vector<char> zeros(PBR_CACHE_ALIGN, 0);
+
+		auto put = [&](const void* data, size_t size) {
+			if (ok && size > 0) {
+				ok = std::fwrite(data, 1, size, f) == size;
+				pos += size;
+			}
+		};
+		auto pad_to = [&](uint64_t offset) {
+			while (ok && pos < offset) {
+				put(zeros.data(), (size_t)std::min<uint64_t>(offset - pos, zeros.size()));
+			}
+		};
+
+		put(&header, sizeof(header));
+		for (int k=0; k<5; ++k) {
+			pad_to(header.offset[k]);
+			put(planes[k], sizes[k]);
+		}
+		pad_to(header.size);
+
+		if (f) {
+			ok = std::fclose(f) == 0 && ok;
+		}
+		std::remove(path.c_str());
+		if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+			OP("Could not write cache=[" << path << "]");
+			std::remove(tmp_path.c_str());
+			return;
+		}
+		OP("Wrote cache=[" << path << "] ms=[" << ms_since(start) << "]");
+	}
+};
@@ -0,0 +1,172 @@
+// ----------------------------------------------------------------------------
+// PBR TYLER library, see pbrtyler.h.
+// ----------------------------------------------------------------------------
+
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include "pbrtyler.h"
+
+#include "exr.h"
+#include "loader.h"
+#include "log.h"
+#include "output_sink.h"
+#include "pbr_cache.h"
+#include "thread_pool.h"
+#include "tyler.h"
+
+
+// Globals of log.h.
+thread_local std::string log_prefix;
+std::mutex log_mutex;
+std::function<void(const std::string&)> log_output;
+
+
+static TylerParams to_params(const TylerSettings& s)
+{
+	TylerParams p;
+	p.blur = s.blur;
+	p.blur_radius = s.blur_radius;
+	p.blur_sigma = s.blur_sigma;
+	p.influence_power = s.sharpness;
+	p.height_noise_factor = s.noise;
+	p.height_epsilon = s.epsilon;
+	for (int k=0; k<4; ++k) {
+		p.seeds[k] = s.seeds[k];
+	}
+	p.use_cache = s.use_cache;
+	p.mem_budget = s.mem_budget;
+	if (!s.format.empty()) {
+		p.output_format = parse_output_format(s.format);
+	}
+	if (!s.png_preset.empty()) {
+		p.png_preset = parse_png_preset(s.png_preset);
+	}
+	if (!s.dds_hrm.empty()) {
+		p.dds_hrm = parse_dds_hrm_format(s.dds_hrm);
+	}
+	p.mips = s.mips;
+	if (!s.exr_layers.empty()) {
+		p.exr_layers = parse_exr_layers(s.exr_layers);
+	}
+	return p;
+}
+
+
+TylerContext::TylerContext(unsigned int threads)
+{
+	pool = new ThreadPool(threads);
+}
+
+
+TylerContext::~TylerContext()
+{
+	delete pool;
+}
+
+
+unsigned int TylerContext::threads()
+{
+	return pool->size();
+}
+
+
+static bool valid_source(const TylerImage& source)
+{
+	size_t size = (size_t)source.w * source.h;
+	const PBRMap& maps = source.maps;
+	if (source.w < 2 || source.h < 2
+		|| maps.d.size() != size || maps.n.size() != size
+		|| maps.h.size() != size || maps.r.size() != size || maps.m.size() != size) {
+		OP("Source image needs every plane at w=[" << source.w << "] h=[" << source.h << "]");
+		return false;
+	}
+	return true;
+}
+
+
+int TylerContext::run(const TylerSettings& settings, const TylerImage& source, TylerImage& out)
+{
+	if (!valid_source(source)) {
+		return 1;
+	}
+	unsigned int w = source.w / 2;
+	unsigned int h = source.h / 2;
+	reserve_pbr(out.maps, w, h);
+	PBRMapSink sink(out.maps, w);
+	int status = run(settings, source, sink);
+	out.w = status == 0 ? w : 0U;
+	out.h = status == 0 ? h : 0U;
+	return status;
+}
+
+
+int TylerContext::run(const TylerSettings& settings, const TylerImage& source, PBRRowSink& out)
+{
+	if (!valid_source(source)) {
+		return 1;
+	}
+
+	try {
+		// Jobs only read their sources.
+		PBRSource src;
+		src.wrap(const_cast<PBRMap&>(source.maps), source.w, source.h);
+
+		TylerJob job;
+		job.params = to_params(settings);
+		job.params.mem_budget = 0;
+		job.pool = pool;
+		job.source = &src;
+		job.out_rows = &out;
+		return job.run();
+	} catch (std::exception e) {
+		return 1;
+	}
+}
+
+
+int TylerContext::run(const TylerSettings& settings, const std::string& input, const std::string& output)
+{
+	try {
+		TylerJob job;
+		job.params = to_params(settings);
+		job.params.input = input;
+		job.params.output = output;
+		output_format_from_extension(job.params.output, job.params.output_format);
+		if (!settings.format.empty()) {
+			job.params.output_format = parse_output_format(settings.format);
+		}
+		job.pool = pool;
+		return job.run();
+	} catch (std::exception e) {
+		return 1;
+	}
+}
+
+
+int TylerContext::load(const TylerSettings& settings, const std::string& input, TylerImage& image)
+{
+	try {
+		TylerParams p = to_params(settings);
+		load_pbr(input, image.maps, image.w, image.h, p.exr_layers, pool);
+		return 0;
+	} catch (std::exception e) {
+		OP("Could not load source maps=[" << input << "]");
+		return 1;
+	}
+}
+
+
+void TylerContext::parallel_rows(unsigned int begin, unsigned int end, std::function<void(unsigned int, unsigned int)> fn)
+{
+	pool->parallel_rows(begin, end, fn);
+}
+
+
+void tyler_log_to(std::function<void(const std::string&)> output)
+{
+	std::unique_lock<std::mutex> lock(log_mutex);
+	log_output = output;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include "types.h"
+
+
+// ----------------------------------------------------------------------------
+// PBR TYLER library.
+//
+// The pbrtyler_lib project builds the tiler as a static library. Code using
+// it includes only this header and links pbrtyler_lib.lib; the rest of the
+// headers are compiled into the library. pbrtyler.exe is main.cpp over it.
+//
+//   TylerContext tyler(8);
+//   TylerSettings s;
+//   s.seeds[0] = 1; s.seeds[1] = 2; s.seeds[2] = 3; s.seeds[3] = 4;
+//   TylerImage out;
+//   int status = tyler.run(s, source, out);
+//
+// A context holds the threads. Any number of threads can run jobs on one
+// context at once, each job keeps its own maps.
+// ----------------------------------------------------------------------------
+
+class ThreadPool;
+
+
+// Settings of one job, the command line options of the same names.
+struct TylerSettings
+{
+	bool blur = true;
+	int blur_radius = 2;
+	float blur_sigma = 0.f;	// 0 - derived from radius
+	float sharpness = 0.125f;
+	float noise = 0.8f;
+	float epsilon = 0.03f;
+	int seeds[4] = {};	// height noise of base, sc1, sc2, sc3
+
+	// Files only.
+	bool use_cache = true;
+	size_t mem_budget = 0;	// 0 - whole maps in memory, else tiled
+	std::string format;	// png, qoi or dds, empty - from the output path
+	std::string png_preset;	// empty - default
+	std::string dds_hrm;	// bc1 or bc7, empty - bc1
+	bool mips = false;
+	std::string exr_layers;	// empty - defaults
+};
+
+
+// Maps of a texture set in memory, w by h pixels in every plane of maps.
+// Diffuse and the other maps in [0, 1], normals in [-1, 1].
+struct TylerImage
+{
+	unsigned int w = 0U;
+	unsigned int h = 0U;
+	PBRMap maps;
+};
+
+
+class TylerContext
+{
+public:
+	explicit TylerContext(unsigned int threads = 0);	// 0 - hardware concurrency
+	~TylerContext();
+
+	// Threads from -threads of a command line.
+	TylerContext(int argc, char** argv);
+
+	TylerContext(const TylerContext&) = delete;
+	TylerContext& operator=(const TylerContext&) = delete;
+
+	unsigned int threads();
+
+	// Tiles a 2w by 2h source into a seamless w by h output, in memory.
+	// 0 when it went through.
+	int run(const TylerSettings& settings, const TylerImage& source, TylerImage& out);
+
+	// Same, with the output handed to out band by band as it is blended,
+	// from several threads at once. Nothing else of the output is kept.
+	int run(const TylerSettings& settings, const TylerImage& source, PBRRowSink& out);
+
+	// Same as the command line, from the input maps to the output files.
+	int run(const TylerSettings& settings, const std::string& input, const std::string& output);
+
+	// Reads the source maps of an input path into memory, 0 when it did.
+	int load(const TylerSettings& settings, const std::string& input, TylerImage& image);
+
+	// Runs fn(row_begin, row_end) on bands of [begin, end) on the context's
+	// threads, for work around the jobs. Returns when all bands are done.
+	void parallel_rows(unsigned int begin, unsigned int end, std::function<void(unsigned int, unsigned int)> fn);
+
+	// Everything pbrtyler.exe does with its command line, -batch, -sweep and
+	// -serve too. Returns the exit status.
+	int run_command_line(int argc, char** argv);
+
+private:
+	ThreadPool* pool = nullptr;
+};
+
+
+// Where log lines go instead of stdout, empty to go back to stdout. Lines of
+// every context come here, from any thread.
+void tyler_log_to(std::function<void(const std::string&)> output);
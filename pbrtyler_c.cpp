@@ -0,0 +1,358 @@
+// ----------------------------------------------------------------------------
+// PBR TYLER C interface, see pbrtyler_c.h.
+//
+// Built on the library API. Sources are copied once into the float planes
+// the pipeline works in, 40 bytes a pixel; the output goes from the blend
+// straight into the caller's buffers, band by band, without a map of its
+// own. 8-bit output goes through the quantizers of the command line's
+// files, so it has the bytes of its PNGs.
+// ----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "pbrtyler.h"
+#include "pbrtyler_c.h"
+
+#include "convert.h"
+#include "output_sink.h"
+
+
+static thread_local std::string last_error;
+
+static std::mutex context_mutex;
+static std::unique_ptr<TylerContext> shared_context;	// all hardware threads, made on first use
+
+
+static int fail(std::string message)
+{
+	last_error = message;
+	return 1;
+}
+
+
+static size_t type_size(int type)
+{
+	return type == PBRTYLER_U8 ? 1 : type == PBRTYLER_U16 ? 2 : 4;
+}
+
+
+// Plane with its strides worked out.
+struct Plane
+{
+	unsigned char* data = nullptr;
+	int type = PBRTYLER_U8;
+	int channels = 0;
+	ptrdiff_t pixel_stride = 0;
+	ptrdiff_t row_stride = 0;
+
+	inline unsigned char* at(unsigned int x, unsigned int y) const
+	{
+		return data + (ptrdiff_t)y * row_stride + (ptrdiff_t)x * pixel_stride;
+	}
+};
+
+
+static bool resolve(const pbrtyler_plane& p, unsigned int w, const char* name, int min_channels, int max_channels, Plane& out)
+{
+	std::string map = std::string(name).append(" ");
+	if (!p.data) {
+		fail(map.append("plane has no data."));
+		return false;
+	}
+	if (p.type < PBRTYLER_U8 || p.type > PBRTYLER_F32) {
+		fail(map.append("plane has an unknown type."));
+		return false;
+	}
+	if (p.channels < min_channels || p.channels > max_channels) {
+		fail(map.append("plane has the wrong number of channels."));
+		return false;
+	}
+	out.data = (unsigned char*)p.data;
+	out.type = p.type;
+	out.channels = p.channels;
+	out.pixel_stride = p.pixel_stride != 0 ? p.pixel_stride : (ptrdiff_t)(p.channels * type_size(p.type));
+	out.row_stride = p.row_stride != 0 ? p.row_stride : out.pixel_stride * (ptrdiff_t)w;
+	return true;
+}
+
+
+// Same values as the PNG reader for 8 bits, normals through [0, 1].
+static inline float read_unorm(const unsigned char* px, int type, int c)
+{
+	if (type == PBRTYLER_U8) {
+		return flt(px[c]);
+	}
+	if (type == PBRTYLER_U16) {
+		uint16_t v;
+		std::memcpy(&v, px + c * 2, 2);
+		return (float)v / 65535.f;
+	}
+	float v;
+	std::memcpy(&v, px + c * 4, 4);
+	return v;
+}
+
+
+static inline float read_snorm(const unsigned char* px, int type, int c)
+{
+	if (type == PBRTYLER_U8) {
+		return fltv(px[c]);
+	}
+	return type == PBRTYLER_F32 ? read_unorm(px, type, c) : read_unorm(px, type, c) * 2.f - 1.f;
+}
+
+
+// 16 and 32 bits, 8 bits go through quantize_map(). 16 bits are clamped
+// into range.
+static inline void write_unorm(unsigned char* px, int type, int c, float v)
+{
+	if (type == PBRTYLER_F32) {
+		std::memcpy(px + c * 4, &v, 4);
+		return;
+	}
+	v = std::min(std::max(v, 0.f), 1.f);
+	uint16_t q = (uint16_t)std::round(v * 65535.f);
+	std::memcpy(px + c * 2, &q, 2);
+}
+
+
+static inline void write_snorm(unsigned char* px, int type, int c, float v)
+{
+	if (type == PBRTYLER_F32) {
+		std::memcpy(px + c * 4, &v, 4);
+		return;
+	}
+	v = std::min(std::max(v, -1.f), 1.f);
+	uint16_t q = (uint16_t)std::round((v + 1.f) * 0.5 * 65535.f);
+	std::memcpy(px + c * 2, &q, 2);
+}
+
+
+// Writes blended bands into the caller's planes.
+class PlaneSink : public PBRRowSink
+{
+public:
+	Plane d;
+	Plane n;
+	Plane hrm;
+	unsigned int w = 0U;
+
+
+	void put_rows(unsigned int y0, unsigned int y1, PBRView rows) override
+	{
+		std::vector<unsigned char> bytes;
+		for (unsigned int y=y0; y<y1; ++y) {
+			size_t i = rows.idx(0, y - y0);
+			if (d.type == PBRTYLER_U8) {
+				put_bytes(0, d, rows, i, y, bytes);
+			} else {
+				for (unsigned int x=0; x<w; ++x) {
+					unsigned char* px = d.at(x, y);
+					Col4 c = rows.d[i + x];
+					write_unorm(px, d.type, 0, c.r);
+					write_unorm(px, d.type, 1, c.g);
+					write_unorm(px, d.type, 2, c.b);
+					if (d.channels == 4) {
+						write_unorm(px, d.type, 3, c.a);
+					}
+				}
+			}
+
+			if (n.type == PBRTYLER_U8) {
+				put_bytes(1, n, rows, i, y, bytes);
+			} else {
+				for (unsigned int x=0; x<w; ++x) {
+					unsigned char* px = n.at(x, y);
+					Vec3 v = normalize(rows.n[i + x]);
+					write_snorm(px, n.type, 0, v.x);
+					write_snorm(px, n.type, 1, v.y);
+					write_snorm(px, n.type, 2, v.z);
+				}
+			}
+
+			if (hrm.type == PBRTYLER_U8) {
+				put_bytes(2, hrm, rows, i, y, bytes);
+			} else {
+				for (unsigned int x=0; x<w; ++x) {
+					unsigned char* px = hrm.at(x, y);
+					write_unorm(px, hrm.type, 0, rows.h[i + x]);
+					write_unorm(px, hrm.type, 1, rows.r[i + x]);
+					write_unorm(px, hrm.type, 2, rows.m[i + x]);
+				}
+			}
+		}
+	}
+
+
+	// Row y of map k from index i of rows, into an 8-bit plane. Packed
+	// pixels are quantized in place, others through bytes.
+	void put_bytes(int k, const Plane& p, PBRView rows, size_t i, unsigned int y, std::vector<unsigned char>& bytes)
+	{
+		size_t pixel = (size_t)p.channels;
+		if (p.pixel_stride == (ptrdiff_t)pixel) {
+			quantize_map(k, p.channels, rows, i, w, p.at(0, y));
+			return;
+		}
+		bytes.resize((size_t)w * pixel);
+		quantize_map(k, p.channels, rows, i, w, bytes.data());
+		for (unsigned int x=0; x<w; ++x) {
+			std::memcpy(p.at(x, y), &bytes[x * pixel], pixel);
+		}
+	}
+};
+
+
+extern "C" {
+
+void pbrtyler_default_params(pbrtyler_params* params)
+{
+	if (!params) {
+		return;
+	}
+	TylerSettings s;
+	std::memset(params, 0, sizeof(pbrtyler_params));
+	params->size = sizeof(pbrtyler_params);
+	params->threads = 0U;
+	params->blur = s.blur ? 1 : 0;
+	params->blur_radius = s.blur_radius;
+	params->blur_sigma = s.blur_sigma;
+	params->sharpness = s.sharpness;
+	params->noise = s.noise;
+	params->epsilon = s.epsilon;
+}
+
+
+int pbrtyler_run(const pbrtyler_params* params, const pbrtyler_image* in, pbrtyler_image* out)
+{
+	last_error.clear();
+	if (!in || !out) {
+		return fail("Input and output images are needed.");
+	}
+
+	// Fields the caller's struct doesn't have keep their defaults.
+	pbrtyler_params p;
+	pbrtyler_default_params(&p);
+	if (params) {
+		std::memcpy(&p, params, std::min((size_t)params->size, sizeof(pbrtyler_params)));
+		p.size = sizeof(pbrtyler_params);
+	}
+
+	if (in->w < 2 || in->h < 2) {
+		return fail("Input needs to be at least 2 by 2.");
+	}
+	if (out->w != in->w / 2 || out->h != in->h / 2) {
+		return fail(std::string("Output needs to be ").append(std::to_string(in->w / 2))
+			.append(" by ").append(std::to_string(in->h / 2)).append("."));
+	}
+	Plane src[3];
+	PlaneSink sink;
+	if (!resolve(in->d, in->w, "d", 3, 4, src[0])
+		|| !resolve(in->n, in->w, "n", 3, 3, src[1])
+		|| !resolve(in->hrm, in->w, "hrm", 3, 3, src[2])
+		|| !resolve(out->d, out->w, "d", 3, 4, sink.d)
+		|| !resolve(out->n, out->w, "n", 3, 3, sink.n)
+		|| !resolve(out->hrm, out->w, "hrm", 3, 3, sink.hrm)) {
+		return 1;
+	}
+	sink.w = out->w;
+
+	try {
+		// Own threads when asked for a count the shared context doesn't have.
+		std::unique_ptr<TylerContext> own;
+		TylerContext* context;
+		{
+			std::unique_lock<std::mutex> lock(context_mutex);
+			if (!shared_context) {
+				shared_context.reset(new TylerContext());
+			}
+			context = shared_context.get();
+		}
+		if (p.threads != 0 && p.threads != context->threads()) {
+			own.reset(new TylerContext(p.threads));
+			context = own.get();
+		}
+
+		TylerSettings s;
+		s.blur = p.blur != 0;
+		s.blur_radius = p.blur_radius;
+		s.blur_sigma = p.blur_sigma;
+		s.sharpness = p.sharpness;
+		s.noise = p.noise;
+		s.epsilon = p.epsilon;
+		for (int k=0; k<4; ++k) {
+			s.seeds[k] = p.seeds[k];
+		}
+
+		// The pipeline reads float planes, so the source is copied into them,
+		// PBR_PIXEL_BYTES a pixel for the run.
+		TylerImage source;
+		source.w = in->w;
+		source.h = in->h;
+		size_t size = (size_t)in->w * in->h;
+		source.maps.d.resize(size);
+		source.maps.n.resize(size);
+		source.maps.h.resize(size);
+		source.maps.r.resize(size);
+		source.maps.m.resize(size);
+		context->parallel_rows(0, in->h, [&](unsigned int y0, unsigned int y1) {
+			for (unsigned int y=y0; y<y1; ++y)
+			for (unsigned int x=0; x<in->w; ++x) {
+				size_t i = (size_t)y * in->w + x;
+				const unsigned char* px = src[0].at(x, y);
+				source.maps.d[i] = Col4{
+					read_unorm(px, src[0].type, 0),
+					read_unorm(px, src[0].type, 1),
+					read_unorm(px, src[0].type, 2),
+					src[0].channels == 4 ? read_unorm(px, src[0].type, 3) : 1.f
+				};
+				px = src[1].at(x, y);
+				source.maps.n[i] = Vec3{
+					read_snorm(px, src[1].type, 0),
+					read_snorm(px, src[1].type, 1),
+					read_snorm(px, src[1].type, 2)
+				};
+				px = src[2].at(x, y);
+				source.maps.h[i] = read_unorm(px, src[2].type, 0);
+				source.maps.r[i] = read_unorm(px, src[2].type, 1);
+				source.maps.m[i] = read_unorm(px, src[2].type, 2);
+			}
+		});
+
+		if (context->run(s, source, sink) != 0) {
+			return fail("Tiling failed, the log has more.");
+		}
+	} catch (std::exception e) {
+		return fail(std::string("Tiling failed: ").append(e.what()));
+	} catch (...) {
+		return fail("Tiling failed.");
+	}
+	return 0;
+}
+
+
+const char* pbrtyler_last_error(void)
+{
+	return last_error.c_str();
+}
+
+
+void pbrtyler_log_to(void (*output)(const char* line, void* user), void* user)
+{
+	if (!output) {
+		tyler_log_to(nullptr);
+		return;
+	}
+	tyler_log_to([output, user](const std::string& line) {
+		output(line.c_str(), user);
+	});
+}
+
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stddef.h>
+
+/* ----------------------------------------------------------------------------
+ * PBR TYLER C interface.
+ *
+ * Tiles maps the caller already holds into buffers the caller owns, with no
+ * files in between. Every plane is read and written through its strides, so
+ * rows can be padded, flipped or interleaved with other data.
+ *
+ * The input is copied once into the float planes the tiler works in, 40
+ * bytes per input pixel held for the call: 640 MB for a 4096 by 4096 input,
+ * on top of the caller's buffers. The output is written into the caller's
+ * buffers as it is blended, with no copy. 8-bit outputs have the bytes of
+ * the command line's PNGs; 16-bit outputs are clamped into range.
+ *
+ * The pbrtyler_dll project builds it as a DLL for ctypes or cffi, the
+ * pbrtyler_lib project has it too.
+ *
+ * Structs only ever grow at the end. pbrtyler_params starts with its own
+ * size, fields past what the caller knows take their defaults.
+ * ------------------------------------------------------------------------- */
+
+#ifdef _WIN32
+#ifdef PBRTYLER_EXPORTS
+#define PBRTYLER_API __declspec(dllexport)
+#elif defined(PBRTYLER_DLL)
+#define PBRTYLER_API __declspec(dllimport)
+#else
+#define PBRTYLER_API
+#endif
+#else
+#define PBRTYLER_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Channel types. Integers are native endian, 0 to max maps to [0, 1] and
+ * normals to [-1, 1]. Floats are taken as they are. */
+enum
+{
+	PBRTYLER_U8 = 0,
+	PBRTYLER_U16 = 1,
+	PBRTYLER_F32 = 2
+};
+
+/* One map. Channel c of pixel (x, y) is at
+ * data + y * row_stride + x * pixel_stride + c * size of type. */
+typedef struct pbrtyler_plane
+{
+	void* data;
+	int type;	/* PBRTYLER_U8, _U16 or _F32 */
+	int channels;	/* d 3 or 4 (alpha 1 when 3), n 3, hrm 3 */
+	ptrdiff_t pixel_stride;	/* bytes, 0 - channels packed */
+	ptrdiff_t row_stride;	/* bytes, 0 - pixels packed */
+} pbrtyler_plane;
+
+/* Diffuse, normal and height-roughness-metalness maps of w by h pixels. */
+typedef struct pbrtyler_image
+{
+	unsigned int w;
+	unsigned int h;
+	pbrtyler_plane d;
+	pbrtyler_plane n;
+	pbrtyler_plane hrm;
+} pbrtyler_image;
+
+/* The command line options of the same names. */
+typedef struct pbrtyler_params
+{
+	unsigned int size;	/* sizeof(pbrtyler_params) */
+	unsigned int threads;	/* 0 - all hardware threads */
+	int blur;
+	int blur_radius;
+	float blur_sigma;	/* 0 - derived from radius */
+	float sharpness;
+	float noise;
+	float epsilon;
+	int seeds[4];	/* height noise of base, sc1, sc2, sc3 */
+} pbrtyler_params;
+
+/* Fills params with the defaults and its size. */
+PBRTYLER_API void pbrtyler_default_params(pbrtyler_params* params);
+
+/* Tiles the 2w by 2h in into the seamless w by h out. out holds the caller's
+ * buffers, sized w by h of in; output normals are normalized. Returns 0 when
+ * it went through, else see pbrtyler_last_error. Any number of threads can
+ * call it at once. */
+PBRTYLER_API int pbrtyler_run(const pbrtyler_params* params, const pbrtyler_image* in, pbrtyler_image* out);
+
+/* Why the last failed call on this thread failed. */
+PBRTYLER_API const char* pbrtyler_last_error(void);
+
+/* Where log lines go instead of stdout, NULL to go back to stdout. */
+PBRTYLER_API void pbrtyler_log_to(void (*output)(const char* line, void* user), void* user);
+
+#ifdef __cplusplus
+}
+#endif
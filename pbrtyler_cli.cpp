@@ -0,0 +1,178 @@
+// ----------------------------------------------------------------------------
+// PBR TYLER command line on a TylerContext, see main.cpp and pbrtyler.h.
+// ----------------------------------------------------------------------------
+
+#include <cstdlib>
+#include <ctime>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "pbrtyler.h"
+
+#include "argument_reader.h"
+#include "batch.h"
+#include "convert.h"
+#include "log.h"
+#include "serve.h"
+#include "sweep.h"
+#include "thread_pool.h"
+#include "tyler.h"
+#include "verify_index.h"
+
+
+// Options of one command line, what runs besides a single set's params.
+struct CommandLine
+{
+	TylerParams params;
+	std::string batch;	// manifest, empty for a single set
+	size_t batch_mem = 0;	// 0 - three quarters of physical memory
+	bool sweep = false;	// settings take lists and ranges, see sweep.h
+	std::string serve;	// socket path, empty when not serving
+	size_t serve_cache = (size_t)4 << 30;	// decoded sources kept between served jobs
+	bool verify_conversions = false;
+	bool verify_indices = false;
+};
+
+
+static void get_filenames(int argc, char** argv, CommandLine& cl)
+{
+	OP("- Get arguments.");
+
+	read_params(argc, argv, cl.params);
+	if (get_argument_flag("-batch", argc, argv)) {
+		cl.batch = get_argument_value("-batch", argc, argv);
+	}
+	if (get_argument_flag("-batch-mem", argc, argv)) {
+		cl.batch_mem = parse_bytes(get_argument_value("-batch-mem", argc, argv));
+	}
+	cl.sweep = get_argument_flag("-sweep", argc, argv);
+	// Either spelling.
+	if (get_argument_flag("-serve", argc, argv)) {
+		cl.serve = get_argument_value("-serve", argc, argv);
+	}
+	if (get_argument_flag("--serve", argc, argv)) {
+		cl.serve = get_argument_value("--serve", argc, argv);
+	}
+	if (get_argument_flag("-serve-cache", argc, argv)) {
+		cl.serve_cache = parse_bytes(get_argument_value("-serve-cache", argc, argv));
+	}
+	cl.verify_conversions = get_argument_flag("-verify-convert", argc, argv);
+	cl.verify_indices = get_argument_flag("-verify-index", argc, argv);
+}
+
+
+static unsigned int get_threads(int argc, char** argv)
+{
+	if (get_argument_flag("-threads", argc, argv)) {
+		return std::stoul(get_argument_value("-threads", argc, argv));
+	}
+	return 0U;
+}
+
+
+static void draw_seeds(int seeds[4])
+{
+	for (int i=0; i<4; ++i) {
+		seeds[i] = std::rand();
+	}
+}
+
+
+static int run_batch_manifest(CommandLine& cl, ThreadPool* pool, int argc, char** argv)
+{
+	OP("- Run batch=[" << cl.batch << "]");
+	std::vector<BatchSet> sets;
+	if (!read_manifest(cl.batch, argc, argv, sets)) {
+		return 1;
+	}
+	for (auto& set : sets) {
+		draw_seeds(set.params.seeds);
+	}
+	return run_batch(sets, pool, cl.batch_mem);
+}
+
+
+static int run_server(CommandLine& cl, ThreadPool* pool, int argc, char** argv)
+{
+	OP("- Serve=[" << cl.serve << "]");
+	TylerServer server;
+	server.path = cl.serve;
+	server.pool = pool;
+	server.cache.limit = cl.serve_cache;
+	for (int i=1; i<argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "-serve" || arg == "--serve" || arg == "-serve-cache" || arg == "-threads") {
+			++i;
+			continue;
+		}
+		server.common.push_back(arg);
+	}
+	return server.run();
+}
+
+
+static int run_sweep_variants(CommandLine& cl, ThreadPool* pool, int argc, char** argv)
+{
+	OP("- Run sweep.");
+	std::vector<TylerParams> variants;
+	draw_seeds(cl.params.seeds);
+	if (!read_sweep(argc, argv, cl.params, variants)) {
+		return 1;
+	}
+	return run_sweep(variants, pool);
+}
+
+
+TylerContext::TylerContext(int argc, char** argv)
+	: TylerContext(get_threads(argc, argv))
+{
+}
+
+
+int TylerContext::run_command_line(int argc, char** argv)
+{
+	OP("\n\n");
+	OP("--------------------------------------------------------------------");
+	OP("- PBR TYLER v0.1");
+	OP("--------------------------------------------------------------------");
+
+
+	// Inputs.
+	CommandLine cl;
+	get_filenames(argc, argv, cl);
+	OP("threads=[" << pool->size() << "]");
+	if (cl.verify_conversions && !verify_convert()) {
+		return 1;
+	}
+	if (cl.verify_indices && !verify_index()) {
+		return 1;
+	}
+	// Checks on their own without an input.
+	if ((cl.verify_conversions || cl.verify_indices) && !get_argument_flag("-i", argc, argv)) {
+		return 0;
+	}
+	std::srand(std::time(0));
+
+	int status = 0;
+	if (!cl.serve.empty()) {
+		status = run_server(cl, pool, argc, argv);
+	} else if (!cl.batch.empty()) {
+		status = run_batch_manifest(cl, pool, argc, argv);
+	} else if (cl.sweep) {
+		status = run_sweep_variants(cl, pool, argc, argv);
+	} else {
+		draw_seeds(cl.params.seeds);
+		TylerJob job;
+		job.params = cl.params;
+		job.pool = pool;
+		status = job.run();
+	}
+	if (status != 0) return status;
+
+
+	OP("- PBR TYLER end.");
+	OP("--------------------------------------------------------------------");
+	OP("\n\n");
+	return 0;
+}
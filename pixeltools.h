@@ -30,7 +30,7 @@ inline Vec3 mix(Vec3 a, Vec3 b, float f)
 }
 
 
-float blend_factor(float f1, float f2, float h1, float h2)
+inline float blend_factor(float f1, float f2, float h1, float h2)
 {
 	if (f1 == 1.f) {
 		return 1.f;
@@ -46,35 +46,26 @@ float blend_factor(float f1, float f2, float h1, float h2)
 }
 
 
-void copy_pixel(
-	PBRMap& src,
-	PBRMap& dst,
-	std::vector<float>& src_f,
-	std::vector<float>& dst_f,
-	int src_i,
-	int dst_i,
-	float blend_f = 1.f,
-	bool copy_fac = true
+// Copies or mixes d, n, h, r, m of one pixel. Works on PBRMap and PBRView.
+template <class S, class D>
+inline void copy_planes(
+	S& src,
+	D& dst,
+	size_t src_i,
+	size_t dst_i,
+	float blend_f = 1.f
 ) {
 	if (blend_f <= 0.f) {
 		return;
 	}
 
 	if (blend_f == 1.f) {
-		if (copy_fac) {
-			dst_f[dst_i] = src_f[src_i];
-			dst.hn[dst_i] = src.hn[src_i];
-		}
 		dst.d[dst_i] = src.d[src_i];
 		dst.n[dst_i] = src.n[src_i];
 		dst.h[dst_i] = src.h[src_i];
 		dst.r[dst_i] = src.r[src_i];
 		dst.m[dst_i] = src.m[src_i];
 	} else {
-		if (copy_fac) {
-			dst_f[dst_i] = mix(dst_f[dst_i], src_f[src_i], blend_f);
-			dst.hn[dst_i] = mix(dst.hn[dst_i], src.hn[src_i], blend_f);
-		}
 		dst.d[dst_i] = mix(dst.d[dst_i], src.d[src_i], blend_f);
 		dst.n[dst_i] = mix(dst.n[dst_i], src.n[src_i], blend_f);
 		dst.h[dst_i] = mix(dst.h[dst_i], src.h[src_i], blend_f);
@@ -84,6 +75,70 @@ void copy_pixel(
 }
 
 
+inline void copy_pixel(
+	PBRMap& src,
+	PBRMap& dst,
+	std::vector<float>& src_f,
+	std::vector<float>& dst_f,
+	size_t src_i,
+	size_t dst_i,
+	float blend_f = 1.f,
+	bool copy_fac = true
+) {
+	if (blend_f <= 0.f) {
+		return;
+	}
+
+	if (copy_fac) {
+		if (blend_f == 1.f) {
+			dst_f[dst_i] = src_f[src_i];
+			dst.hn[dst_i] = src.hn[src_i];
+		} else {
+			dst_f[dst_i] = mix(dst_f[dst_i], src_f[src_i], blend_f);
+			dst.hn[dst_i] = mix(dst.hn[dst_i], src.hn[src_i], blend_f);
+		}
+	}
+	copy_planes(src, dst, src_i, dst_i, blend_f);
+}
+
+
+// Writes the weighted sum of 4 layers into dst in a single pass.
+// Weights should sum to 1.
+inline void composite_pixel(
+	PBRView src[4],
+	const size_t src_i[4],
+	PBRMap& dst,
+	const float wt[4],
+	size_t dst_i
+) {
+	Col4 d = { 0.f, 0.f, 0.f, 0.f };
+	Vec3 n = { 0.f, 0.f, 0.f };
+	float h = 0.f;
+	float r = 0.f;
+	float m = 0.f;
+	for (int k=0; k<4; ++k) {
+		PBRView& s = src[k];
+		size_t i = src_i[k];
+		float f = wt[k];
+		d.r += s.d[i].r * f;
+		d.g += s.d[i].g * f;
+		d.b += s.d[i].b * f;
+		d.a += s.d[i].a * f;
+		n.x += s.n[i].x * f;
+		n.y += s.n[i].y * f;
+		n.z += s.n[i].z * f;
+		h += s.h[i] * f;
+		r += s.r[i] * f;
+		m += s.m[i] * f;
+	}
+	dst.d[dst_i] = d;
+	dst.n[dst_i] = n;
+	dst.h[dst_i] = h;
+	dst.r[dst_i] = r;
+	dst.m[dst_i] = m;
+}
+
+
 inline float height_factor(float f, float h)
 {
 	return 1.f * f + (1.f - f) * (f * h);
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "lodepng.h"
+
+#include "loader.h"
+#include "log.h"
+#include "parallel_deflate.h"
+#include "types.h"
+
+
+// ----------------------------------------------------------------------------
+// Row streamed PNG writer.
+//
+// Bands of rows are filtered and deflated as soon as they are made, on the
+// thread that made them, and written in order as IDAT chunks once the bands
+// above them are written. Each band is one strip of the zlib stream, as in
+// parallel_zlib, so whole images never exist as bytes. Only 8-bit RGB and
+// RGBA are written.
+// ----------------------------------------------------------------------------
+
+inline unsigned char paeth(unsigned char a, unsigned char b, unsigned char c)
+{
+	int p = (int)a + b - c;
+	int pa = std::abs(p - a);
+	int pb = std::abs(p - b);
+	int pc = std::abs(p - c);
+	if (pa <= pb && pa <= pc) {
+		return a;
+	}
+	return pb <= pc ? b : c;
+}
+
+
+// Filters one row into out, which starts with the filter type.
+// prev is the row above, nullptr for none.
+inline void png_filter_row(
+	int type,
+	const unsigned char* row,
+	const unsigned char* prev,
+	size_t size,
+	unsigned int bpp,
+	unsigned char* out
+) {
+	out[0] = (unsigned char)type;
+	out += 1;
+	for (size_t i=0; i<size; ++i) {
+		unsigned char a = i >= bpp ? row[i - bpp] : 0;
+		unsigned char b = prev ? prev[i] : 0;
+		unsigned char c = prev && i >= bpp ? prev[i - bpp] : 0;
+		switch (type) {
+		case 0: out[i] = row[i]; break;
+		case 1: out[i] = row[i] - a; break;
+		case 2: out[i] = row[i] - b; break;
+		case 3: out[i] = row[i] - (unsigned char)(((int)a + b) / 2); break;
+		default: out[i] = row[i] - paeth(a, b, c); break;
+		}
+	}
+}
+
+
+// Filters rows, each prefixed by its filter type. With minsum a row takes
+// the filter with the smallest sum of absolute values, as lodepng's
+// LFS_MINSUM does, else none. The first row only tries none and sub, which
+// don't look at the row above, so a band doesn't need the band above it.
+inline void png_filter_rows(
+	const unsigned char* pixels,
+	unsigned int rows,
+	size_t size,
+	unsigned int bpp,
+	bool minsum,
+	unsigned char* out
+) {
+	std::vector<unsigned char> attempt(size + 1);
+	for (unsigned int y=0; y<rows; ++y) {
+		const unsigned char* row = pixels + y * size;
+		const unsigned char* prev = y > 0 ? row - size : nullptr;
+		unsigned char* dst = out + y * (size + 1);
+		if (!minsum) {
+			png_filter_row(0, row, prev, size, bpp, dst);
+			continue;
+		}
+
+		size_t best_sum = (size_t)-1;
+		for (int type=0; type<(prev ? 5 : 2); ++type) {
+			png_filter_row(type, row, prev, size, bpp, attempt.data());
+			size_t sum = 0;
+			for (size_t i=1; i<=size; ++i) {
+				unsigned char v = attempt[i];
+				sum += type == 0 ? v : (v < 128 ? v : 255U - v);
+			}
+			if (sum < best_sum) {
+				best_sum = sum;
+				std::memcpy(dst, attempt.data(), size + 1);
+			}
+		}
+	}
+}
+
+
+// channels 3 is RGB, 4 RGBA.
+class PNGStream : public ImageStream
+{
+public:
+	~PNGStream()
+	{
+		if (file) {
+			std::fclose(file);
+		}
+	}
+
+
+	void open(
+		std::string filename,
+		unsigned int _w,
+		unsigned int _h,
+		unsigned int _channels,
+		PNGPreset preset
+	)
+	{
+		w = _w;
+		h = _h;
+		channels = _channels;
+		path = filename;
+		next_row = 0;
+		adler = 1;
+		error = false;
+		pending.clear();
+
+		LodePNGEncoderSettings enc;
+		lodepng_encoder_settings_init(&enc);
+		png_preset_settings(preset, enc);
+		zlib = enc.zlibsettings;
+		minsum = enc.filter_strategy != LFS_ZERO;
+
+		file = std::fopen(path.c_str(), "wb");
+		if (!file) {
+			OP("Could not open=[" << path << "]");
+			throw std::exception("Encoder error.");
+		}
+
+		const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+		write(signature, 8);
+		unsigned char ihdr[13];
+		put_u32(ihdr, w);
+		put_u32(ihdr + 4, h);
+		ihdr[8] = 8;
+		ihdr[9] = channels == 3 ? 2 : 6;
+		ihdr[10] = 0;
+		ihdr[11] = 0;
+		ihdr[12] = 0;
+		write_chunk("IHDR", ihdr, 13);
+
+		// CMF and FLG as lodepng writes them, sent with the first band.
+		zlib_head = { 120, 1 };
+	}
+
+
+	// Big enough for deflate, small enough to keep the bands in cache.
+	// Sized as if RGBA so all maps of an output share their bands.
+	unsigned int band_rows() override
+	{
+		size_t row = (size_t)w * 4;
+		return (unsigned int)std::max((size_t)1, (DEFLATE_STRIP_MIN + row - 1) / row);
+	}
+
+
+	void put_rows(unsigned int y0, unsigned int y1, const unsigned char* pixels) override
+	{
+		size_t size = (size_t)w * channels;
+		std::vector<unsigned char> filtered((size + 1) * (y1 - y0));
+		png_filter_rows(pixels, y1 - y0, size, channels, minsum, filtered.data());
+
+		Band band;
+		band.y1 = y1;
+		band.size = filtered.size();
+		band.adler = adler32(filtered.data(), filtered.size());
+		unsigned strip_error = deflate_strip(
+			filtered.data(), filtered.size(), &zlib, y1 == h, band.bytes
+		);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (strip_error) {
+			error = true;
+			return;
+		}
+		pending[y0].swap(band);
+		auto it = pending.find(next_row);
+		while (it != pending.end()) {
+			Band& b = it->second;
+			b.bytes.insert(b.bytes.begin(), zlib_head.begin(), zlib_head.end());
+			zlib_head.clear();
+			write_chunk("IDAT", b.bytes.data(), b.bytes.size());
+			adler = adler32_combine(adler, b.adler, b.size);
+			next_row = b.y1;
+			pending.erase(it);
+			it = pending.find(next_row);
+		}
+	}
+
+
+	void close() override
+	{
+		if (!file) {
+			return;
+		}
+		if (next_row != h) {
+			OP("Rows missing=[" << h - next_row << "]");
+			error = true;
+		}
+		unsigned char trailer[4];
+		put_u32(trailer, adler);
+		write_chunk("IDAT", trailer, 4);
+		write_chunk("IEND", nullptr, 0);
+		error = std::fclose(file) != 0 || error;
+		file = nullptr;
+		pending.clear();
+		if (error) {
+			OP("Encoder error. Filename=[" << path << "]");
+			throw std::exception("Encoder error.");
+		}
+	}
+
+private:
+	struct Band
+	{
+		unsigned int y1;
+		size_t size;	// filtered bytes
+		unsigned int adler;
+		std::vector<unsigned char> bytes;
+
+		void swap(Band& other)
+		{
+			std::swap(y1, other.y1);
+			std::swap(size, other.size);
+			std::swap(adler, other.adler);
+			bytes.swap(other.bytes);
+		}
+	};
+
+	std::string path;
+	std::FILE* file = nullptr;
+	LodePNGCompressSettings zlib;
+	bool minsum = true;
+	std::vector<unsigned char> zlib_head;
+	unsigned int next_row = 0U;
+	unsigned int adler = 1U;
+	bool error = false;
+	std::map<unsigned int, Band> pending;	// by first row
+	std::mutex mutex;
+
+
+	static void put_u32(unsigned char* out, unsigned int v)
+	{
+		out[0] = (unsigned char)(v >> 24);
+		out[1] = (unsigned char)(v >> 16);
+		out[2] = (unsigned char)(v >> 8);
+		out[3] = (unsigned char)v;
+	}
+
+	void write(const unsigned char* data, size_t size)
+	{
+		if (size > 0 && std::fwrite(data, 1, size, file) != size) {
+			error = true;
+		}
+	}
+
+	void write_chunk(const char* type, const unsigned char* data, size_t size)
+	{
+		std::vector<unsigned char> chunk(4 + size);
+		std::memcpy(chunk.data(), type, 4);
+		if (size > 0) {
+			std::memcpy(chunk.data() + 4, data, size);
+		}
+		unsigned char length[4];
+		unsigned char crc[4];
+		put_u32(length, (unsigned int)size);
+		put_u32(crc, lodepng_crc32(chunk.data(), chunk.size()));
+		write(length, 4);
+		write(chunk.data(), chunk.size());
+		write(crc, 4);
+	}
+};
+
@@ -0,0 +1,411 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "types.h"
+
+
+// ----------------------------------------------------------------------------
+// QOI codec.
+//
+// The Quite OK Image format: 8-bit RGB or RGBA, lossless, encoded in one
+// pass with a running index of recently seen pixels. Several times faster
+// than deflate both ways at somewhat larger files, which suits intermediate
+// maps that are repacked right away.
+// ----------------------------------------------------------------------------
+
+const unsigned char QOI_MAGIC[4] = { 'q', 'o', 'i', 'f' };
+const size_t QOI_HEADER_BYTES = 14;
+const unsigned char QOI_END[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+const size_t QOI_PIXELS_MAX = 400000000;
+const size_t QOI_BAND_PIXELS = 1 << 16;
+const size_t QOI_PENDING_BYTES = (size_t)64 << 20;
+
+const unsigned char QOI_OP_INDEX = 0x00;
+const unsigned char QOI_OP_DIFF = 0x40;
+const unsigned char QOI_OP_LUMA = 0x80;
+const unsigned char QOI_OP_RUN = 0xC0;
+const unsigned char QOI_OP_RGB = 0xFE;
+const unsigned char QOI_OP_RGBA = 0xFF;
+
+
+struct QOIPixel
+{
+	unsigned char r = 0;
+	unsigned char g = 0;
+	unsigned char b = 0;
+	unsigned char a = 0;
+
+	inline bool operator==(const QOIPixel& o) const
+	{
+		return r == o.r && g == o.g && b == o.b && a == o.a;
+	}
+
+	inline int hash() const
+	{
+		return (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+	}
+};
+
+
+inline bool is_qoi(const unsigned char* data, size_t size)
+{
+	return size >= QOI_HEADER_BYTES && std::memcmp(data, QOI_MAGIC, 4) == 0;
+}
+
+
+inline unsigned int qoi_u32(const unsigned char* p)
+{
+	return (unsigned int)p[0] << 24 | (unsigned int)p[1] << 16 | (unsigned int)p[2] << 8 | p[3];
+}
+
+
+// Header fields, false when it isn't a valid QOI header.
+inline bool qoi_inspect(
+	const unsigned char* data,
+	size_t size,
+	unsigned int& w,
+	unsigned int& h,
+	unsigned int& channels
+) {
+	if (!is_qoi(data, size)) {
+		return false;
+	}
+	w = qoi_u32(data + 4);
+	h = qoi_u32(data + 8);
+	channels = data[12];
+	return w > 0 && h > 0 && (channels == 3 || channels == 4)
+		&& (size_t)w * h <= QOI_PIXELS_MAX;
+}
+
+
+inline void qoi_header(
+	unsigned int w,
+	unsigned int h,
+	unsigned int channels,
+	bool srgb,
+	unsigned char out[QOI_HEADER_BYTES]
+) {
+	std::memcpy(out, QOI_MAGIC, 4);
+	for (int b=0; b<4; ++b) {
+		out[4 + b] = (unsigned char)(w >> (24 - b * 8));
+		out[8 + b] = (unsigned char)(h >> (24 - b * 8));
+	}
+	out[12] = (unsigned char)channels;
+	out[13] = srgb ? 0 : 1;
+}
+
+
+// Encoder state carried from one run of pixels to the next, so an image can
+// be encoded a band at a time. finish() ends a pending run.
+class QOIEncoder
+{
+public:
+	QOIEncoder()
+	{
+		prev.a = 255;
+	}
+
+	void put(const unsigned char* pixels, size_t count, unsigned int channels, std::vector<unsigned char>& out)
+	{
+		for (size_t i=0; i<count; ++i) {
+			const unsigned char* p = pixels + i * channels;
+			QOIPixel px;
+			px.r = p[0];
+			px.g = p[1];
+			px.b = p[2];
+			px.a = channels == 4 ? p[3] : 255;
+
+			if (px == prev) {
+				if (++run == 62) {
+					finish(out);
+				}
+				continue;
+			}
+			finish(out);
+
+			int k = px.hash();
+			if (index[k] == px) {
+				out.push_back(QOI_OP_INDEX | (unsigned char)k);
+			} else {
+				index[k] = px;
+				if (px.a == prev.a) {
+					signed char vr = (signed char)(px.r - prev.r);
+					signed char vg = (signed char)(px.g - prev.g);
+					signed char vb = (signed char)(px.b - prev.b);
+					signed char vg_r = (signed char)(vr - vg);
+					signed char vg_b = (signed char)(vb - vg);
+					if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+						out.push_back(QOI_OP_DIFF | (unsigned char)((vr + 2) << 4 | (vg + 2) << 2 | (vb + 2)));
+					} else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+						out.push_back(QOI_OP_LUMA | (unsigned char)(vg + 32));
+						out.push_back((unsigned char)((vg_r + 8) << 4 | (vg_b + 8)));
+					} else {
+						unsigned char op[4] = { QOI_OP_RGB, px.r, px.g, px.b };
+						out.insert(out.end(), op, op + 4);
+					}
+				} else {
+					unsigned char op[5] = { QOI_OP_RGBA, px.r, px.g, px.b, px.a };
+					out.insert(out.end(), op, op + 5);
+				}
+			}
+			prev = px;
+		}
+	}
+
+	void finish(std::vector<unsigned char>& out)
+	{
+		if (run > 0) {
+			out.push_back(QOI_OP_RUN | (unsigned char)(run - 1));
+			run = 0;
+		}
+	}
+
+private:
+	QOIPixel index[64];
+	QOIPixel prev;
+	int run = 0;
+};
+
+
+inline void qoi_encode(
+	const unsigned char* pixels,
+	unsigned int w,
+	unsigned int h,
+	unsigned int channels,
+	bool srgb,
+	std::vector<unsigned char>& out
+) {
+	out.resize(QOI_HEADER_BYTES);
+	out.reserve((size_t)w * h * (channels + 1) / 2);
+	qoi_header(w, h, channels, srgb, out.data());
+	QOIEncoder enc;
+	enc.put(pixels, (size_t)w * h, channels, out);
+	enc.finish(out);
+	out.insert(out.end(), QOI_END, QOI_END + 8);
+}
+
+
+// Decodes into the image's own channels, 3 or 4, or into RGBA when rgba
+// is set. Returns false on a broken file.
+inline bool qoi_decode(
+	const std::vector<unsigned char>& data,
+	std::vector<unsigned char>& pixels,
+	unsigned int& w,
+	unsigned int& h,
+	unsigned int& channels,
+	bool rgba = false
+) {
+	if (!qoi_inspect(data.data(), data.size(), w, h, channels)) {
+		return false;
+	}
+	unsigned int out_channels = rgba ? 4 : channels;
+	size_t size = (size_t)w * h;
+	pixels.resize(size * out_channels);
+
+	QOIPixel index[64];
+	QOIPixel px;
+	px.a = 255;
+	size_t p = QOI_HEADER_BYTES;
+	size_t end = data.size() - 8;
+	int run = 0;
+	for (size_t i=0; i<size; ++i) {
+		if (run > 0) {
+			--run;
+		} else {
+			if (p >= end) {
+				return false;
+			}
+			unsigned char b1 = data[p++];
+			if (b1 == QOI_OP_RGB || b1 == QOI_OP_RGBA) {
+				size_t n = b1 == QOI_OP_RGB ? 3 : 4;
+				if (p + n > end) {
+					return false;
+				}
+				px.r = data[p];
+				px.g = data[p + 1];
+				px.b = data[p + 2];
+				if (n == 4) {
+					px.a = data[p + 3];
+				}
+				p += n;
+			} else if ((b1 & 0xC0) == QOI_OP_INDEX) {
+				px = index[b1];
+			} else if ((b1 & 0xC0) == QOI_OP_DIFF) {
+				px.r += ((b1 >> 4) & 3) - 2;
+				px.g += ((b1 >> 2) & 3) - 2;
+				px.b += (b1 & 3) - 2;
+			} else if ((b1 & 0xC0) == QOI_OP_LUMA) {
+				if (p >= end) {
+					return false;
+				}
+				unsigned char b2 = data[p++];
+				int vg = (b1 & 0x3F) - 32;
+				px.r += vg - 8 + ((b2 >> 4) & 0x0F);
+				px.g += vg;
+				px.b += vg - 8 + (b2 & 0x0F);
+			} else {
+				run = b1 & 0x3F;
+			}
+			index[px.hash()] = px;
+		}
+
+		unsigned char* o = &pixels[i * out_channels];
+		o[0] = px.r;
+		o[1] = px.g;
+		o[2] = px.b;
+		if (out_channels == 4) {
+			o[3] = px.a;
+		}
+	}
+	return true;
+}
+
+
+// Bands are encoded in order as soon as the bands above them are in, on
+// the thread that brought the missing band. QOI's state runs through the
+// whole image, so unlike the PNG and DDS streams the encoding itself isn't
+// parallel; it is fast enough not to need it. Bands held out of order are
+// bounded by QOI_PENDING_BYTES, threads bringing more wait for the rows
+// above instead.
+class QOIStream : public ImageStream
+{
+public:
+	~QOIStream()
+	{
+		if (file) {
+			std::fclose(file);
+		}
+	}
+
+
+	void open(
+		std::string filename,
+		unsigned int _w,
+		unsigned int _h,
+		unsigned int _channels,
+		bool srgb
+	)
+	{
+		w = _w;
+		h = _h;
+		channels = _channels;
+		path = filename;
+		next_row = 0;
+		error = false;
+		enc = QOIEncoder();
+		pending.clear();
+		pending_bytes = 0;
+
+		file = std::fopen(path.c_str(), "wb");
+		if (!file) {
+			OP("Could not open=[" << path << "]");
+			throw std::exception("Encoder error.");
+		}
+		unsigned char header[QOI_HEADER_BYTES];
+		qoi_header(w, h, channels, srgb, header);
+		write(header, QOI_HEADER_BYTES);
+	}
+
+
+	unsigned int band_rows() override
+	{
+		return (unsigned int)std::max((size_t)1, QOI_BAND_PIXELS / std::max(1U, w));
+	}
+
+
+	void put_rows(unsigned int y0, unsigned int y1, const unsigned char* pixels) override
+	{
+		size_t size = (size_t)w * channels * (y1 - y0);
+		std::unique_lock<std::mutex> lock(mutex);
+		// The thread with the band at next_row never waits, so the rows
+		// above always come.
+		drained.wait(lock, [&]() {
+			return y0 == next_row || pending_bytes + size <= QOI_PENDING_BYTES;
+		});
+		if (y0 != next_row) {
+			Band& band = pending[y0];
+			band.y1 = y1;
+			band.pixels.assign(pixels, pixels + size);
+			pending_bytes += size;
+			return;
+		}
+
+		encode(y0, y1, pixels);
+		auto it = pending.find(next_row);
+		while (it != pending.end()) {
+			encode(it->first, it->second.y1, it->second.pixels.data());
+			pending_bytes -= it->second.pixels.size();
+			pending.erase(it);
+			it = pending.find(next_row);
+		}
+		drained.notify_all();
+	}
+
+
+	void close() override
+	{
+		if (!file) {
+			return;
+		}
+		if (next_row != h) {
+			OP("Rows missing=[" << h - next_row << "]");
+			error = true;
+		}
+		std::vector<unsigned char> tail;
+		enc.finish(tail);
+		tail.insert(tail.end(), QOI_END, QOI_END + 8);
+		write(tail.data(), tail.size());
+		error = std::fclose(file) != 0 || error;
+		file = nullptr;
+		pending.clear();
+		pending_bytes = 0;
+		if (error) {
+			OP("Encoder error. Filename=[" << path << "]");
+			throw std::exception("Encoder error.");
+		}
+	}
+
+private:
+	struct Band
+	{
+		unsigned int y1;
+		std::vector<unsigned char> pixels;
+	};
+
+	std::string path;
+	std::FILE* file = nullptr;
+	QOIEncoder enc;
+	unsigned int next_row = 0U;
+	bool error = false;
+	std::map<unsigned int, Band> pending;	// by first row
+	size_t pending_bytes = 0;
+	std::condition_variable drained;
+	std::vector<unsigned char> bytes;
+	std::mutex mutex;
+
+
+	void encode(unsigned int y0, unsigned int y1, const unsigned char* pixels)
+	{
+		bytes.clear();
+		enc.put(pixels, (size_t)w * (y1 - y0), channels, bytes);
+		write(bytes.data(), bytes.size());
+		next_row = y1;
+	}
+
+	void write(const unsigned char* data, size_t size)
+	{
+		if (size > 0 && std::fwrite(data, 1, size, file) != size) {
+			error = true;
+		}
+	}
+};
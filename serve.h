@@ -0,0 +1,676 @@
+#pragma once
+
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <exception>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <afunix.h>
+#include <io.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "exr.h"
+#include "log.h"
+#include "pbr_cache.h"
+#include "thread_pool.h"
+#include "tyler.h"
+
+
+// ----------------------------------------------------------------------------
+// Serve mode.
+//
+// -serve /path/to.sock keeps one process running and takes jobs over a local
+// socket, so the threads, the working maps and the decoded sources stay warm
+// between them. A client sends one JSON object per line, keys are the
+// command line options without the dash:
+//
+//   {"id": 1, "i": "tex/grass", "o": "out/grass", "sharpness": 0.2, "mips": true}
+//
+// true adds a flag, false and null leave it out. "seed" picks the height
+// noise seeds, else they are drawn. "cmd" is "run" (the default), "stats" or
+// "shutdown". Options on the command line apply to every job that doesn't
+// set them itself.
+//
+// Each job answers with lines of its own, all carrying its "id":
+//
+//   {"id":1,"event":"start","seed":1234}
+//   {"id":1,"event":"source","cached":false,"ms":812.5}
+//   {"id":1,"event":"stage","stage":"setup","ms":95.1}
+//   {"id":1,"event":"done","status":0,"ms":1630.2}
+//
+// or {"id":1,"event":"error","message":"..."} when the request is unusable.
+// Jobs on one connection run one after another, connections run side by
+// side on the shared pool.
+// ----------------------------------------------------------------------------
+
+#ifdef _WIN32
+typedef SOCKET serve_socket;
+const serve_socket SERVE_NO_SOCKET = INVALID_SOCKET;
+const int SERVE_SEND_FLAGS = 0;
+
+inline void close_socket(serve_socket s) { closesocket(s); }
+inline void unlink_socket(const std::string& path) { _unlink(path.c_str()); }
+#else
+typedef int serve_socket;
+const serve_socket SERVE_NO_SOCKET = -1;
+#ifdef MSG_NOSIGNAL
+const int SERVE_SEND_FLAGS = MSG_NOSIGNAL;	// a client gone mid job is not fatal
+#else
+const int SERVE_SEND_FLAGS = 0;
+#endif
+
+inline void close_socket(serve_socket s) { close(s); }
+inline void unlink_socket(const std::string& path) { unlink(path.c_str()); }
+#endif
+
+
+// Value of a flat JSON object, strings unquoted.
+struct JSONField
+{
+	std::string value;
+	bool is_string = false;
+};
+
+
+inline std::string json_escape(const std::string& text)
+{
+	std::string out;
+	for (unsigned char c : text) {
+		switch (c) {
+		case '"': out.append("\\\""); break;
+		case '\\': out.append("\\\\"); break;
+		case '\n': out.append("\\n"); break;
+		case '\r': out.append("\\r"); break;
+		case '\t': out.append("\\t"); break;
+		default:
+			if (c < 0x20) {
+				const char* hex = "0123456789abcdef";
+				out.append("\\u00").push_back(hex[c >> 4]);
+				out.push_back(hex[c & 15]);
+			} else {
+				out.push_back((char)c);
+			}
+		}
+	}
+	return out;
+}
+
+
+inline void append_utf8(std::string& out, unsigned int cp)
+{
+	if (cp < 0x80) {
+		out.push_back((char)cp);
+	} else if (cp < 0x800) {
+		out.push_back((char)(0xc0 | (cp >> 6)));
+		out.push_back((char)(0x80 | (cp & 0x3f)));
+	} else if (cp < 0x10000) {
+		out.push_back((char)(0xe0 | (cp >> 12)));
+		out.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+		out.push_back((char)(0x80 | (cp & 0x3f)));
+	} else {
+		out.push_back((char)(0xf0 | (cp >> 18)));
+		out.push_back((char)(0x80 | ((cp >> 12) & 0x3f)));
+		out.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+		out.push_back((char)(0x80 | (cp & 0x3f)));
+	}
+}
+
+
+// One object of strings, numbers, true, false and null. Nesting is not
+// needed by the protocol and is an error.
+inline bool parse_json_object(const std::string& text, std::map<std::string, JSONField>& fields)
+{
+	size_t i = 0;
+	auto skip = [&]() {
+		while (i < text.size() && std::isspace((unsigned char)text[i])) {
+			++i;
+		}
+	};
+	auto hex4 = [&](unsigned int& cp) {
+		if (i + 4 > text.size()) {
+			return false;
+		}
+		cp = 0;
+		for (int k=0; k<4; ++k) {
+			char c = text[i++];
+			cp <<= 4;
+			if (c >= '0' && c <= '9') cp |= c - '0';
+			else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+			else return false;
+		}
+		return true;
+	};
+	auto read_string = [&](std::string& out) {
+		if (i >= text.size() || text[i] != '"') {
+			return false;
+		}
+		++i;
+		while (i < text.size() && text[i] != '"') {
+			char c = text[i++];
+			if (c != '\\') {
+				out.push_back(c);
+				continue;
+			}
+			if (i >= text.size()) {
+				return false;
+			}
+			c = text[i++];
+			switch (c) {
+			case 'n': out.push_back('\n'); break;
+			case 'r': out.push_back('\r'); break;
+			case 't': out.push_back('\t'); break;
+			case 'b': out.push_back('\b'); break;
+			case 'f': out.push_back('\f'); break;
+			case 'u': {
+				unsigned int cp;
+				if (!hex4(cp)) {
+					return false;
+				}
+				// Surrogate pair.
+				unsigned int low;
+				if (cp >= 0xd800 && cp < 0xdc00 && text.compare(i, 2, "\\u") == 0) {
+					i += 2;
+					if (!hex4(low)) {
+						return false;
+					}
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+				}
+				append_utf8(out, cp);
+				break;
+			}
+			default: out.push_back(c);
+			}
+		}
+		if (i >= text.size()) {
+			return false;
+		}
+		++i;
+		return true;
+	};
+
+	skip();
+	if (i >= text.size() || text[i] != '{') {
+		return false;
+	}
+	++i;
+	skip();
+	if (i < text.size() && text[i] == '}') {
+		++i;
+		skip();
+		return i == text.size();
+	}
+	for (;;) {
+		skip();
+		std::string key;
+		if (!read_string(key)) {
+			return false;
+		}
+		skip();
+		if (i >= text.size() || text[i] != ':') {
+			return false;
+		}
+		++i;
+		skip();
+
+		JSONField field;
+		if (i < text.size() && text[i] == '"') {
+			field.is_string = true;
+			if (!read_string(field.value)) {
+				return false;
+			}
+		} else {
+			size_t start = i;
+			while (i < text.size() && (std::isalnum((unsigned char)text[i]) || text[i] == '-' || text[i] == '+' || text[i] == '.')) {
+				++i;
+			}
+			field.value = text.substr(start, i - start);
+			if (field.value.empty()) {
+				return false;
+			}
+		}
+		fields[key] = field;
+
+		skip();
+		if (i < text.size() && text[i] == ',') {
+			++i;
+			continue;
+		}
+		if (i < text.size() && text[i] == '}') {
+			++i;
+			skip();
+			return i == text.size();
+		}
+		return false;
+	}
+}
+
+
+// Decoded sources kept between jobs, least recently used dropped first once
+// over the limit. A source whose files changed on disk is decoded again.
+class SourceCache
+{
+public:
+	size_t limit = 0;	// 0 - keep nothing
+
+
+	std::shared_ptr<PBRSource> get(TylerParams& p, ThreadPool* pool, bool& cached)
+	{
+		std::string key = p.input;
+		if (is_exr_path(p.input)) {
+			key.append("|").append(std::to_string(exr_layers_key(p.exr_layers)));
+		}
+		PBRCacheHeader stamp = {};
+		bool stamped = PBRSource::stamp_sources(p.input, stamp);
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			auto it = entries.find(key);
+			if (it != entries.end() && stamped && same_stamp(it->second.stamp, stamp)) {
+				it->second.used = ++clock;
+				++hits;
+				cached = true;
+				return it->second.source;
+			}
+			++misses;
+		}
+
+		// Decoded outside the lock, other connections keep going.
+		cached = false;
+		auto source = std::make_shared<PBRSource>();
+		source->load(p.input, p.use_cache, p.exr_layers, pool);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		auto it = entries.find(key);
+		if (it != entries.end()) {
+			total -= it->second.bytes;
+			entries.erase(it);
+		}
+		size_t bytes = (size_t)source->w * source->h * 10 * sizeof(float);
+		if (stamped && bytes <= limit) {
+			Entry entry;
+			entry.source = source;
+			entry.stamp = stamp;
+			entry.bytes = bytes;
+			entry.used = ++clock;
+			entries[key] = entry;
+			total += bytes;
+			evict();
+		}
+		return source;
+	}
+
+
+	std::string stats()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		std::ostringstream out;
+		out << "\"cache_entries\":" << entries.size() << ",\"cache_bytes\":" << total
+			<< ",\"cache_hits\":" << hits << ",\"cache_misses\":" << misses;
+		return out.str();
+	}
+
+private:
+	struct Entry
+	{
+		std::shared_ptr<PBRSource> source;	// jobs hold it while they run
+		PBRCacheHeader stamp;
+		size_t bytes = 0;
+		uint64_t used = 0;
+	};
+
+	std::mutex mutex;
+	std::map<std::string, Entry> entries;
+	unsigned int hits = 0U;
+	unsigned int misses = 0U;
+	size_t total = 0;
+	uint64_t clock = 0;
+
+
+	static bool same_stamp(const PBRCacheHeader& a, const PBRCacheHeader& b)
+	{
+		for (int k=0; k<3; ++k) {
+			if (a.source_size[k] != b.source_size[k] || a.source_mtime[k] != b.source_mtime[k]) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+
+	void evict()
+	{
+		while (total > limit && entries.size() > 1) {
+			auto oldest = entries.begin();
+			for (auto it = entries.begin(); it != entries.end(); ++it) {
+				if (it->second.used < oldest->second.used) {
+					oldest = it;
+				}
+			}
+			OP("Source cache drops=[" << oldest->first << "]");
+			total -= oldest->second.bytes;
+			entries.erase(oldest);
+		}
+	}
+};
+
+
+class TylerServer
+{
+public:
+	std::string path;
+	ThreadPool* pool = nullptr;
+	SourceCache cache;
+	std::vector<std::string> common;	// command line options for every job
+
+
+	// Serves until a client asks for shutdown, 0 when it went down cleanly.
+	int run()
+	{
+		if (!start()) {
+			return 1;
+		}
+		OP("Serving socket=[" << path << "] cache=[" << cache.limit << "]");
+
+		while (!stopping) {
+			// Wakes up now and then to notice a shutdown.
+			fd_set ready;
+			FD_ZERO(&ready);
+			FD_SET(listener, &ready);
+			timeval timeout = { 0, 200000 };
+			int n = select((int)listener + 1, &ready, nullptr, nullptr, &timeout);
+			reap();
+			if (n <= 0) {
+				continue;
+			}
+			serve_socket client = accept(listener, nullptr, nullptr);
+			if (client == SERVE_NO_SOCKET) {
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(mutex);
+			connections.emplace_back();
+			Connection& c = connections.back();
+			c.socket = client;
+			c.number = ++accepted;
+			c.thread = std::thread([this, &c]() { serve(c); });
+		}
+
+		// Clients still connected get their current job finished, then
+		// their sockets closed under them.
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			for (auto& c : connections) {
+				shutdown(c.socket, 2);
+			}
+		}
+		for (auto& c : connections) {
+			c.thread.join();
+		}
+		close_socket(listener);
+		unlink_socket(path);
+#ifdef _WIN32
+		WSACleanup();
+#endif
+		OP("Serving end. connections=[" << accepted << "] jobs=[" << jobs << "]");
+		return 0;
+	}
+
+private:
+	struct Connection
+	{
+		std::thread thread;
+		serve_socket socket = SERVE_NO_SOCKET;
+		unsigned int number = 0U;
+		std::atomic<bool> done{ false };
+	};
+
+	serve_socket listener = SERVE_NO_SOCKET;
+	std::atomic<bool> stopping{ false };
+	std::atomic<unsigned int> jobs{ 0U };
+	std::mutex mutex;
+	std::mutex seed_mutex;
+	std::list<Connection> connections;
+	unsigned int accepted = 0U;
+
+
+	bool start()
+	{
+#ifdef _WIN32
+		WSADATA wsa;
+		if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+			OP("Could not start winsock.");
+			return false;
+		}
+#endif
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+			OP("Socket path=[" << path << "] is empty or too long.");
+			return false;
+		}
+		path.copy(addr.sun_path, path.size());
+
+		// A socket file left by a previous run would fail the bind.
+		unlink_socket(path);
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener == SERVE_NO_SOCKET
+			|| bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0
+			|| listen(listener, 16) != 0) {
+			OP("Could not listen on socket=[" << path << "]");
+			if (listener != SERVE_NO_SOCKET) {
+				close_socket(listener);
+			}
+			return false;
+		}
+		return true;
+	}
+
+
+	// Joins connections that are gone.
+	void reap()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (auto it = connections.begin(); it != connections.end();) {
+			if (it->done) {
+				it->thread.join();
+				it = connections.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+
+	void serve(Connection& c)
+	{
+		log_prefix = std::string("[conn ").append(std::to_string(c.number)).append("] ");
+		OP("Connected.");
+
+		// Kept for the whole connection so its maps are reused.
+		TylerJob job;
+		job.pool = pool;
+
+		std::string buffer;
+		char chunk[4096];
+		bool open = true;
+		while (open && !stopping) {
+			int n = (int)recv(c.socket, chunk, sizeof(chunk), 0);
+			if (n <= 0) {
+				break;
+			}
+			buffer.append(chunk, n);
+			size_t end;
+			while (open && (end = buffer.find('\n')) != std::string::npos) {
+				std::string line = buffer.substr(0, end);
+				buffer.erase(0, end + 1);
+				if (line.find_first_not_of(" \t\r") != std::string::npos) {
+					open = request(c, job, line);
+				}
+			}
+		}
+
+		close_socket(c.socket);
+		OP("Disconnected.");
+		log_prefix.clear();
+		c.done = true;
+	}
+
+
+	bool send_line(Connection& c, const std::string& line)
+	{
+		std::string out = std::string(line).append("\n");
+		size_t sent = 0;
+		while (sent < out.size()) {
+			int n = (int)send(c.socket, out.data() + sent, (int)(out.size() - sent), SERVE_SEND_FLAGS);
+			if (n <= 0) {
+				return false;
+			}
+			sent += n;
+		}
+		return true;
+	}
+
+
+	// Handles one request line, false when the connection should close.
+	bool request(Connection& c, TylerJob& job, const std::string& line)
+	{
+		std::map<std::string, JSONField> fields;
+		std::string id = "null";
+		bool parsed = parse_json_object(line, fields);
+		if (fields.count("id")) {
+			JSONField& f = fields["id"];
+			id = f.is_string ? std::string("\"").append(json_escape(f.value)).append("\"") : f.value;
+		}
+		std::string head = std::string("{\"id\":").append(id).append(",\"event\":");
+		auto error = [&](std::string message) {
+			OP("Request error=[" << message << "]");
+			return send_line(c, std::string(head).append("\"error\",\"message\":\"").append(json_escape(message)).append("\"}"));
+		};
+		if (!parsed) {
+			return error("Request is not a flat JSON object.");
+		}
+
+		std::string cmd = fields.count("cmd") ? fields["cmd"].value : "run";
+		if (cmd == "shutdown") {
+			OP("Shutdown asked.");
+			stopping = true;
+			send_line(c, std::string(head).append("\"shutdown\"}"));
+			return false;
+		}
+		if (cmd == "stats") {
+			std::ostringstream out;
+			out << head << "\"stats\",\"jobs\":" << jobs << "," << cache.stats() << "}";
+			return send_line(c, out.str());
+		}
+		if (cmd != "run") {
+			return error(std::string("Unknown cmd=[").append(cmd).append("]"));
+		}
+
+		// Fields become the options of a command line.
+		std::vector<std::string> args = { "pbrtyler" };
+		for (auto& field : fields) {
+			const std::string& key = field.first;
+			const JSONField& f = field.second;
+			if (key == "id" || key == "cmd" || key == "seed") {
+				continue;
+			}
+			if (!f.is_string && (f.value == "false" || f.value == "null")) {
+				continue;
+			}
+			args.push_back(std::string("-").append(key));
+			if (f.is_string || f.value != "true") {
+				args.push_back(f.value);
+			}
+		}
+		args.insert(args.end(), common.begin(), common.end());
+		std::vector<char*> ptrs;
+		for (auto& arg : args) {
+			ptrs.push_back(&arg[0]);
+		}
+
+		TylerParams p;
+		try {
+			read_params((int)ptrs.size(), ptrs.data(), p);
+			if (fields.count("seed")) {
+				p.seeds[0] = std::stoi(fields["seed"].value);
+			} else {
+				std::unique_lock<std::mutex> lock(seed_mutex);
+				p.seeds[0] = std::rand();
+			}
+		} catch (std::exception e) {
+			return error("Bad option value.");
+		}
+		if (!get_argument_flag("-i", (int)ptrs.size(), ptrs.data())
+			|| !get_argument_flag("-o", (int)ptrs.size(), ptrs.data())) {
+			return error("Request needs i and o.");
+		}
+		for (int k=1; k<4; ++k) {
+			p.seeds[k] = p.seeds[0] + k;
+		}
+
+		OP("Job begin. input=[" << p.input << "] output=[" << p.output << "] seed=[" << p.seeds[0] << "]");
+		auto start = std::chrono::steady_clock::now();
+		bool connected = send_line(c, std::string(head).append("\"start\",\"seed\":").append(std::to_string(p.seeds[0])).append("}"));
+
+		// Tiled jobs stream their sources and skip the cache.
+		std::shared_ptr<PBRSource> source;
+		if (p.mem_budget == 0) {
+			auto load_start = std::chrono::steady_clock::now();
+			bool cached = false;
+			try {
+				source = cache.get(p, pool, cached);
+			} catch (std::exception e) {
+				OP("Could not load source maps.");
+				return error("Could not load source maps.") && connected;
+			}
+			std::ostringstream out;
+			out << head << "\"source\",\"cached\":" << (cached ? "true" : "false") << ",\"ms\":" << ms_since(load_start) << "}";
+			connected = send_line(c, out.str()) && connected;
+		}
+
+		job.params = p;
+		job.source = source.get();
+		job.on_stage = [&](std::string stage, double ms) {
+			std::ostringstream out;
+			out << head << "\"stage\",\"stage\":\"" << stage << "\",\"ms\":" << ms << "}";
+			connected = send_line(c, out.str()) && connected;
+		};
+		int status = 1;
+		try {
+			status = job.run();
+		} catch (std::exception e) {
+			status = 1;
+		}
+		job.source = nullptr;
+		job.on_stage = nullptr;
+		++jobs;
+
+		double ms = ms_since(start);
+		OP("Job end. status=[" << status << "] ms=[" << ms << "]");
+		std::ostringstream out;
+		out << head << "\"done\",\"status\":" << status << ",\"ms\":" << ms << "}";
+		return send_line(c, out.str()) && connected;
+	}
+};
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "loader.h"
+#include "log.h"
+
+
+// Decoded pixels of the _d, _n and _hrm source maps, each in its own PNG's
+// format (see inspect_png), or floats from an EXR.
+// Kept in memory, or spilled to a file when they don't fit the memory budget
+// so only the spans being read live in memory. Spans are read at their
+// offset, without a shared file position, so tiles read side by side.
+// Loading still decodes each map whole: one decoded map and its file are
+// held at a time, whatever the budget, or for an EXR all three maps, which
+// come from one decode.
+class SourceStore
+{
+public:
+	enum Map { D = 0, N = 1, HRM = 2 };
+
+	unsigned int w = 0U;
+	unsigned int h = 0U;
+	PixelFormat format[3];
+	bool opaque = true;	// every diffuse alpha is 1
+
+	~SourceStore()
+	{
+		close();
+	}
+
+
+	// Decodes PNG and QOI maps one at a time so at most one decoded map is
+	// held. An EXR is decoded once for all three.
+	void load(
+		std::string filename,
+		bool spill,
+		std::string spill_path,
+		const EXRLayers& layers = EXRLayers(),
+		ThreadPool* pool = nullptr
+	)
+	{
+		OP("Load source store begin.");
+		const char* suffixes[3] = { "_d", "_n", "_hrm" };
+
+		if (spill) {
+			path = spill_path;
+			if (!open_spill()) {
+				OP("Could not open spill file=[" << path << "]");
+				throw std::exception("Spill file error.");
+			}
+		}
+
+		std::vector<unsigned char> exr_maps[3];
+		unsigned int exr_w = 0U;
+		unsigned int exr_h = 0U;
+		bool exr = is_exr_path(filename);
+		if (exr) {
+			read_exr_sources(filename, layers, exr_maps, format, exr_w, exr_h, pool);
+		}
+
+		for (int k=0; k<3; ++k) {
+			std::vector<unsigned char> decoded;
+			unsigned int mw = exr_w;
+			unsigned int mh = exr_h;
+			if (exr) {
+				decoded.swap(exr_maps[k]);
+			} else {
+				read_source(filename, k, decoded, format[k], mw, mh);
+			}
+			if (k == 0) {
+				w = mw;
+				h = mh;
+			} else if (mw != w || mh != h) {
+				OP("Map sizes differ: _d=[" << w << "x" << h << "]"
+					<< " " << suffixes[k] << "=[" << mw << "x" << mh << "]");
+				throw std::exception("Map size mismatch.");
+			}
+			if (k == D) {
+				opaque = true;
+				int a = format[k].channel(3);
+				size_t pb = format[k].pixel_bytes();
+				for (size_t i=0; a >= 0 && opaque && i<decoded.size(); i+=pb) {
+					opaque = format[k].unorm(&decoded[i], 3) == 1.f;
+				}
+			}
+			base[k] = k == 0 ? 0 : base[k-1] + (size_t)w * h * format[k-1].pixel_bytes();
+
+			if (spill) {
+				if (!write_at(offset(k, 0, 0), decoded.data(), decoded.size())) {
+					OP("Could not write spill file=[" << path << "]");
+					throw std::exception("Spill file error.");
+				}
+			} else {
+				bytes[k].swap(decoded);
+			}
+		}
+
+		OP("source=[" << w << "x" << h << "] spilled=[" << spilled() << "]");
+		OP("Load source store end.");
+	}
+
+
+	// Reads count pixels of one row, starting at (x, y), in format[map].
+	void read_span(
+		int map,
+		unsigned int x,
+		unsigned int y,
+		unsigned int count,
+		unsigned char* out
+	)
+	{
+		size_t size = (size_t)count * format[map].pixel_bytes();
+		if (!spilled()) {
+			std::memcpy(out, &bytes[map][offset(map, x, y) - base[map]], size);
+			return;
+		}
+
+		if (!read_at(offset(map, x, y), out, size)) {
+			OP("Could not read spill file=[" << path << "]");
+			throw std::exception("Spill file error.");
+		}
+	}
+
+
+	void close()
+	{
+		if (spilled()) {
+#ifdef _WIN32
+			CloseHandle(file);
+			file = INVALID_HANDLE_VALUE;
+#else
+			::close(fd);
+			fd = -1;
+#endif
+			std::remove(path.c_str());
+		}
+		for (int k=0; k<3; ++k) {
+			std::vector<unsigned char>().swap(bytes[k]);
+		}
+	}
+
+private:
+	// Largest single read or write, ReadFile takes 32-bit sizes.
+	static const size_t IO_CHUNK = (size_t)1 << 30;
+
+	std::vector<unsigned char> bytes[3];
+	size_t base[3] = {};	// offset of each map in the spill file
+	std::string path;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+#else
+	int fd = -1;
+#endif
+
+
+	inline bool spilled()
+	{
+#ifdef _WIN32
+		return file != INVALID_HANDLE_VALUE;
+#else
+		return fd >= 0;
+#endif
+	}
+
+
+	bool open_spill()
+	{
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+			CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+#else
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+		return spilled();
+	}
+
+
+	// Positioned reads and writes, safe from several threads at once.
+	bool write_at(uint64_t pos, const unsigned char* data, size_t size)
+	{
+		while (size > 0) {
+			size_t n = size < IO_CHUNK ? size : IO_CHUNK;
+#ifdef _WIN32
+			OVERLAPPED at = {};
+			at.Offset = (DWORD)pos;
+			at.OffsetHigh = (DWORD)(pos >> 32);
+			DWORD done = 0;
+			if (!WriteFile(file, data, (DWORD)n, &done, &at) || done == 0) {
+				return false;
+			}
+#else
+			ssize_t done = pwrite(fd, data, n, (off_t)pos);
+			if (done <= 0) {
+				return false;
+			}
+#endif
+			pos += done;
+			data += done;
+			size -= done;
+		}
+		return true;
+	}
+
+
+	bool read_at(uint64_t pos, unsigned char* data, size_t size)
+	{
+		while (size > 0) {
+			size_t n = size < IO_CHUNK ? size : IO_CHUNK;
+#ifdef _WIN32
+			OVERLAPPED at = {};
+			at.Offset = (DWORD)pos;
+			at.OffsetHigh = (DWORD)(pos >> 32);
+			DWORD done = 0;
+			if (!ReadFile(file, data, (DWORD)n, &done, &at) || done == 0) {
+				return false;
+			}
+#else
+			ssize_t done = pread(fd, data, n, (off_t)pos);
+			if (done <= 0) {
+				return false;
+			}
+#endif
+			pos += done;
+			data += done;
+			size -= done;
+		}
+		return true;
+	}
+
+
+	inline size_t offset(int map, unsigned int x, unsigned int y)
+	{
+		return base[map] + ((size_t)y * w + x) * format[map].pixel_bytes();
+	}
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cmath>
+#include <exception>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "argument_reader.h"
+#include "log.h"
+#include "thread_pool.h"
+#include "tyler.h"
+
+
+// ----------------------------------------------------------------------------
+// Sweep mode.
+//
+// -sweep renders one source with many settings to pick from. -sharpness,
+// -noise and -epsilon take a list or an inclusive range, and -seed picks the
+// height noise seeds the same way:
+//
+//   -sweep -sharpness 0.1,0.2,0.4 -noise 0:0.8:0.2 -seed 1,2
+//
+// Every combination is one output, labelled with the settings that vary,
+// out/grass_s0.2_n0.4_seed2_d.png and so on. The source is read and split
+// once; influence maps, noise, blend and output are redone per combination.
+// ----------------------------------------------------------------------------
+
+// "0.1,0.2,0.4" or "from:to:step", to included.
+inline std::vector<double> parse_sweep_values(std::string text)
+{
+	std::vector<double> values;
+	size_t colon = text.find(':');
+	if (colon != std::string::npos) {
+		size_t colon2 = text.find(':', colon + 1);
+		if (colon2 == std::string::npos) {
+			throw std::exception("Sweep range needs from:to:step.");
+		}
+		double from = std::stod(text.substr(0, colon));
+		double to = std::stod(text.substr(colon + 1, colon2 - colon - 1));
+		double step = std::stod(text.substr(colon2 + 1));
+		if (step <= 0.0 || to < from) {
+			throw std::exception("Sweep range is empty.");
+		}
+		// A little slack so 0:1:0.1 ends on 1.
+		int n = (int)std::floor((to - from) / step + 1e-6) + 1;
+		for (int i=0; i<n; ++i) {
+			values.push_back(from + i * step);
+		}
+		return values;
+	}
+
+	std::stringstream list(text);
+	std::string item;
+	while (std::getline(list, item, ',')) {
+		values.push_back(std::stod(item));
+	}
+	if (values.empty()) {
+		throw std::exception("Sweep list is empty.");
+	}
+	return values;
+}
+
+
+// Every combination of the swept settings on top of base, false when the
+// options can't be used.
+inline bool read_sweep(int argc, char** argv, TylerParams& base, std::vector<TylerParams>& variants)
+{
+	std::vector<double> sharpness = { base.influence_power };
+	std::vector<double> noise = { base.height_noise_factor };
+	std::vector<double> epsilon = { base.height_epsilon };
+	std::vector<double> seed;
+	bool picked_seeds = get_argument_flag("-seed", argc, argv);
+	try {
+		if (get_argument_flag("-sharpness", argc, argv)) {
+			sharpness = parse_sweep_values(get_argument_value("-sharpness", argc, argv));
+		}
+		if (get_argument_flag("-noise", argc, argv)) {
+			noise = parse_sweep_values(get_argument_value("-noise", argc, argv));
+		}
+		if (get_argument_flag("-epsilon", argc, argv)) {
+			epsilon = parse_sweep_values(get_argument_value("-epsilon", argc, argv));
+		}
+		if (picked_seeds) {
+			seed = parse_sweep_values(get_argument_value("-seed", argc, argv));
+		}
+	} catch (std::exception e) {
+		OP("Sweep values need to be a list like 0.1,0.2 or a range like 0:1:0.25");
+		return false;
+	}
+	if (seed.empty()) {
+		seed.push_back(base.seeds[0]);
+	}
+
+	for (double s : sharpness)
+	for (double n : noise)
+	for (double e : epsilon)
+	for (double sd : seed) {
+		TylerParams p = base;
+		p.influence_power = (float)s;
+		p.height_noise_factor = (float)n;
+		p.height_epsilon = (float)e;
+		// Drawn seeds stay as drawn, picked ones count up from the pick.
+		if (picked_seeds) {
+			for (int k=0; k<4; ++k) {
+				p.seeds[k] = (int)sd + k;
+			}
+		}
+
+		std::ostringstream label;
+		label << base.output;
+		if (sharpness.size() > 1) label << "_s" << s;
+		if (noise.size() > 1) label << "_n" << n;
+		if (epsilon.size() > 1) label << "_e" << e;
+		if (seed.size() > 1) label << "_seed" << (int)sd;
+		p.output = label.str();
+		variants.push_back(p);
+	}
+	return true;
+}
+
+
+// Renders every variant, 0 when all went through.
+inline int run_sweep(std::vector<TylerParams>& variants, ThreadPool* pool)
+{
+	OP("Sweep begin. variants=[" << variants.size() << "]");
+	auto start = std::chrono::steady_clock::now();
+
+	TylerJob job;
+	job.pool = pool;
+	int status = 1;
+	try {
+		status = job.run_variants(variants);
+	} catch (std::exception e) {
+		status = 1;
+	}
+
+	OP("Sweep end. status=[" << status << "] ms=[" << ms_since(start) << "]");
+	return status;
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+
+// Fixed size pool of worker threads. The calling thread takes part in the
+// work too, so a pool of N threads starts N-1 workers. Any number of threads
+// can call it at once, including its own workers.
+class ThreadPool
+{
+public:
+	ThreadPool(unsigned int threads = 0)
+	{
+		if (threads == 0) {
+			threads = std::max(1U, std::thread::hardware_concurrency());
+		}
+		for (unsigned int i=1; i<threads; ++i) {
+			workers.emplace_back([this]() { work(); });
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& t : workers) {
+			t.join();
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned int size()
+	{
+		return (unsigned int)workers.size() + 1;
+	}
+
+
+	// Splits [begin, end) rows into bands and runs fn(band_begin, band_end)
+	// on every band. Returns when all bands are done.
+	void parallel_rows(
+		unsigned int begin,
+		unsigned int end,
+		std::function<void(unsigned int, unsigned int)> fn
+	)
+	{
+		if (end <= begin) {
+			return;
+		}
+
+		unsigned int rows = end - begin;
+		if (workers.empty() || rows == 1) {
+			fn(begin, end);
+			return;
+		}
+
+		// Few bands per thread so uneven rows even out.
+		Batch batch;
+		batch.fn = &fn;
+		batch.begin = begin;
+		batch.end = end;
+		batch.count = std::min(rows, size() * 4);
+		batch.band = (rows + batch.count - 1) / batch.count;
+		batch.count = (rows + batch.band - 1) / batch.band;
+
+		unsigned int helpers = std::min(
+			(unsigned int)workers.size(),
+			batch.count - 1
+		);
+		batch.pending = helpers;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			for (unsigned int i=0; i<helpers; ++i) {
+				tasks.push([this, &batch]() {
+					run_bands(batch);
+					{
+						std::unique_lock<std::mutex> lock(mutex);
+						--batch.pending;
+					}
+					wake.notify_all();
+				});
+			}
+		}
+		wake.notify_all();
+
+		run_bands(batch);
+
+		// Helpers hold a reference to the batch until they finish. Rather
+		// than block, the caller runs queued tasks meanwhile, its own
+		// helpers or bands of other batches. Calls from inside a task, or
+		// from several jobs at once, can't starve each other that way.
+		std::unique_lock<std::mutex> lock(mutex);
+		while (batch.pending > 0) {
+			if (tasks.empty()) {
+				wake.wait(lock);
+				continue;
+			}
+			std::function<void()> task = std::move(tasks.front());
+			tasks.pop();
+			lock.unlock();
+			task();
+			lock.lock();
+		}
+	}
+
+private:
+	struct Batch
+	{
+		std::function<void(unsigned int, unsigned int)>* fn;
+		unsigned int begin;
+		unsigned int end;
+		unsigned int band;
+		unsigned int count;
+		std::atomic<unsigned int> next{ 0 };
+		unsigned int pending;	// helpers not done, under the pool mutex
+	};
+
+	std::vector<std::thread> workers;
+	std::queue< std::function<void()> > tasks;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping = false;
+
+
+	static void run_bands(Batch& batch)
+	{
+		for (;;) {
+			unsigned int b = batch.next++;
+			if (b >= batch.count) {
+				return;
+			}
+			unsigned int y0 = batch.begin + b * batch.band;
+			unsigned int y1 = std::min(y0 + batch.band, batch.end);
+			(*batch.fn)(y0, y1);
+		}
+	}
+
+
+	void work()
+	{
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this]() { return stopping || !tasks.empty(); });
+				if (stopping && tasks.empty()) {
+					return;
+				}
+				task = std::move(tasks.front());
+				tasks.pop();
+			}
+			task();
+		}
+	}
+};
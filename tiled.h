@@ -0,0 +1,389 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "FastNoiseLite.h"
+
+#include "functions.h"
+#include "loader.h"
+#include "log.h"
+#include "maptools.h"
+#include "mips.h"
+#include "output_sink.h"
+#include "source_store.h"
+#include "types.h"
+
+
+// Where copy_chunk puts a pixel when it swaps the two halves of an axis.
+// Returns -1 for the last row or column of odd sizes, which it never fills.
+inline int swap_halves(int x, int n)
+{
+	int half = n / 2;
+	if (x < half) {
+		return x + half;
+	}
+	if (x < 2 * half) {
+		return x - half;
+	}
+	return -1;
+}
+
+
+// Out-of-core version of the TylerJob pipeline.
+// The output is made tile by tile. Each tile gathers its four layers, with a
+// halo as wide as the blur radius, straight from the source store and blends
+// them on its own, so the working set depends on the tile size and not on
+// the texture size. The result matches the in-memory pipeline exactly.
+class TiledTyler
+{
+public:
+	unsigned int w;
+	unsigned int h;
+	size_t mem_budget;
+	float influence_power;
+	float height_noise_factor;
+	int seeds[4];	// base, sc1, sc2, sc3
+	bool blur;
+	OutputFormat output_format = FORMAT_PNG;
+	PNGPreset png_preset = PNG_DEFAULT;
+	DDSFormat dds_hrm = DDS_BC1;
+	bool mips = false;
+	EXRLayers exr_layers;
+	MapTools mt;	// output sized, pool and blur kernel set
+
+
+	void run(std::string input, std::string output)
+	{
+		OP("Tiled run begin.");
+
+		// Estimate from the image headers before anything is decoded.
+		unsigned int src_w = 0U;
+		unsigned int src_h = 0U;
+		size_t src_pixel_bytes = 0;
+		size_t map_pixel_bytes = 0;
+		for (int k=0; k<3; ++k) {
+			PixelFormat f;
+			inspect_source(input, k, f, src_w, src_h);
+			src_pixel_bytes += f.pixel_bytes();
+			map_pixel_bytes = std::max(map_pixel_bytes, f.pixel_bytes());
+		}
+		w = src_w / 2;
+		h = src_h / 2;
+		mt.src_w = src_w;
+		mt.src_h = src_h;
+		mt.w = w;
+		mt.h = h;
+
+		// A tile takes TILE_PIXEL_BYTES per pixel, the row of tiles being
+		// encoded OUT_PIXEL_BYTES per pixel of its width.
+		size_t src_bytes = (size_t)src_w * src_h * src_pixel_bytes;
+		size_t min_tile_bytes = (size_t)TILE_MIN * TILE_MIN * TILE_PIXEL_BYTES
+			+ (size_t)TILE_MIN * w * OUT_PIXEL_BYTES;
+		bool spill = src_bytes + min_tile_bytes > mem_budget;
+		// Maps are decoded whole before they are spilled, that part isn't
+		// bounded by the budget. An EXR decodes all three at once.
+		size_t decode_bytes = (size_t)src_w * src_h
+			* (is_exr_path(input) ? src_pixel_bytes : map_pixel_bytes);
+		if (spill && decode_bytes > mem_budget) {
+			OP("Decoding the sources takes=[" << decode_bytes << "] more than the memory budget.");
+		}
+		// Level 1 is made next to the tiles; once they are gone write_mips
+		// holds it and the level below.
+		size_t fixed = spill ? 0 : src_bytes;
+		if (mips) {
+			size_t level1_bytes = (size_t)std::max(1U, w / 2) * std::max(1U, h / 2) * PBR_PIXEL_BYTES;
+			size_t chain_bytes = level1_bytes + level1_bytes / 4;
+			fixed += level1_bytes;
+			if (chain_bytes > mem_budget) {
+				OP("Mip levels 1 and 2 take=[" << chain_bytes << "] more than the memory budget.");
+			}
+		}
+		size_t left = mem_budget > fixed ? mem_budget - fixed : 0;
+		if (left < min_tile_bytes) {
+			OP("Memory budget=[" << mem_budget << "] is short, minimum tiles take=[" << fixed + min_tile_bytes << "]");
+			left = min_tile_bytes;
+		}
+
+		// Tiles also make their part of mip level 1, which reaches past them.
+		int r = (blur ? mt.blur_kernel.radius : 0) + (mips ? MIP_HALO : 0);
+		double a = (double)TILE_PIXEL_BYTES;
+		double b = (double)w * OUT_PIXEL_BYTES;
+		int side = (int)((std::sqrt(b * b + 4.0 * a * left) - b) / (2.0 * a));
+		// Rows of tiles start on block bounds for DDS.
+		tile = std::max(TILE_MIN, side - 2 * r) / 4 * 4;
+		tile = std::min(tile, (int)std::max(w, h));
+		OP("w=[" << w << "] h=[" << h << "] tile=[" << tile << "] halo=[" << r << "]");
+
+		store.load(input, spill, std::string(output).append(".spill"), exr_layers, mt.pool);
+
+		for (int k=0; k<4; ++k) {
+			noise[k] = mt.height_noise(seeds[LAYERS[k].seed]);
+		}
+		unsigned int levels = mips ? mip_levels(w, h) : 1U;
+		maps.open(output, w, h, store.opaque, output_format, png_preset, levels, dds_hrm);
+		if (levels > 1) {
+			reserve_pbr(level1, std::max(1U, w / 2), std::max(1U, h / 2));
+		}
+		for (int k=0; k<3; ++k) {
+			out[k].resize((size_t)w * tile * maps.image[k]->channels);
+		}
+
+		for (unsigned int ty=0; ty<h; ty+=tile) {
+			unsigned int th = std::min((unsigned int)tile, h - ty);
+			for (unsigned int tx=0; tx<w; tx+=tile) {
+				OP("- Tile x=[" << tx << "] y=[" << ty << "]");
+				run_tile(
+					tx,
+					ty,
+					std::min((unsigned int)tile, w - tx),
+					th,
+					r
+				);
+			}
+			encode_rows(ty, th);
+		}
+
+		free_tile();
+		store.close();
+		if (levels > 1) {
+			write_mips(maps, level1, std::max(1U, w / 2), std::max(1U, h / 2), mt);
+		}
+		save();
+
+		OP("Tiled run end.");
+	}
+
+private:
+	// Working bytes per pixel of a tile: 4 layers, their factors, blend
+	// factors and their blur, layer order and the blended tile.
+	static const size_t TILE_PIXEL_BYTES = 256;
+	static const size_t OUT_PIXEL_BYTES = 10;
+	static const int TILE_MIN = 64;
+
+	// Where each layer of blend_map_4_way comes from: the source quadrant,
+	// which halves copy_chunk swapped, its influence map and noise seed.
+	struct Layer
+	{
+		int qx;
+		int qy;
+		bool swap_x;
+		bool swap_y;
+		int influence;	// 0 - base, 1 - corner, 2 - edge
+		int seed;
+	};
+	const Layer LAYERS[4] = {
+		{ 0, 0, false, false, 0, 0 },	// base
+		{ 0, 1, false, true, 2, 2 },	// edges from sc2
+		{ 1, 1, true, false, 2, 3 },	// edges_lr from sc3
+		{ 1, 0, true, true, 1, 1 },		// corners from sc1
+	};
+
+	SourceStore store;
+	FastNoiseLite noise[4];
+	int tile;
+
+	PBRMap layers[4];
+	std::vector<float> fac[4];
+	PBRMap blended;
+	PBRMap level1;	// mip level 1, made tile by tile
+	PBROutputSink maps;
+	std::vector<unsigned char> out[3];	// quantized row of tiles
+
+
+	float influence(int type, int x, int y)
+	{
+		switch (type) {
+		case 0: return mt.influence_base(x, y, influence_power);
+		case 1: return mt.influence_corner(x, y, influence_power);
+		default: return mt.influence_edge(x, y, influence_power);
+		}
+	}
+
+
+	// Fills row ry of every layer of the tile region starting at (rx0, ry0)
+	// in output coords, wrapped around the output.
+	void fill_row(int rx0, int ry0, int rw, int ry, std::vector<unsigned char> bytes[3])
+	{
+		int gy = modulo(ry0 + ry, h);
+		size_t row = (size_t)ry * rw;
+
+		for (int k=0; k<4; ++k) {
+			const Layer& l = LAYERS[k];
+			PBRMap& map = layers[k];
+			int my = l.swap_y ? swap_halves(gy, h) : gy;
+
+			int rx = 0;
+			while (rx < rw) {
+				int mx = mapped_x(l, rx0 + rx);
+				if (my < 0 || mx < 0) {
+					size_t i = row + rx;
+					map.d[i] = Col4{ 0.f, 0.f, 0.f, 1.f };
+					map.n[i] = Vec3{ 0.f, 0.f, 0.f };
+					map.h[i] = 0.f;
+					map.r[i] = 0.f;
+					map.m[i] = 0.f;
+					fac[k][i] = 0.f;
+					++rx;
+					continue;
+				}
+
+				// Run of consecutive source pixels.
+				int count = 1;
+				while (rx + count < rw && mapped_x(l, rx0 + rx + count) == mx + count) {
+					++count;
+				}
+				unsigned int sx = l.qx * w + mx;
+				unsigned int sy = l.qy * h + my;
+				store.read_span(SourceStore::D, sx, sy, count, bytes[0].data());
+				store.read_span(SourceStore::N, sx, sy, count, bytes[1].data());
+				store.read_span(SourceStore::HRM, sx, sy, count, bytes[2].data());
+
+				PixelFormat& fd = store.format[SourceStore::D];
+				PixelFormat& fn = store.format[SourceStore::N];
+				PixelFormat& fhrm = store.format[SourceStore::HRM];
+				for (int c=0; c<count; ++c) {
+					size_t i = row + rx + c;
+					unsigned char* d = &bytes[0][c * fd.pixel_bytes()];
+					unsigned char* n = &bytes[1][c * fn.pixel_bytes()];
+					unsigned char* hrm = &bytes[2][c * fhrm.pixel_bytes()];
+					map.d[i] = Col4{ fd.unorm(d, 0), fd.unorm(d, 1), fd.unorm(d, 2), fd.unorm(d, 3) };
+					map.n[i] = Vec3{ fn.snorm(n, 0), fn.snorm(n, 1), fn.snorm(n, 2) };
+					map.h[i] = fhrm.unorm(hrm, 0);
+					map.r[i] = fhrm.unorm(hrm, 1);
+					map.m[i] = fhrm.unorm(hrm, 2);
+					fac[k][i] = mt.fac_noise(
+						influence(l.influence, mx + c, my),
+						noise[k],
+						height_noise_factor,
+						mx + c,
+						my
+					);
+				}
+				rx += count;
+			}
+		}
+	}
+
+
+	inline int mapped_x(const Layer& l, int x)
+	{
+		int gx = modulo(x, w);
+		return l.swap_x ? swap_halves(gx, w) : gx;
+	}
+
+
+	void run_tile(
+		unsigned int tx,
+		unsigned int ty,
+		unsigned int tw,
+		unsigned int th,
+		int r
+	)
+	{
+		int rw = tw + 2 * r;
+		int rh = th + 2 * r;
+		size_t size = (size_t)rw * rh;
+
+		MapTools tmt = mt;
+		tmt.w = rw;
+		tmt.h = rh;
+		tmt.src_w = rw;
+		tmt.src_h = rh;
+
+		for (int k=0; k<4; ++k) {
+			reserve_pbr(layers[k], rw, rh);
+			fac[k].resize(size);
+		}
+		reserve_pbr(blended, rw, rh);
+
+		tmt.for_rows([&](unsigned int y0, unsigned int y1) {
+			std::vector<unsigned char> bytes[3];
+			for (int k=0; k<3; ++k) {
+				bytes[k].resize((size_t)rw * store.format[k].pixel_bytes());
+			}
+			for (unsigned int ry=y0; ry<y1; ++ry) {
+				fill_row((int)tx - r, (int)ty - r, rw, ry, bytes);
+			}
+		});
+
+		tmt.blend_map_4_way(blended,
+			PBRView(layers[0], rw),
+			PBRView(layers[1], rw),
+			PBRView(layers[2], rw),
+			PBRView(layers[3], rw),
+			fac[0], fac[1], fac[2], fac[3],
+			blur
+		);
+		if (tmt.mix_failed) {
+			mt.mix_failed = true;
+		}
+
+		// Quantize the tile without its halo into the row of tiles.
+		unsigned int top = r;
+		unsigned int bottom = r + th;
+		tmt.for_rows([&](unsigned int y0, unsigned int y1) {
+			for (unsigned int ry=std::max(y0, top); ry<std::min(y1, bottom); ++ry)
+				for (int k=0; k<3; ++k) {
+					unsigned int c = maps.image[k]->channels;
+					size_t o = ((size_t)(ry - r) * w + tx) * c;
+					maps.quantize(k, PBRView(blended, rw), (size_t)ry * rw + r, tw, &out[k][o]);
+				}
+		});
+
+		// Level 1 pixels whose 2x2 footprint starts in the tile.
+		if (!level1.d.empty()) {
+			unsigned int w1 = std::max(1U, w / 2);
+			unsigned int h1 = std::max(1U, h / 2);
+			unsigned int x0 = (tx + 1) / 2;
+			unsigned int x1 = std::min(w1, (tx + tw + 1) / 2);
+			tmt.for_range((ty + 1) / 2, std::min(h1, (ty + th + 1) / 2), [&](unsigned int y0, unsigned int y1) {
+				downsample_rows(
+					PBRView(blended, rw), w, h, (int)tx - r, (int)ty - r, false, false,
+					PBRView(level1, w1), x0, x1, y0, y1
+				);
+			});
+		}
+	}
+
+
+	// Streams rows [ty, ty + th) of the row of tiles into the output files.
+	void encode_rows(unsigned int ty, unsigned int th)
+	{
+		unsigned int rows = maps.band_rows();
+		unsigned int bands = (th + rows - 1) / rows;
+		mt.for_range(0, bands, [&](unsigned int b0, unsigned int b1) {
+			for (unsigned int b=b0; b<b1; ++b) {
+				unsigned int y0 = b * rows;
+				unsigned int y1 = std::min(y0 + rows, th);
+				for (int k=0; k<3; ++k) {
+					size_t o = (size_t)y0 * w * maps.image[k]->channels;
+					maps.image[k]->put_rows(ty + y0, ty + y1, &out[k][o]);
+				}
+			}
+		});
+	}
+
+
+	void free_tile()
+	{
+		for (int k=0; k<4; ++k) {
+			layers[k] = PBRMap();
+			std::vector<float>().swap(fac[k]);
+		}
+		blended = PBRMap();
+	}
+
+
+	void save()
+	{
+		OP("Save tiled output begin.");
+		for (int k=0; k<3; ++k) {
+			std::vector<unsigned char>().swap(out[k]);
+		}
+		maps.close();
+		OP("Save tiled output end.");
+	}
+};
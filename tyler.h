@@ -0,0 +1,584 @@
+#pragma once
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "FastNoiseLite.h"
+
+#include "argument_reader.h"
+#include "exr.h"
+#include "loader.h"
+#include "log.h"
+#include "maptools.h"
+#include "mips.h"
+#include "output_sink.h"
+#include "pbr_cache.h"
+#include "thread_pool.h"
+#include "tiled.h"
+#include "types.h"
+
+
+// Peak working memory per output pixel of the in-memory pipeline, while
+// blending: the decoded source, four output pixels of it, the three
+// working maps and the seven factor maps, then the blend's four weight
+// maps, the two the blur works in and the layer order. Mips add level 1,
+// a quarter of a pixel, and level 2 while level 1 is written.
+const size_t JOB_PIXEL_BYTES = 4 * (sizeof(Col4) + sizeof(Vec3) + 3 * sizeof(float))
+	+ 3 * PBR_PIXEL_BYTES + 7 * sizeof(float)
+	+ 6 * sizeof(float) + sizeof(unsigned char);
+const size_t JOB_MIP_PIXEL_BYTES = PBR_PIXEL_BYTES * 5 / 16;
+
+
+// Settings of one texture set.
+struct TylerParams
+{
+	std::string input;
+	std::string output;
+	bool blur = true;
+	bool use_cache = true;
+	int blur_radius = 2;
+	float blur_sigma = 0.f;	// 0 - derived from radius
+	float influence_power = 0.125f;
+	float height_noise_factor = 0.8f;
+	float height_epsilon = 0.03f;
+	size_t mem_budget = 0;	// 0 - whole maps in memory, else tiled
+	OutputFormat output_format = FORMAT_PNG;
+	PNGPreset png_preset = PNG_DEFAULT;
+	DDSFormat dds_hrm = DDS_BC1;
+	bool mips = false;
+	EXRLayers exr_layers;
+	bool png_bench = false;
+	bool verify_mix = false;
+	float verify_tolerance = 0.5f / 255.f;
+	int seeds[4] = {};	// base, sc1, sc2, sc3
+};
+
+
+inline void read_params(int argc, char** argv, TylerParams& p)
+{
+	p.input = get_argument_value("-i", argc, argv);
+	p.output = get_argument_value("-o", argc, argv);
+	output_format_from_extension(p.output, p.output_format);
+	p.blur = !get_argument_flag("-noblur", argc, argv);
+	p.use_cache = !get_argument_flag("-nocache", argc, argv);
+	if (get_argument_flag("-sharpness", argc, argv)) {
+		p.influence_power = std::stof(get_argument_value("-sharpness", argc, argv));
+	}
+	if (get_argument_flag("-noise", argc, argv)) {
+		p.height_noise_factor = std::stof(get_argument_value("-noise", argc, argv));
+	}
+	if (get_argument_flag("-epsilon", argc, argv)) {
+		p.height_epsilon = std::stof(get_argument_value("-epsilon", argc, argv));
+	}
+	if (get_argument_flag("-blur-radius", argc, argv)) {
+		p.blur_radius = std::stoi(get_argument_value("-blur-radius", argc, argv));
+	}
+	if (get_argument_flag("-blur-sigma", argc, argv)) {
+		p.blur_sigma = std::stof(get_argument_value("-blur-sigma", argc, argv));
+	}
+	if (get_argument_flag("-verify-mix", argc, argv)) {
+		p.verify_mix = true;
+	}
+	if (get_argument_flag("-verify-tolerance", argc, argv)) {
+		p.verify_tolerance = std::stof(get_argument_value("-verify-tolerance", argc, argv));
+	}
+	if (get_argument_flag("-mem-budget", argc, argv)) {
+		p.mem_budget = parse_bytes(get_argument_value("-mem-budget", argc, argv));
+	}
+	if (get_argument_flag("-format", argc, argv)) {
+		p.output_format = parse_output_format(get_argument_value("-format", argc, argv));
+	}
+	if (get_argument_flag("-png-preset", argc, argv)) {
+		p.png_preset = parse_png_preset(get_argument_value("-png-preset", argc, argv));
+	}
+	if (get_argument_flag("-dds-hrm", argc, argv)) {
+		p.dds_hrm = parse_dds_hrm_format(get_argument_value("-dds-hrm", argc, argv));
+	}
+	p.mips = get_argument_flag("-mips", argc, argv);
+	if (get_argument_flag("-exr-layers", argc, argv)) {
+		p.exr_layers = parse_exr_layers(get_argument_value("-exr-layers", argc, argv));
+	}
+	p.png_bench = get_argument_flag("-png-bench", argc, argv);
+}
+
+
+// One texture set through the whole pipeline. Each job keeps its own maps,
+// so several can run at once on a shared pool, and keeps them between runs
+// so running it again reuses them.
+class TylerJob
+{
+public:
+	TylerParams params;
+	ThreadPool* pool = nullptr;
+	PBRSource* source = nullptr;	// decoded elsewhere and kept, else the job loads its own
+	PBRRowSink* out_rows = nullptr;	// blended rows go here instead of the output files
+	std::function<void(std::string, double)> on_stage;	// name and ms of each finished stage
+
+
+	// Memory the job works in, from the size of its sources.
+	static size_t estimate_bytes(TylerParams& p, unsigned int src_w, unsigned int src_h)
+	{
+		if (p.mem_budget > 0) {
+			return p.mem_budget;
+		}
+		size_t pixels = (size_t)(src_w / 2) * (src_h / 2);
+		return pixels * (JOB_PIXEL_BYTES + (p.mips ? JOB_MIP_PIXEL_BYTES : 0));
+	}
+
+
+	// Runs every stage, 0 when the set went through.
+	int run()
+	{
+		begin_run();
+
+		if (params.mem_budget > 0) {
+			int status = run_tiled();
+			if (status != 0) return status;
+			stage("run_tiled");
+			return bench_output();
+		}
+
+		// Source maps.
+		int status = read_source_maps();
+		if (status != 0) return status;
+		stage("read_source_maps");
+
+		prepare();
+		return render();
+	}
+
+
+	// Runs every variant off one read and split of the source. Variants are
+	// params of the same input that differ only in sharpness, noise, epsilon,
+	// seeds and output. 0 when all went through, a failed variant doesn't
+	// stop the rest.
+	int run_variants(std::vector<TylerParams>& variants)
+	{
+		if (variants.empty()) {
+			return 0;
+		}
+		params = variants[0];
+		begin_run();
+
+		// Tiled runs read the source per tile anyway, nothing to share.
+		bool tiled = params.mem_budget > 0;
+		if (!tiled) {
+			int status = read_source_maps();
+			if (status != 0) return status;
+			stage("read_source_maps");
+			prepare();
+		}
+
+		unsigned int failed = 0U;
+		for (size_t v=0; v<variants.size(); ++v) {
+			params = variants[v];
+			keep_sources = v + 1 < variants.size();
+			OP("Variant begin. [" << v+1 << "/" << variants.size() << "] output=[" << params.output << "]");
+			auto start = std::chrono::steady_clock::now();
+			int status = tiled ? run() : render();
+			if (status != 0) {
+				++failed;
+			}
+			OP("Variant end. status=[" << status << "] ms=[" << ms_since(start) << "]");
+		}
+		keep_sources = false;
+		return failed > 0 ? 1 : 0;
+	}
+
+private:
+	MapTools mt;
+	unsigned int src_w = 0U;
+	unsigned int src_h = 0U;
+	unsigned int w;
+	unsigned int h;
+	std::chrono::steady_clock::time_point stage_start;
+	bool keep_sources = false;	// more variants to render from them
+
+	PBRSource src;
+
+	// Working sources are views into quadrants of src.
+	PBRView base;
+	std::vector<float> fac_base;
+
+	PBRView sc1;
+	std::vector<float> fac_sc1;
+
+	PBRView sc2;
+	std::vector<float> fac_sc2;
+
+	PBRView sc3;
+	std::vector<float> fac_sc3;
+
+	// Blended output goes straight into the output files.
+	PBROutputSink out_maps;
+
+	// Mip level 1, made as level 0 is blended.
+	PBRMap level1;
+
+	// We can get away with a single map cause no overlap.
+	PBRMap corners;
+	std::vector<float> fac_corners;
+
+	// All edges to be blended here.
+	PBRMap edges;
+	std::vector<float> fac_edges;
+
+	// No need for ud, copy those straight to edges map.
+	PBRMap edges_lr;
+	std::vector<float> fac_edges_lr;
+
+	// Chunk moves of the pixels above, replayed on the factors.
+	struct ChunkMove
+	{
+		std::vector<float>* src_f;
+		std::vector<float>* dst_f;
+		Rect2 from;
+		Vec2 to;
+	};
+	std::vector<ChunkMove> moves;
+
+
+	void begin_run()
+	{
+		mt = MapTools();
+		mt.pool = pool;
+		mt.verify_mix = params.verify_mix;
+		mt.verify_tolerance = params.verify_tolerance;
+		setup_blur();
+		stage_start = std::chrono::steady_clock::now();
+	}
+
+
+	// Stages that only depend on the source.
+	void prepare()
+	{
+		reserve_maps();
+		split_sources();
+		copy_corners();
+		copy_edges();
+		stage("split");
+	}
+
+
+	// Stages that depend on the settings, through to the saved output.
+	int render()
+	{
+		mt.hnf = params.height_noise_factor;
+		mt.he = params.height_epsilon;
+		mt.mix_failed = false;
+		create_influence_maps();
+		apply_height_noise();
+		copy_factors();
+		stage("influence");
+		int status = out_rows ? 0 : open_output();
+		if (status != 0) return status;
+
+		apply_seams_fix();
+		stage("blend");
+		if (out_rows) {
+			return mt.mix_failed ? 1 : 0;
+		}
+		status = write_mip_chain();
+		if (status != 0) return status;
+		stage("mips");
+
+		// Save.
+		status = save_output();
+		if (status != 0) return status;
+		stage("save");
+		status = bench_output();
+		if (status != 0) return status;
+
+		// The output is still written so it can be looked at.
+		return mt.mix_failed ? 1 : 0;
+	}
+
+
+	void stage(const char* name)
+	{
+		if (on_stage) {
+			on_stage(name, ms_since(stage_start));
+		}
+		stage_start = std::chrono::steady_clock::now();
+	}
+
+
+	PBRSource& source_maps()
+	{
+		return source ? *source : src;
+	}
+
+
+	void setup_blur()
+	{
+		mt.blur_kernel = BlurKernel(
+			params.blur_radius,
+			params.blur_sigma > 0.f ? params.blur_sigma : 0.415f * params.blur_radius
+		);
+	}
+
+
+	int read_source_maps()
+	{
+		OP("- Read source maps.");
+
+		try {
+			if (!source) {
+				src.load(params.input, params.use_cache, params.exr_layers, pool);
+			}
+			src_w = source_maps().w;
+			src_h = source_maps().h;
+			w = src_w / 2;
+			h = src_h / 2;
+			mt.src_w = src_w;
+			mt.src_h = src_h;
+			mt.w = w;
+			mt.h = h;
+			OP("w=[" << w << "] h=[" << h << "]");
+		} catch (std::exception e) {
+			OP("Could not load source maps.");
+			return 1;
+		}
+
+		return 0;
+	}
+
+
+	void reserve_maps()
+	{
+		OP("- Reserve maps.");
+		reserve_pbr(corners, w, h);
+		reserve_pbr(edges, w, h);
+		reserve_pbr(edges_lr, w, h);
+	}
+
+
+	void create_influence_maps()
+	{
+		OP("- Create influence maps.");
+		float influence_power = params.influence_power;
+
+		mt.influence_map_base(fac_base, influence_power);
+
+		mt.influence_map_corner(fac_sc1, influence_power);
+		mt.influence_map_edge(fac_sc2, influence_power);
+		mt.influence_map_edge(fac_sc3, influence_power);
+
+		mt.influence_map_empty(fac_corners);
+		mt.influence_map_empty(fac_edges);
+		mt.influence_map_empty(fac_edges_lr);
+	}
+
+
+	void split_sources()
+	{
+		OP("- Split into working sources.");
+		PBRView view = source_maps().view;
+		base = view.window(0, 0);
+		sc1 = view.window(w, 0);
+		sc2 = view.window(0, h);
+		sc3 = view.window(w, h);
+	}
+
+
+	void copy_corners()
+	{
+		OP("- Copy corners to corners temp.");
+		Rect2 src_ul = Rect2(0, 0, w/2, h/2);
+		Rect2 src_ur = Rect2(w/2, 0, w/2, h/2);
+		Rect2 src_dr = Rect2(w/2, h/2, w/2, h/2);
+		Rect2 src_dl = Rect2(0, h/2, w/2, h/2);
+		Vec2 dst_ul = Vec2(0, 0);
+		Vec2 dst_ur = Vec2(w/2, 0);
+		Vec2 dst_dr = Vec2(w/2, h/2);
+		Vec2 dst_dl = Vec2(0, h/2);
+		moves.clear();
+		move_chunk(sc1, corners, fac_sc1, fac_corners, src_dr, dst_ul);
+		move_chunk(sc1, corners, fac_sc1, fac_corners, src_dl, dst_ur);
+		move_chunk(sc1, corners, fac_sc1, fac_corners, src_ul, dst_dr);
+		move_chunk(sc1, corners, fac_sc1, fac_corners, src_ur, dst_dl);
+	}
+
+
+	void copy_edges()
+	{
+		OP("- Copy edges to u,d edge temp.");
+		Rect2 src_u = Rect2(0, 0, w, h/2);
+		Rect2 src_d = Rect2(0, h/2, w, h/2);
+		Rect2 src_l = Rect2(0, 0, w/2, h);
+		Rect2 src_r = Rect2(w/2, 0, w/2, h);
+		Vec2 dst_ul = Vec2(0, 0);
+		Vec2 dst_ur = Vec2(w/2, 0);
+		Vec2 dst_dr = Vec2(w/2, h/2);
+		Vec2 dst_dl = Vec2(0, h/2);
+		move_chunk(sc2, edges, fac_sc2, fac_edges, src_u, dst_dl);
+		move_chunk(sc2, edges, fac_sc2, fac_edges, src_d, dst_ul);
+
+		OP("- Copy edges to l,r temp.");
+		move_chunk(sc3, edges_lr, fac_sc3, fac_edges_lr, src_l, dst_ur);
+		move_chunk(sc3, edges_lr, fac_sc3, fac_edges_lr, src_r, dst_ul);
+	}
+
+
+	void move_chunk(
+		PBRView src,
+		PBRMap& dst,
+		std::vector<float>& src_f,
+		std::vector<float>& dst_f,
+		Rect2 from,
+		Vec2 to
+	)
+	{
+		mt.copy_chunk(src, dst, from, to);
+		moves.push_back({ &src_f, &dst_f, from, to });
+	}
+
+
+	void copy_factors()
+	{
+		OP("- Copy factors along with the chunks.");
+		for (auto& m : moves) {
+			mt.copy_fac_chunk(*m.src_f, *m.dst_f, m.from, m.to);
+		}
+	}
+
+
+	void apply_height_noise()
+	{
+		OP("- Apply height noise.");
+		FastNoiseLite ns;
+		float height_noise_factor = params.height_noise_factor;
+
+		ns = mt.height_noise(params.seeds[0]);
+		mt.apply_fac_noise(fac_base, ns, height_noise_factor);
+		ns = mt.height_noise(params.seeds[1]);
+		mt.apply_fac_noise(fac_sc1, ns, height_noise_factor);
+		ns = mt.height_noise(params.seeds[2]);
+		mt.apply_fac_noise(fac_sc2, ns, height_noise_factor);
+		ns = mt.height_noise(params.seeds[3]);
+		mt.apply_fac_noise(fac_sc3, ns, height_noise_factor);
+	}
+
+
+	void apply_seams_fix()
+	{
+		OP("- Blend edges temp to corner temp.");
+		auto blend = [&](PBRRowSink& sink) {
+			mt.blend_map_4_way(sink,
+				base, PBRView(edges, w), PBRView(edges_lr, w), PBRView(corners, w),
+				fac_base, fac_edges, fac_edges_lr, fac_corners,
+				params.blur
+			);
+		};
+		if (params.mips && !out_rows) {
+			PBRMipSink mips(out_maps, w, h);
+			blend(mips);
+			level1 = std::move(mips.level1);
+		} else {
+			blend(out_rows ? *out_rows : out_maps);
+		}
+		if (!keep_sources) {
+			src.free();
+			free_pbr(corners);
+			free_pbr(edges);
+			free_pbr(edges_lr);
+		}
+	}
+
+
+	int open_output()
+	{
+		OP("- Open output.");
+		try {
+			unsigned int levels = params.mips ? mip_levels(w, h) : 1U;
+			out_maps.open(params.output, w, h, source_maps().opaque, params.output_format, params.png_preset, levels, params.dds_hrm);
+		} catch (std::exception e) {
+			OP("Could not open output maps.");
+			return 1;
+		}
+		return 0;
+	}
+
+
+	int write_mip_chain()
+	{
+		if (out_maps.levels < 2) {
+			return 0;
+		}
+		OP("- Write mips.");
+		try {
+			write_mips(out_maps, level1, std::max(1U, w / 2), std::max(1U, h / 2), mt);
+		} catch (std::exception e) {
+			OP("Could not write mips.");
+			return 1;
+		}
+		return 0;
+	}
+
+
+	int save_output()
+	{
+		OP("- Save output.");
+		try {
+			out_maps.close();
+		} catch (std::exception e) {
+			OP("Could not save output maps.");
+			return 1;
+		}
+		return 0;
+	}
+
+
+	int bench_output()
+	{
+		if (!params.png_bench) {
+			return 0;
+		}
+		if (params.output_format == FORMAT_DDS) {
+			OP("PNG preset bench needs png or qoi output.");
+			return 0;
+		}
+		OP("- Bench png presets.");
+		try {
+			bench_png_presets(params.output, pool);
+		} catch (std::exception e) {
+			OP("PNG preset bench failed.");
+			return 1;
+		}
+		return 0;
+	}
+
+
+	int run_tiled()
+	{
+		OP("- Run tiled, mem budget=[" << params.mem_budget << "]");
+
+		TiledTyler tt;
+		tt.mem_budget = params.mem_budget;
+		tt.influence_power = params.influence_power;
+		tt.height_noise_factor = params.height_noise_factor;
+		for (int i=0; i<4; ++i) {
+			tt.seeds[i] = params.seeds[i];
+		}
+		tt.blur = params.blur;
+		tt.output_format = params.output_format;
+		tt.png_preset = params.png_preset;
+		tt.dds_hrm = params.dds_hrm;
+		tt.mips = params.mips;
+		tt.exr_layers = params.exr_layers;
+		tt.mt = mt;
+		tt.mt.hnf = params.height_noise_factor;
+		tt.mt.he = params.height_epsilon;
+
+		try {
+			tt.run(params.input, params.output);
+		} catch (std::exception e) {
+			OP("Tiled run failed.");
+			return 1;
+		}
+		return tt.mt.mix_failed ? 1 : 0;
+	}
+};
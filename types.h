@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
 
 struct Col3
@@ -61,3 +62,115 @@ public:
 	std::vector<float> hn;
 	std::vector<float> m;
 };
+
+
+// Window into the planes of a wider map, without copying it.
+// Pixel (x, y) of the window is at index idx(x, y) of its planes.
+class PBRView
+{
+public:
+	Col4* d = nullptr;
+	Vec3* n = nullptr;
+	float* r = nullptr;
+	float* h = nullptr;
+	float* m = nullptr;
+	size_t stride = 0;	// pixels per row of the underlying planes
+
+	PBRView() {}
+
+	PBRView(PBRMap& map, size_t _stride)
+		: PBRView(map, 0, 0, _stride) {}
+
+	PBRView(PBRMap& map, size_t x, size_t y, size_t _stride)
+	{
+		size_t offset = y * _stride + x;
+		d = map.d.data() + offset;
+		n = map.n.data() + offset;
+		r = map.r.data() + offset;
+		h = map.h.data() + offset;
+		m = map.m.data() + offset;
+		stride = _stride;
+	}
+
+	inline size_t idx(size_t x, size_t y)
+	{
+		return y * stride + x;
+	}
+
+	// Same planes with the origin moved to (x, y).
+	PBRView window(size_t x, size_t y)
+	{
+		PBRView v = *this;
+		size_t offset = idx(x, y);
+		v.d += offset;
+		v.n += offset;
+		v.r += offset;
+		v.h += offset;
+		v.m += offset;
+		return v;
+	}
+};
+
+
+// Receives an image a band of rows at a time. Bands can come from several
+// threads at once and in any order.
+class PBRRowSink
+{
+public:
+	virtual ~PBRRowSink() {}
+
+	// Rows per band the sink works best with, 0 - any.
+	virtual unsigned int band_rows()
+	{
+		return 0U;
+	}
+
+	// Rows [y0, y1), pixel (x, y) at rows.idx(x, y - y0).
+	virtual void put_rows(unsigned int y0, unsigned int y1, PBRView rows) = 0;
+};
+
+
+// Receives an image of 8-bit pixels a band of rows at a time, rows after
+// each other. Bands can come from several threads at once and in any order.
+class ImageStream
+{
+public:
+	unsigned int w = 0U;
+	unsigned int h = 0U;
+	unsigned int channels = 4U;
+
+	virtual ~ImageStream() {}
+
+	// Rows per band the stream works best with.
+	virtual unsigned int band_rows() = 0;
+
+	// Rows [y0, y1). Errors show when the stream is closed.
+	virtual void put_rows(unsigned int y0, unsigned int y1, const unsigned char* pixels) = 0;
+
+	virtual void close() = 0;
+};
+
+
+// Collects the bands into a whole map of width w.
+class PBRMapSink : public PBRRowSink
+{
+public:
+	PBRMapSink(PBRMap& _dst, unsigned int _w) : dst(_dst), w(_w) {}
+
+	void put_rows(unsigned int y0, unsigned int y1, PBRView rows) override
+	{
+		for (unsigned int y=y0; y<y1; ++y) {
+			size_t i = rows.idx(0, y - y0);
+			size_t o = (size_t)y * w;
+			std::copy(rows.d + i, rows.d + i + w, dst.d.begin() + o);
+			std::copy(rows.n + i, rows.n + i + w, dst.n.begin() + o);
+			std::copy(rows.h + i, rows.h + i + w, dst.h.begin() + o);
+			std::copy(rows.r + i, rows.r + i + w, dst.r.begin() + o);
+			std::copy(rows.m + i, rows.m + i + w, dst.m.begin() + o);
+		}
+	}
+
+private:
+	PBRMap& dst;
+	unsigned int w;
+};
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "loader.h"
+#include "log.h"
+#include "maptools.h"
+#include "pixeltools.h"
+#include "types.h"
+
+
+// ----------------------------------------------------------------------------
+// -verify-index checks the pixel index math past 2^31 and 2^32 elements:
+// MapTools _i and _ii, PBRView windows, copy_planes and the loader's row
+// loops, on a 65536 x 65537 output of a 131072 x 65537 source. The planes
+// are reserved address space only, pages come in where the check touches
+// them, so it runs in a few MB.
+// ----------------------------------------------------------------------------
+
+// Address space of size bytes, usable a window at a time.
+class SparseBuffer
+{
+public:
+	explicit SparseBuffer(size_t _size) : size(_size)
+	{
+#ifdef _WIN32
+		data = (unsigned char*)VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+		void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		data = p == MAP_FAILED ? nullptr : (unsigned char*)p;
+#endif
+	}
+
+	~SparseBuffer()
+	{
+		if (!data) {
+			return;
+		}
+#ifdef _WIN32
+		VirtualFree(data, 0, MEM_RELEASE);
+#else
+		munmap(data, size);
+#endif
+	}
+
+	SparseBuffer(const SparseBuffer&) = delete;
+	SparseBuffer& operator=(const SparseBuffer&) = delete;
+
+	unsigned char* data = nullptr;
+	size_t size;
+
+	// Makes bytes [offset, offset + bytes) usable, false when it can't.
+	bool touch(size_t offset, size_t bytes)
+	{
+#ifdef _WIN32
+		return VirtualAlloc(data + offset, bytes, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+		return true;
+#endif
+	}
+};
+
+
+// Sparse d, n, h, r, m planes of size pixels.
+struct SparsePlanes
+{
+	SparseBuffer d;
+	SparseBuffer n;
+	SparseBuffer h;
+	SparseBuffer r;
+	SparseBuffer m;
+
+	explicit SparsePlanes(size_t size)
+		: d(size * sizeof(Col4)), n(size * sizeof(Vec3)),
+		h(size * sizeof(float)), r(size * sizeof(float)), m(size * sizeof(float)) {}
+
+	bool ok()
+	{
+		return d.data && n.data && h.data && r.data && m.data;
+	}
+
+	bool touch(size_t i)
+	{
+		return d.touch(i * sizeof(Col4), sizeof(Col4))
+			&& n.touch(i * sizeof(Vec3), sizeof(Vec3))
+			&& h.touch(i * sizeof(float), sizeof(float))
+			&& r.touch(i * sizeof(float), sizeof(float))
+			&& m.touch(i * sizeof(float), sizeof(float));
+	}
+
+	PBRView view(size_t stride)
+	{
+		PBRView v;
+		v.d = (Col4*)d.data;
+		v.n = (Vec3*)n.data;
+		v.h = (float*)h.data;
+		v.r = (float*)r.data;
+		v.m = (float*)m.data;
+		v.stride = stride;
+		return v;
+	}
+};
+
+
+// Loader row loop on pixels [i0, i0 + n) of sparse planes, every value
+// against PixelFormat::unorm of its byte. Fails count.
+inline size_t verify_decode_range(PixelFormat f, uint64_t i0, size_t n, int count, size_t step)
+{
+	uint64_t size = i0 + n;
+	SparseBuffer bytes(size * f.pixel_bytes());
+	std::vector< std::unique_ptr<SparseBuffer> > planes;
+	size_t plane_floats = step == 1 ? size : size * step;
+	int plane_count = step == 1 ? count : 1;
+	for (int c=0; c<plane_count; ++c) {
+		planes.emplace_back(new SparseBuffer(plane_floats * sizeof(float)));
+	}
+
+	size_t fails = 0;
+	bool ok = bytes.data && bytes.touch(i0 * f.pixel_bytes(), n * f.pixel_bytes());
+	for (auto& p : planes) {
+		ok = ok && p->data && p->touch(i0 * step * sizeof(float), n * step * sizeof(float));
+	}
+	if (!ok) {
+		OP("Could not reserve the sparse planes.");
+		fails = 1;
+	} else {
+		unsigned char* px = bytes.data + i0 * f.pixel_bytes();
+		for (size_t b=0; b<n * f.pixel_bytes(); ++b) {
+			px[b] = (unsigned char)(b * 37 + 11);
+		}
+
+		float* out[4];
+		for (int c=0; c<count; ++c) {
+			out[c] = step == 1 ? (float*)planes[c]->data : (float*)planes[0]->data + c;
+		}
+		std::vector<float> values(n * f.channels);
+		decode_pixel_range(bytes.data, f, (size_t)i0, n, false, count, out, step, values.data());
+
+		for (size_t i=0; i<n; ++i)
+		for (int c=0; c<count; ++c) {
+			float v = out[c][(i0 + i) * step];
+			fails += v != f.unorm(px + i * f.pixel_bytes(), c);
+		}
+	}
+	return fails;
+}
+
+
+inline bool verify_index()
+{
+	OP("Verify index begin.");
+	const uint64_t W = 65536;
+	const uint64_t H = 65537;	// W * H past 2^32
+
+	MapTools mt;
+	mt.w = (unsigned int)W;
+	mt.h = (unsigned int)H;
+	mt.src_w = (unsigned int)(2 * W);
+	mt.src_h = (unsigned int)H;
+
+	// Either side of 2^31 and 2^32 elements, and the last pixels.
+	const uint64_t coords[][2] = {
+		{ 0, 0 },
+		{ W - 1, 32767 },
+		{ 0, 32768 },
+		{ 1, 32768 },
+		{ W - 1, 65535 },
+		{ 0, 65536 },
+		{ 7, 65536 },
+		{ W - 1, H - 1 },
+	};
+	const size_t count = sizeof(coords) / sizeof(coords[0]);
+
+	size_t fails = 0;
+	SparsePlanes src((size_t)(2 * W * H));
+	SparsePlanes dst((size_t)(W * H));
+	if (!src.ok() || !dst.ok()) {
+		OP("Could not reserve the sparse planes.");
+		fails = 1;
+	} else {
+		// Right half of the source onto the output, the way the quadrants go.
+		PBRView sv = src.view((size_t)(2 * W));
+		PBRView window = sv.window((size_t)W, 0);
+		PBRView dv = dst.view((size_t)W);
+
+		for (size_t k=0; k<count; ++k) {
+			uint64_t x = coords[k][0];
+			uint64_t y = coords[k][1];
+			uint64_t ref_si = y * 2 * W + x + W;
+			uint64_t ref_di = y * W + x;
+			size_t si = mt._ii((size_t)x, (size_t)y, (size_t)W, 0);
+			size_t di = mt._i((size_t)x, (size_t)y);
+			fails += si != ref_si;
+			fails += di != ref_di;
+			fails += window.idx((size_t)x, (size_t)y) + (size_t)W != si;
+			if (!src.touch(si) || !dst.touch(di)) {
+				OP("Could not commit the sparse planes.");
+				return false;
+			}
+
+			float v = (float)(k + 1);
+			sv.d[si] = Col4{ v, v + 0.25f, v + 0.5f, v + 0.75f };
+			sv.n[si] = Vec3{ -v, v, -v };
+			sv.h[si] = v;
+			sv.r[si] = 2.f * v;
+			sv.m[si] = 3.f * v;
+			copy_planes(sv, dv, si, di);
+		}
+
+		// After all writes, so two coordinates landing on one index fail.
+		for (size_t k=0; k<count; ++k) {
+			uint64_t x = coords[k][0];
+			uint64_t y = coords[k][1];
+			size_t ref_di = (size_t)(y * W + x);
+			float v = (float)(k + 1);
+			fails += ((Col4*)dst.d.data)[ref_di].a != v + 0.75f;
+			fails += ((Vec3*)dst.n.data)[ref_di].y != v;
+			fails += ((float*)dst.h.data)[ref_di] != v;
+			fails += ((float*)dst.r.data)[ref_di] != 2.f * v;
+			fails += ((float*)dst.m.data)[ref_di] != 3.f * v;
+			fails += window.h[window.idx((size_t)x, (size_t)y)] != v;
+		}
+	}
+	OP("MapTools and view indices failed=[" << fails << "]");
+
+	// Loader row loops: 8-bit rgb into interleaved Col4s, 16-bit into
+	// planes, across 2^31 and 2^32 pixels.
+	size_t loader_fails = 0;
+	PixelFormat rgb8;
+	rgb8.channels = 3;
+	rgb8.bitdepth = 8;
+	PixelFormat rgb16;
+	rgb16.channels = 3;
+	rgb16.bitdepth = 16;
+	loader_fails += verify_decode_range(rgb8, ((uint64_t)1 << 31) - 5, 16, 4, 4);
+	loader_fails += verify_decode_range(rgb8, ((uint64_t)1 << 32) - 5, 16, 4, 4);
+	loader_fails += verify_decode_range(rgb16, ((uint64_t)1 << 32) - 5, 16, 3, 1);
+	OP("Loader row loops failed=[" << loader_fails << "]");
+
+	bool passed = fails == 0 && loader_fails == 0;
+	if (passed) {
+		OP("Verify index passed.");
+	} else {
+		OP("Verify index FAILED.");
+	}
+	OP("Verify index end.");
+	return passed;
+}